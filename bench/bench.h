@@ -0,0 +1,28 @@
+/******************************************************************************
+ * bench.h
+ * -------
+ * Helpers shared by the microbenchmarks: a clock, and a count of the memory
+ * allocations made. Benchmarks are linked with -Wl,--wrap for malloc(),
+ * calloc() and realloc() (see BENCH_LDFLAGS in the Makefile), so every
+ * allocation made by the code under test goes through bench.c and is counted.
+ *
+ *****************************************************************************/
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <time.h>
+
+/** Number of allocations made so far. */
+extern unsigned long bench_allocs;
+
+/**
+ * Returns the current time in nanoseconds.
+ */
+static inline long long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+#endif /* BENCH_H */
@@ -0,0 +1,59 @@
+/******************************************************************************
+ * bench_cksum.c
+ * -------------
+ * Microbenchmark for cksum(), which every segment sent and received goes
+ * through, over buffers from a bare header up to the largest a segment can
+ * be.
+ *
+ * To run, do the following:
+ *     make bench
+ *     ./bench/bench_cksum
+ *
+ *****************************************************************************/
+
+#include "../ctcp_utils.h"
+#include "bench.h"
+
+/** Bytes checksummed for each size. Smaller sizes get more calls. */
+#define NUM_BYTES (1LL << 28)
+
+/** Keeps the compiler from optimizing away checksums. */
+static volatile uint16_t sink;
+
+/**
+ * Runs the benchmark with a given buffer size.
+ *
+ * size: Bytes to checksum.
+ */
+static void bench(int size) {
+  char *buf = malloc(size);
+  long long calls = NUM_BYTES / size, start, ns, i;
+  unsigned long allocs;
+
+  for (i = 0; i < size; i++)
+    buf[i] = rand();
+
+  allocs = bench_allocs;
+  start = now_ns();
+  for (i = 0; i < calls; i++) {
+    /* Vary the data a little so each call does the same work as a new one. */
+    buf[0] = i;
+    sink = cksum(buf, size);
+  }
+  ns = now_ns() - start;
+  allocs = bench_allocs - allocs;
+
+  printf("%10d %12.1f %12.2f %12.2f\n", size, (double) ns / calls,
+         (double) size * calls / ns, (double) allocs / calls);
+  free(buf);
+}
+
+int main() {
+  int sizes[] = { 16, 64, 256, 1024, 1440, 4096, 16384, 65535 };
+  unsigned int i;
+
+  printf("%10s %12s %12s %12s\n", "bytes", "ns/op", "GB/s", "allocs/op");
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    bench(sizes[i]);
+  return 0;
+}
@@ -0,0 +1,101 @@
+/******************************************************************************
+ * bench_demux.c
+ * -------------
+ * Microbenchmark for connection demultiplexing: finding the connection an
+ * incoming packet belongs to, given the sender's IP address and port.
+ *
+ * Compares the connection table's hash index (ct_find(), used by
+ * recv_filter()) against walking a linked list of every connection, which is
+ * what recv_filter() used to do. Lookups are spread evenly over all
+ * connections.
+ *
+ * To run, do the following:
+ *     make bench
+ *     ./bench/bench_demux
+ *
+ *****************************************************************************/
+
+#include "../ctcp_conn_table.h"
+#include "bench.h"
+
+/** Total number of lookups done for each connection count. */
+#define NUM_LOOKUPS 2000000
+
+/** Connection details compared by the old recv_filter() loop. */
+struct fake_conn {
+  in_addr_t ip_addr;
+  int port;
+  struct fake_conn *next;
+};
+
+/** Keeps the compiler from optimizing away lookups. */
+static volatile void *sink;
+
+
+/**
+ * Runs the benchmark with a given number of connections.
+ *
+ * num_conns: Number of connections.
+ */
+static void bench(int num_conns) {
+  struct fake_conn *conns = calloc(sizeof(struct fake_conn), num_conns);
+  struct fake_conn *list = NULL;
+  conn_table_t *table = ct_create(0);
+  long long start, hash_ns, list_ns;
+  unsigned long allocs;
+  int i, next;
+
+  /* Clients on the same host, as with Unix sockets. */
+  for (i = 0; i < num_conns; i++) {
+    conns[i].ip_addr = htonl(0x0a000001 + i / 1000);
+    conns[i].port = 10000 + i;
+    conns[i].next = list;
+    list = &conns[i];
+    ct_add(table, conns[i].ip_addr, conns[i].port, &conns[i]);
+  }
+
+  /* Hash index. */
+  allocs = bench_allocs;
+  start = now_ns();
+  for (i = 0, next = 0; i < NUM_LOOKUPS; i++) {
+    struct fake_conn *key = &conns[next];
+    next = (next + 7919) % num_conns;
+    sink = ct_find(table, key->ip_addr, key->port);
+  }
+  hash_ns = now_ns() - start;
+  allocs = bench_allocs - allocs;
+
+  /* Linear walk. Fewer lookups for large counts so this finishes quickly. */
+  int list_lookups = num_conns > 100 ? NUM_LOOKUPS / (num_conns / 100)
+                                     : NUM_LOOKUPS;
+  start = now_ns();
+  for (i = 0, next = 0; i < list_lookups; i++) {
+    struct fake_conn *key = &conns[next];
+    struct fake_conn *conn;
+    next = (next + 7919) % num_conns;
+    for (conn = list; conn != NULL; conn = conn->next) {
+      if (conn->port == key->port && conn->ip_addr == key->ip_addr)
+        break;
+    }
+    sink = conn;
+  }
+  list_ns = now_ns() - start;
+
+  printf("%12d %14.1f %14.2f %14.1f\n", num_conns,
+         (double) hash_ns / NUM_LOOKUPS, (double) allocs / NUM_LOOKUPS,
+         (double) list_ns / list_lookups);
+
+  ct_destroy(table);
+  free(conns);
+}
+
+int main() {
+  int counts[] = { 1, 10, 100, 1000, 10000, 100000 };
+  unsigned int i;
+
+  printf("%12s %14s %14s %14s\n", "connections", "hash ns/op",
+         "hash allocs/op", "list ns/op");
+  for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++)
+    bench(counts[i]);
+  return 0;
+}
@@ -0,0 +1,109 @@
+/******************************************************************************
+ * bench_list.c
+ * ------------
+ * Microbenchmark for the linked list, which holds each connection's unacked
+ * segments and segments waiting to be output. Times adding to the back and
+ * the front, finding an object, and removing from the front, for lists of
+ * several lengths.
+ *
+ * To run, do the following:
+ *     make bench
+ *     ./bench/bench_list
+ *
+ *****************************************************************************/
+
+#include "../ctcp_linked_list.h"
+#include "bench.h"
+
+/** Total number of operations of each kind done for each list length. */
+#define NUM_OPS 1000000
+
+/** Keeps the compiler from optimizing away lookups. */
+static volatile void *sink;
+
+/** When the current measurement started. */
+static long long start_ns;
+static unsigned long start_allocs;
+
+static void start() {
+  start_allocs = bench_allocs;
+  start_ns = now_ns();
+}
+
+/**
+ * Prints the time and allocations taken since start().
+ *
+ * name: Name of the operation.
+ * length: Length of the lists.
+ * ops: Number of operations done.
+ */
+static void stop(const char *name, int length, long long ops) {
+  long long ns = now_ns() - start_ns;
+  unsigned long allocs = bench_allocs - start_allocs;
+
+  printf("%-10s %8d %12.1f %12.2f\n", name, length, (double) ns / ops,
+         (double) allocs / ops);
+}
+
+/**
+ * Runs the benchmark with a given list length. Operations are spread over
+ * enough lists of that length to make NUM_OPS of them, so short lists are
+ * timed without reading the clock for each one.
+ *
+ * length: Number of objects in each list.
+ */
+static void bench(int length) {
+  int num_lists = NUM_OPS / length;
+  long long ops = (long long) num_lists * length;
+  linked_list_t **lists = malloc(num_lists * sizeof(linked_list_t *));
+  int *objects = malloc(length * sizeof(int));
+  int i, j;
+
+  for (i = 0; i < num_lists; i++)
+    lists[i] = ll_create();
+
+  start();
+  for (i = 0; i < num_lists; i++) {
+    for (j = 0; j < length; j++)
+      ll_add(lists[i], &objects[j]);
+  }
+  stop("add", length, ops);
+
+  /* Look up objects spread evenly over a list. */
+  int lookups = length > 100 ? NUM_OPS / (length / 100) : NUM_OPS;
+  start();
+  for (i = 0, j = 0; i < lookups; i++) {
+    sink = ll_find(lists[i % num_lists], &objects[j]);
+    j = (j + 7919) % length;
+  }
+  stop("find", length, lookups);
+
+  start();
+  for (i = 0; i < num_lists; i++) {
+    for (j = 0; j < length; j++)
+      ll_remove(lists[i], ll_front(lists[i]));
+  }
+  stop("remove", length, ops);
+
+  start();
+  for (i = 0; i < num_lists; i++) {
+    for (j = 0; j < length; j++)
+      ll_add_front(lists[i], &objects[j]);
+  }
+  stop("add_front", length, ops);
+
+  for (i = 0; i < num_lists; i++)
+    ll_destroy(lists[i]);
+  free(lists);
+  free(objects);
+}
+
+int main() {
+  int lengths[] = { 1, 10, 100, 1000 };
+  unsigned int i;
+
+  printf("%-10s %8s %12s %12s\n", "operation", "length", "ns/op", "allocs/op");
+  for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++)
+    bench(lengths[i]);
+  return 0;
+}
@@ -0,0 +1,223 @@
+/******************************************************************************
+ * bench_reassembly.c
+ * ------------------
+ * Microbenchmark for receiving data segments: ctcp_receive() checking them,
+ * putting them back in order and outputting them. The segments arrive in
+ * batches that fit in the receive window, in order, reversed, or shuffled.
+ * Each is timed both with the list of segments waiting to be output and with
+ * direct output (see conn_output_direct()), where the data goes straight to
+ * its place in the output.
+ *
+ * ctcp.c is linked against stubs for the conn_*() functions, so only the
+ * protocol's own work is timed. Building each segment is not.
+ *
+ * To run, do the following:
+ *     make bench
+ *     ./bench/bench_reassembly
+ *
+ *****************************************************************************/
+
+#include "../ctcp.h"
+#include "../ctcp_utils.h"
+#include "bench.h"
+
+/** Segments in each batch. The receive window holds exactly one batch. */
+#define BATCH 64
+
+/** Total number of segments received for each arrival order. */
+#define NUM_SEGMENTS 256000
+
+/** Data bytes in each segment. */
+#define SEGMENT_DATA 1000
+
+/** Stub connection. Keeps track of what would have been output. */
+struct conn {
+  bool direct;                 /* Whether to use direct output */
+  uint64_t output;             /* Data bytes output so far */
+  bool output_later;           /* ctcp_output() is to be called */
+};
+
+/* The conn_*() functions ctcp.c uses to receive. */
+
+int conn_output(conn_t *conn, const char *buf, size_t len) {
+  conn->output += len;
+  return len;
+}
+
+int conn_output_at(conn_t *conn, uint32_t offset, const char *buf,
+                   size_t len) {
+  conn->output += len;
+  return len;
+}
+
+int conn_outputv(conn_t *conn, const struct iovec *iov, int iovcnt) {
+  size_t len = 0;
+  int i;
+  for (i = 0; i < iovcnt; i++)
+    len += iov[i].iov_len;
+  conn->output += len;
+  return len;
+}
+
+void conn_output_later(conn_t *conn) {
+  conn->output_later = true;
+}
+
+size_t conn_bufspace(conn_t *conn) {
+  return SIZE_MAX;
+}
+
+bool conn_output_direct(conn_t *conn) {
+  return conn->direct;
+}
+
+int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len) {
+  return len;
+}
+
+void conn_count(conn_t *conn, conn_event_t event) {
+}
+
+void conn_time(conn_t *conn, conn_timing_t timing, uint64_t usec) {
+}
+
+/* The rest are only used to send, and are never called. */
+
+int conn_inputv(conn_t *conn, const struct iovec *iov, int iovcnt) {
+  abort();
+}
+
+int conn_sendv(conn_t *conn, ctcp_segment_t *segment, const void *data,
+               size_t data_len) {
+  abort();
+}
+
+const char *conn_input_map(conn_t *conn, size_t *len) {
+  abort();
+}
+
+bool conn_input_broadcast(conn_t *conn) {
+  abort();
+}
+
+int conn_input_shared(conn_t *conn, size_t len, shared_buf_t **buf,
+                      const char **data) {
+  abort();
+}
+
+void conn_flight_dump(conn_t *conn, const char *reason) {
+  abort();
+}
+
+void conn_remove(conn_t *conn) {
+}
+
+void end_client() {
+}
+
+/** Orders in which each batch of segments arrives. */
+enum order { IN_ORDER, REVERSED, SHUFFLED };
+
+/**
+ * Makes a data segment, as it would arrive from the network.
+ *
+ * seqno: Sequence number of its first byte.
+ * data: Data, SEGMENT_DATA bytes.
+ */
+static ctcp_segment_t *make_segment(uint32_t seqno, const char *data) {
+  uint16_t len = sizeof(ctcp_segment_t) + SEGMENT_DATA;
+  ctcp_segment_t *segment = malloc(len);
+
+  memset(segment, 0, sizeof(ctcp_segment_t));
+  segment->seqno = htonl(seqno);
+  segment->ackno = htonl(1);
+  segment->len = htons(len);
+  segment->flags = TH_ACK;
+  segment->window = htons(0xffff);
+  memcpy(segment->data, data, SEGMENT_DATA);
+  segment->cksum = cksum(segment, len);
+  return segment;
+}
+
+/**
+ * Receives NUM_SEGMENTS segments in a given order and prints how long each
+ * took.
+ *
+ * order: Order in which each batch arrives.
+ * direct: Whether to use direct output.
+ */
+static void bench(enum order order, bool direct) {
+  static const char *order_names[] = { "in-order", "reversed", "shuffled" };
+  struct conn conn = { direct, 0 };
+  ctcp_config_t *cfg = calloc(1, sizeof(ctcp_config_t));
+  ctcp_segment_t *segments[BATCH];
+  char data[SEGMENT_DATA];
+  long long ns = 0, start;
+  unsigned long allocs = 0, before;
+  uint32_t seqno = 1;
+  int batch, i, j;
+
+  memset(data, 'x', sizeof(data));
+  cfg->recv_window = BATCH * SEGMENT_DATA;
+  cfg->send_window = BATCH * SEGMENT_DATA;
+  cfg->timer = 40;
+  cfg->rt_timeout = 200;
+  cfg->mss = SEGMENT_DATA;
+  ctcp_state_t *state = ctcp_init(&conn, cfg);
+
+  srand(1);
+  for (batch = 0; batch < NUM_SEGMENTS / BATCH; batch++) {
+    for (i = 0; i < BATCH; i++)
+      segments[i] = make_segment(seqno + i * SEGMENT_DATA, data);
+    seqno += BATCH * SEGMENT_DATA;
+
+    if (order == REVERSED) {
+      for (i = 0; i < BATCH / 2; i++) {
+        ctcp_segment_t *tmp = segments[i];
+        segments[i] = segments[BATCH - 1 - i];
+        segments[BATCH - 1 - i] = tmp;
+      }
+    } else if (order == SHUFFLED) {
+      for (i = BATCH - 1; i > 0; i--) {
+        ctcp_segment_t *tmp = segments[i];
+        j = rand() % (i + 1);
+        segments[i] = segments[j];
+        segments[j] = tmp;
+      }
+    }
+
+    before = bench_allocs;
+    start = now_ns();
+    for (i = 0; i < BATCH; i++) {
+      ctcp_receive(state, segments[i],
+                   sizeof(ctcp_segment_t) + SEGMENT_DATA);
+      /* As the library does once it has handled a batch of events, taking
+         each segment as its own batch. */
+      if (conn.output_later) {
+        conn.output_later = false;
+        ctcp_output(state);
+      }
+    }
+    ns += now_ns() - start;
+    allocs += bench_allocs - before;
+  }
+
+  if (conn.output != (uint64_t) NUM_SEGMENTS / BATCH * BATCH * SEGMENT_DATA)
+    fprintf(stderr, "bench_reassembly: only %llu bytes were output\n",
+            (unsigned long long) conn.output);
+  printf("%-10s %-8s %12.1f %12.2f\n", order_names[order],
+         direct ? "direct" : "list", (double) ns / NUM_SEGMENTS,
+         (double) allocs / NUM_SEGMENTS);
+  ctcp_destroy(state);
+}
+
+int main() {
+  enum order order;
+
+  printf("%-10s %-8s %12s %12s\n", "order", "output", "ns/op", "allocs/op");
+  for (order = IN_ORDER; order <= SHUFFLED; order++) {
+    bench(order, false);
+    bench(order, true);
+  }
+  return 0;
+}
@@ -0,0 +1,37 @@
+/******************************************************************************
+ * echo.c
+ * ------
+ * Echo service for the server's program mode. Writes everything it reads
+ * back out as soon as it is read, without buffering, so the time a message
+ * takes to come back is the time ctcp takes to carry it both ways. Used by
+ * bench/pingpong.
+ *
+ * To run, do the following:
+ *     make bench
+ *     ./ctcp -s -p [server port] -- ./bench/echo
+ *
+ *****************************************************************************/
+
+#include <errno.h>
+#include <unistd.h>
+
+int main() {
+  char buf[65536];
+  ssize_t r, w, done;
+
+  while ((r = read(STDIN_FILENO, buf, sizeof(buf))) != 0) {
+    if (r < 0) {
+      if (errno == EINTR)
+        continue;
+      return 1;
+    }
+    for (done = 0; done < r; done += w) {
+      w = write(STDOUT_FILENO, buf + done, r - done);
+      if (w < 0 && errno == EINTR)
+        w = 0;
+      else if (w < 0)
+        return 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,446 @@
+/******************************************************************************
+ * pingpong.c
+ * ----------
+ * Request/response latency benchmark. Starts a server that runs bench/echo
+ * for each connection, and clients that each send a message, wait for all of
+ * it to come back, and send the next one. Prints the round-trip latency
+ * percentiles for each number of concurrent clients and message size, so
+ * changes to when segments and acks are sent (Nagle, delayed acks, timers)
+ * can be compared.
+ *
+ * Usage:
+ *     ./bench/pingpong [-n messages] [-s sizes] [-c clients] [-- args...]
+ *
+ *   -n messages  Messages timed per client for each size (default 1000).
+ *                WARMUP more are sent first and not timed.
+ *   -s sizes     Message sizes in bytes, comma-separated (default
+ *                1,64,1024,8192)
+ *   -c clients   Numbers of concurrent clients, comma-separated (default
+ *                1,4,16)
+ *   args         More arguments for the server and the clients, e.g.
+ *                "-w 8 --io-uring"
+ *
+ * To run, do the following from the top directory:
+ *     make ctcp bench
+ *     ./bench/pingpong
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "bench.h"
+
+/** Messages each client sends before the timed ones, so that connection
+    set-up does not count. */
+#define WARMUP 10
+
+/** Most sizes or client counts that can be given. */
+#define MAX_LIST 32
+
+/** Most clients at the same time. */
+#define MAX_CLIENTS 256
+
+/** Most arguments passed on to ctcp. */
+#define MAX_ARGS 64
+
+/** How long to wait for any reply before giving up, in ms. */
+#define REPLY_TIMEOUT 30000
+
+/** A client and the message it has in flight. */
+struct client {
+  pid_t pid;
+  int in;                      /* Write end of its STDIN */
+  int out;                     /* Read end of its STDOUT */
+  size_t sent;                 /* Bytes of the message written so far */
+  size_t received;             /* Bytes of the message read back so far */
+  long long start;             /* When the message was first written, in ns */
+  int done;                    /* Messages that came back, including warm-up
+                                  ones */
+};
+
+/** Arguments from the command line for both the server and the clients. */
+static char **extra_args;
+static int num_extra_args;
+
+/**
+ * Parses a comma-separated list of positive numbers.
+ *
+ * str: The list.
+ * list: Where to store the numbers, at most MAX_LIST.
+ * returns: How many numbers there are, or -1 if the list is not valid.
+ */
+static int parse_list(char *str, int *list) {
+  char *item, *end;
+  int n = 0;
+
+  for (item = strtok(str, ","); item != NULL; item = strtok(NULL, ",")) {
+    if (n == MAX_LIST)
+      return -1;
+    list[n] = strtol(item, &end, 10);
+    if (*end != '\0' || list[n] <= 0)
+      return -1;
+    n++;
+  }
+  return n > 0 ? n : -1;
+}
+
+/**
+ * Starts ctcp with the given arguments followed by the extra ones, with
+ * pipes to its STDIN and from its STDOUT. Its STDERR is thrown away, unless
+ * 'err' is given.
+ *
+ * args: Arguments, NULL-terminated, not including the program name.
+ * tail: Arguments to put after the extra ones, NULL-terminated.
+ * in: Set to the write end of its STDIN.
+ * out: Set to the read end of its STDOUT.
+ * err: If not NULL, set to the read end of its STDERR.
+ * returns: The process ID.
+ */
+static pid_t start_ctcp(char **args, char **tail, int *in, int *out,
+                        int *err) {
+  char *argv[MAX_ARGS + 16];
+  int to_child[2], from_child[2], err_child[2];
+  int argc = 0, i;
+  pid_t pid;
+
+  argv[argc++] = "./ctcp";
+  for (i = 0; args[i] != NULL; i++)
+    argv[argc++] = args[i];
+  for (i = 0; i < num_extra_args; i++)
+    argv[argc++] = extra_args[i];
+  for (i = 0; tail[i] != NULL; i++)
+    argv[argc++] = tail[i];
+  argv[argc] = NULL;
+
+  if (pipe2(to_child, O_CLOEXEC) < 0 || pipe2(from_child, O_CLOEXEC) < 0 ||
+      (err != NULL && pipe2(err_child, O_CLOEXEC) < 0)) {
+    perror("pipe");
+    exit(EXIT_FAILURE);
+  }
+  pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    exit(EXIT_FAILURE);
+  }
+  if (pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(to_child[0], STDIN_FILENO);
+    dup2(from_child[1], STDOUT_FILENO);
+    dup2(err != NULL ? err_child[1] : null, STDERR_FILENO);
+    execv(argv[0], argv);
+    _exit(127);
+  }
+  close(to_child[0]);
+  close(from_child[1]);
+  if (err != NULL) {
+    close(err_child[1]);
+    *err = err_child[0];
+  }
+  fcntl(to_child[1], F_SETFL, O_NONBLOCK);
+  fcntl(from_child[0], F_SETFL, O_NONBLOCK);
+  *in = to_child[1];
+  *out = from_child[0];
+  return pid;
+}
+
+/**
+ * Waits for the server to say it has started, which it does once it has
+ * finished cleaning up old connections and takes clients. What it writes to
+ * STDERR afterwards is read and thrown away by a child process, so it never
+ * blocks on it.
+ *
+ * err: Read end of the server's STDERR. Closed by this.
+ * returns: The process ID of the child, or -1 if the server stopped first.
+ */
+static pid_t wait_started(int err) {
+  char line[256];
+  size_t len = 0;
+  pid_t pid;
+  char c;
+
+  for (;;) {
+    if (read(err, &c, 1) <= 0) {
+      close(err);
+      return -1;
+    }
+    if (c != '\n') {
+      if (len < sizeof(line) - 1)
+        line[len++] = c;
+      continue;
+    }
+    line[len] = '\0';
+    len = 0;
+    if (strstr(line, "Server started") != NULL)
+      break;
+  }
+
+  pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    exit(EXIT_FAILURE);
+  }
+  if (pid == 0) {
+    while (read(err, line, sizeof(line)) > 0)
+      ;
+    _exit(0);
+  }
+  close(err);
+  return pid;
+}
+
+/**
+ * Stops a ctcp process and closes its pipes.
+ */
+static void stop_ctcp(pid_t pid, int in, int out) {
+  close(in);
+  close(out);
+  kill(pid, SIGTERM);
+  waitpid(pid, NULL, 0);
+}
+
+static int compare_latency(const void *a, const void *b) {
+  long long x = *(const long long *) a, y = *(const long long *) b;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * Returns a percentile of sorted latencies, in microseconds.
+ *
+ * latencies: The latencies, in ns, in increasing order.
+ * n: Number of latencies.
+ * per_mille: Which percentile, in thousandths (e.g. 999 for p99.9).
+ */
+static double percentile(long long *latencies, size_t n, int per_mille) {
+  size_t i = (n * per_mille + 999) / 1000;
+  return latencies[i > 0 ? i - 1 : 0] / 1000.0;
+}
+
+/**
+ * Has each client send messages of one size until it has sent WARMUP +
+ * num_messages of them, all at the same time, and records how long the timed
+ * ones took to come back.
+ *
+ * clients: The clients.
+ * num_clients: Number of clients.
+ * msg: The message to send.
+ * size: Its size.
+ * num_messages: Messages timed per client.
+ * latencies: Filled with num_clients * num_messages round-trip times, in ns.
+ * returns: 0 on success, -1 if a client stopped or took too long to reply.
+ */
+static int run_round(struct client *clients, int num_clients, const char *msg,
+                     size_t size, int num_messages, long long *latencies) {
+  struct pollfd fds[2 * MAX_CLIENTS];
+  char buf[65536];
+  size_t num_latencies = 0;
+  int remaining = num_clients;
+  int i;
+
+  for (i = 0; i < num_clients; i++) {
+    clients[i].sent = clients[i].received = 0;
+    clients[i].done = 0;
+    clients[i].start = now_ns();
+  }
+
+  while (remaining > 0) {
+    for (i = 0; i < num_clients; i++) {
+      struct client *c = &clients[i];
+      bool active = c->done < WARMUP + num_messages;
+      fds[2 * i].fd = c->in;
+      fds[2 * i].events = active && c->sent < size ? POLLOUT : 0;
+      fds[2 * i + 1].fd = c->out;
+      fds[2 * i + 1].events = active ? POLLIN : 0;
+    }
+    int r = poll(fds, 2 * num_clients, REPLY_TIMEOUT);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0) {
+      fprintf(stderr, "pingpong: no reply for %d s\n", REPLY_TIMEOUT / 1000);
+      return -1;
+    }
+
+    for (i = 0; i < num_clients; i++) {
+      struct client *c = &clients[i];
+      ssize_t n;
+
+      if (c->done == WARMUP + num_messages)
+        continue;
+      if (fds[2 * i].revents & (POLLOUT | POLLERR)) {
+        n = write(c->in, msg + c->sent, size - c->sent);
+        if (n < 0 && errno != EAGAIN) {
+          fprintf(stderr, "pingpong: client %d stopped\n", i);
+          return -1;
+        }
+        if (n > 0)
+          c->sent += n;
+      }
+
+      if (!(fds[2 * i + 1].revents & (POLLIN | POLLHUP | POLLERR)))
+        continue;
+      n = read(c->out, buf, sizeof(buf));
+      if (n < 0 && errno == EAGAIN)
+        continue;
+      if (n <= 0) {
+        fprintf(stderr, "pingpong: client %d stopped\n", i);
+        return -1;
+      }
+      if (c->received + n > c->sent ||
+          memcmp(buf, msg + c->received, n) != 0) {
+        fprintf(stderr, "pingpong: client %d got back the wrong data\n", i);
+        return -1;
+      }
+      c->received += n;
+      if (c->received < size)
+        continue;
+
+      /* The whole message is back. Send the next one. */
+      long long end = now_ns();
+      if (c->done++ >= WARMUP)
+        latencies[num_latencies++] = end - c->start;
+      c->sent = c->received = 0;
+      c->start = end;
+      if (c->done == WARMUP + num_messages)
+        remaining--;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Starts a server and some clients, runs a round with each message size, and
+ * prints the latencies.
+ *
+ * num_clients: Number of clients.
+ * sizes: Message sizes.
+ * num_sizes: Number of message sizes.
+ * num_messages: Messages timed per client for each size.
+ * returns: 0 on success, -1 on failure.
+ */
+static int run_level(int num_clients, int *sizes, int num_sizes,
+                     int num_messages) {
+  struct client clients[MAX_CLIENTS];
+  char port[16], client_ports[MAX_CLIENTS][16], server[32];
+  int port_num = 20000 + rand() % 20000;
+  int server_in, server_out, server_err;
+  pid_t server_pid, drain_pid;
+  int i, result = 0;
+
+  snprintf(port, sizeof(port), "%d", port_num);
+  snprintf(server, sizeof(server), "localhost:%d", port_num);
+  char *server_args[] = { "-s", "-p", port, NULL };
+  char *server_tail[] = { "--", "./bench/echo", NULL };
+  server_pid = start_ctcp(server_args, server_tail, &server_in, &server_out,
+                          &server_err);
+  drain_pid = wait_started(server_err);
+  if (drain_pid < 0) {
+    fprintf(stderr, "pingpong: the server did not start\n");
+    stop_ctcp(server_pid, server_in, server_out);
+    return -1;
+  }
+
+  for (i = 0; i < num_clients; i++) {
+    snprintf(client_ports[i], sizeof(client_ports[i]), "%d", port_num + 1 + i);
+    char *client_args[] = { "-p", client_ports[i], "-c", server, NULL };
+    char *client_tail[] = { NULL };
+    clients[i].pid = start_ctcp(client_args, client_tail, &clients[i].in,
+                                &clients[i].out, NULL);
+  }
+
+  for (i = 0; i < num_sizes && result == 0; i++) {
+    size_t n = (size_t) num_clients * num_messages;
+    long long *latencies = malloc(n * sizeof(long long));
+    char *msg = malloc(sizes[i]);
+    int j;
+
+    for (j = 0; j < sizes[i]; j++)
+      msg[j] = rand();
+    result = run_round(clients, num_clients, msg, sizes[i], num_messages,
+                       latencies);
+    if (result == 0) {
+      qsort(latencies, n, sizeof(long long), compare_latency);
+      printf("%8d %8d %10zu %10.1f %10.1f %10.1f %10.1f\n", num_clients,
+             sizes[i], n, percentile(latencies, n, 500),
+             percentile(latencies, n, 990), percentile(latencies, n, 999),
+             latencies[n - 1] / 1000.0);
+      fflush(stdout);
+    }
+    free(latencies);
+    free(msg);
+  }
+
+  for (i = 0; i < num_clients; i++)
+    stop_ctcp(clients[i].pid, clients[i].in, clients[i].out);
+  stop_ctcp(server_pid, server_in, server_out);
+  kill(drain_pid, SIGTERM);
+  waitpid(drain_pid, NULL, 0);
+  return result;
+}
+
+static void usage(const char *progname) {
+  fprintf(stderr, "Usage: %s [-n messages] [-s sizes] [-c clients] "
+          "[-- args...]\n", progname);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+  int sizes[MAX_LIST] = { 1, 64, 1024, 8192 };
+  int levels[MAX_LIST] = { 1, 4, 16 };
+  int num_sizes = 4, num_levels = 3;
+  int num_messages = 1000;
+  int opt, i;
+
+  while ((opt = getopt(argc, argv, "n:s:c:")) != -1) {
+    switch (opt) {
+    case 'n':
+      num_messages = atoi(optarg);
+      if (num_messages <= 0)
+        usage(argv[0]);
+      break;
+    case 's':
+      if ((num_sizes = parse_list(optarg, sizes)) < 0)
+        usage(argv[0]);
+      break;
+    case 'c':
+      if ((num_levels = parse_list(optarg, levels)) < 0)
+        usage(argv[0]);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  extra_args = argv + optind;
+  num_extra_args = argc - optind;
+  if (num_extra_args > MAX_ARGS)
+    usage(argv[0]);
+  for (i = 0; i < num_levels; i++) {
+    if (levels[i] > MAX_CLIENTS) {
+      fprintf(stderr, "pingpong: at most %d clients\n", MAX_CLIENTS);
+      return EXIT_FAILURE;
+    }
+  }
+  if (access("./ctcp", X_OK) < 0 || access("./bench/echo", X_OK) < 0) {
+    fprintf(stderr, "pingpong: run `make ctcp bench` from the top directory "
+            "first\n");
+    return EXIT_FAILURE;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  srand(time(NULL));
+  printf("%8s %8s %10s %10s %10s %10s %10s\n", "clients", "bytes", "messages",
+         "p50 us", "p99 us", "p99.9 us", "max us");
+  for (i = 0; i < num_levels; i++) {
+    if (run_level(levels[i], sizes, num_sizes, num_messages) < 0)
+      return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,105 @@
+#!/bin/bash
+
+# Compares how many system calls the epoll and io_uring backends make to move
+# data from a client to a server over a Unix socket. Both hosts are run under
+# bench/syscount, and are stopped as soon as the server has written all of the
+# data, so teardown does not count. The server's output goes through a FIFO,
+# so that moment is seen as soon as the last byte is read.
+#
+# Usage: ./bench/syscalls.sh [size_kb] [window]
+#
+# Start-up (including the one second spent cleaning up old connections) is
+# counted as well, so use a large enough size for it not to matter.
+
+size_kb=${1:-1024}
+window=${2:-8}
+
+cd "$(dirname "$0")/.." || exit 1
+make CFLAGS="${CFLAGS:--g -Wall -Werror -pthread}" ctcp bench/syscount \
+  >/dev/null || exit 1
+
+input=$(mktemp /tmp/ctcp_syscalls_in.XXXXXX)
+output=$(mktemp /tmp/ctcp_syscalls_out.XXXXXX)
+counts=$(mktemp -d /tmp/ctcp_syscalls.XXXXXX)
+trap 'exec 3>&-; rm -rf $input $output $counts' EXIT
+head -c $((size_kb * 1024)) /dev/urandom > $input
+
+# The server's STDIN is a FIFO that is held open but never written to, so it
+# does not wake the server up.
+mkfifo $counts/stdin
+exec 3<> $counts/stdin
+
+# Runs one transfer with a backend and stores the counts in $counts.
+#
+# backend: epoll or io_uring.
+run() {
+  local backend=$1 flag=
+  local port=$((20000 + RANDOM % 20000))
+  [ "$backend" = io_uring ] && flag=--io-uring
+
+  rm -f $output $counts/received $counts/server_log
+  mkfifo $counts/received $counts/server_log
+
+  # Read the server's output until all of it has arrived, up to 10 minutes.
+  # Reads block until there is output.
+  timeout 600 head -c $((size_kb * 1024)) < $counts/received > $output &
+  local receiver=$!
+  ./bench/syscount -o $counts/$backend.server \
+    ./ctcp -s -p $port -w $window $flag \
+    < $counts/stdin > $counts/received 2> $counts/server_log &
+  local server=$!
+
+  # The server takes clients once it has finished cleaning up old connections
+  # and says it has started. Keep reading what it writes afterwards, so it
+  # never blocks on STDERR.
+  exec 4< $counts/server_log
+  if ! grep -q -m 1 "Server started" <&4; then
+    echo "$backend: server did not start" >&2
+    kill $receiver 2>/dev/null
+    wait $server $receiver 2>/dev/null
+    return 1
+  fi
+  cat <&4 > /dev/null &
+  exec 4<&-
+
+  ./bench/syscount -o $counts/$backend.client \
+    ./ctcp -p $((port + 1)) -c localhost:$port -w $window $flag \
+    < $input > /dev/null 2>/dev/null &
+  local client=$!
+
+  wait $receiver
+
+  pkill -f "^./ctcp -p $((port + 1)) "
+  pkill -f "^./ctcp -s -p $port "
+  wait $server $client 2>/dev/null
+
+  if ! cmp -s $input $output; then
+    echo "$backend: transfer did not complete" >&2
+    return 1
+  fi
+}
+
+run epoll || exit 1
+run io_uring || exit 1
+
+###############################################################################
+# Results.
+###############################################################################
+
+printf "%-10s %-7s %10s %12s\n" backend host syscalls "per MB"
+for backend in epoll io_uring; do
+  for host in client server; do
+    awk -v backend=$backend -v host=$host -v mb=$(echo "$size_kb" |
+        awk '{ print $1 / 1024 }') '
+      $1 == "total" { printf "%-10s %-7s %10d %12.0f\n", backend, host, $2,
+                      $2 / mb }' $counts/$backend.$host
+  done
+done
+
+echo
+echo "Breakdown (client + server):"
+printf "%-16s %10s %10s\n" syscall epoll io_uring
+paste $counts/epoll.client $counts/epoll.server \
+      $counts/io_uring.client $counts/io_uring.server |
+  awk '$1 != "total" && ($2 + $4 + $6 + $8) > 0 {
+         printf "%-16s %10d %10d\n", $1, $2 + $4, $6 + $8 }'
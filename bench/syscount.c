@@ -0,0 +1,135 @@
+/******************************************************************************
+ * syscount.c
+ * ----------
+ * Counts the system calls made by a command and every process and thread it
+ * starts, like `strace -c -f` but without needing strace. Used by
+ * bench/syscalls.sh to compare the event loop backends.
+ *
+ * Usage:
+ *     ./bench/syscount -o OUTPUT command [args...]
+ *
+ * When the command exits (or is killed), OUTPUT gets a line with the total,
+ * followed by the count for each system call ctcp uses for I/O. The command's
+ * exit status is passed on.
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/** Highest system call number counted separately. */
+#define MAX_SYSCALL 512
+
+/** System calls listed in the output, in order. Others are only counted in
+    the total. */
+static const struct {
+  int nr;
+  const char *name;
+} named[] = {
+  { SYS_read, "read" },
+  { SYS_readv, "readv" },
+  { SYS_write, "write" },
+  { SYS_writev, "writev" },
+  { SYS_vmsplice, "vmsplice" },
+  { SYS_recvfrom, "recvfrom" },
+  { SYS_sendto, "sendto" },
+  { SYS_poll, "poll" },
+  { SYS_epoll_wait, "epoll_wait" },
+  { SYS_epoll_ctl, "epoll_ctl" },
+  { SYS_io_uring_enter, "io_uring_enter" },
+  { SYS_fcntl, "fcntl" },
+  { SYS_futex, "futex" },
+};
+
+static unsigned long counts[MAX_SYSCALL];
+static unsigned long total;
+
+/**
+ * Writes the counts to a file.
+ */
+static void report(const char *path) {
+  FILE *f = fopen(path, "w");
+  unsigned int i;
+
+  if (f == NULL) {
+    perror(path);
+    return;
+  }
+  fprintf(f, "total %lu\n", total);
+  for (i = 0; i < sizeof(named) / sizeof(named[0]); i++)
+    fprintf(f, "%s %lu\n", named[i].name, counts[named[i].nr]);
+  fclose(f);
+}
+
+int main(int argc, char *argv[]) {
+  const char *output = NULL;
+  int opt, status, exit_status = 0;
+  pid_t root, pid;
+
+  while ((opt = getopt(argc, argv, "+o:")) != -1) {
+    if (opt == 'o')
+      output = optarg;
+  }
+  if (output == NULL || optind >= argc) {
+    fprintf(stderr, "Usage: %s -o OUTPUT command [args...]\n", argv[0]);
+    return 1;
+  }
+
+  root = fork();
+  if (root == 0) {
+    ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+    raise(SIGSTOP);
+    execvp(argv[optind], argv + optind);
+    perror(argv[optind]);
+    _exit(127);
+  }
+
+  /* Wait for the child to stop itself, then follow everything it starts. */
+  waitpid(root, &status, 0);
+  ptrace(PTRACE_SETOPTIONS, root, NULL,
+         PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK |
+         PTRACE_O_TRACEVFORK | PTRACE_O_EXITKILL);
+  ptrace(PTRACE_SYSCALL, root, NULL, NULL);
+
+  while ((pid = waitpid(-1, &status, __WALL)) > 0) {
+    int sig = 0;
+
+    if (WIFEXITED(status) || WIFSIGNALED(status)) {
+      if (pid == root)
+        exit_status = WIFEXITED(status) ? WEXITSTATUS(status)
+                                        : 128 + WTERMSIG(status);
+      continue;
+    }
+    if (!WIFSTOPPED(status))
+      continue;
+
+    /* System call stop. Count it on entry only. */
+    if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+      struct __ptrace_syscall_info info;
+      if (ptrace(PTRACE_GET_SYSCALL_INFO, pid, sizeof(info), &info) > 0 &&
+          info.op == PTRACE_SYSCALL_INFO_ENTRY) {
+        total++;
+        if (info.entry.nr < MAX_SYSCALL)
+          counts[info.entry.nr]++;
+      }
+    }
+    /* Signals other than ptrace's own stops are passed on. */
+    else if (status >> 16 == 0 && WSTOPSIG(status) != SIGTRAP &&
+             WSTOPSIG(status) != SIGSTOP) {
+      sig = WSTOPSIG(status);
+    }
+    ptrace(PTRACE_SYSCALL, pid, NULL, sig);
+  }
+
+  report(output);
+  return exit_status;
+}
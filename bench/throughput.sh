@@ -0,0 +1,205 @@
+#!/bin/bash
+
+# Measures bulk transfers from a client to a server on this machine, across
+# transfer sizes, window sizes and unreliability profiles, without xterm. For
+# each transfer it records the goodput, the share of segments the client
+# retransmitted, the CPU time and peak memory of both hosts, and writes the
+# results as CSV or JSON so runs can be compared.
+#
+# Usage: ./bench/throughput.sh [options]
+#   -s "sizes"     Transfer sizes, with K, M or G suffixes (default "1M 16M")
+#   -w "windows"   Window sizes, in segments (default "1 8")
+#   -p "profiles"  Unreliability profiles (default "clean drop:1"). A profile
+#                  is "clean" or option:percent[+option:percent...], where the
+#                  options are drop, corrupt, delay and duplicate. Both hosts
+#                  get them, so both directions are affected.
+#   -n runs        Transfers of each kind (default 1)
+#   -t seconds     Time a transfer may take before it is given up (default
+#                  300)
+#   -f csv|json    Output format (default csv)
+#   -o path        Write the results there instead of STDOUT
+#   -x "args"      More arguments for both hosts, e.g. "--io-uring"
+#
+# Example:
+#   ./bench/throughput.sh -s "1M 64M 1G" -w "8 32" \
+#     -p "clean drop:1 drop:5 corrupt:2 duplicate:2+delay:1" -f json -o a.json
+#
+# Goodput is the data size over the time from the first byte of output to the
+# last, so start-up and teardown do not count. The server's output goes
+# through a FIFO, and the time is taken as soon as each of those bytes is
+# read, so nothing is polled. CPU time and peak RSS are those
+# of the main process of each host. Processes forked for --delay and
+# --duplicate are not counted.
+
+sizes="1M 16M"
+windows="1 8"
+profiles="clean drop:1"
+runs=1
+timeout=300
+format=csv
+out=/dev/stdout
+extra=
+
+while getopts "s:w:p:n:t:f:o:x:" opt; do
+  case $opt in
+    s) sizes=$OPTARG ;;
+    w) windows=$OPTARG ;;
+    p) profiles=$OPTARG ;;
+    n) runs=$OPTARG ;;
+    t) timeout=$OPTARG ;;
+    f) format=$OPTARG ;;
+    o) out=$OPTARG ;;
+    x) extra=$OPTARG ;;
+    *) sed -n '3,/^$/s/^# \{0,1\}//p' "$0" >&2; exit 1 ;;
+  esac
+done
+case $format in
+  csv|json) ;;
+  *) echo "Unknown format: $format" >&2; exit 1 ;;
+esac
+
+[ "$out" != /dev/stdout ] && out=$(realpath -m "$out")
+cd "$(dirname "$0")/.." || exit 1
+make CFLAGS="${CFLAGS:--g -Wall -Werror -pthread}" ctcp ctcpctl \
+  >/dev/null || exit 1
+
+tmp=$(mktemp -d /tmp/ctcp_throughput.XXXXXX)
+trap 'exec 3>&-; rm -rf $tmp' EXIT
+
+# The server's STDIN is a FIFO that is held open but never written to, so it
+# does not wake the server up.
+mkfifo $tmp/stdin
+exec 3<> $tmp/stdin
+
+# Prints the CPU time (user + system) used by a process, in seconds.
+cpu_seconds() {
+  awk -v hz=$(getconf CLK_TCK) '{ printf "%.3f", ($14 + $15) / hz }' \
+    /proc/$1/stat 2>/dev/null || echo 0
+}
+
+# Prints the peak resident memory of a process, in KB.
+peak_rss_kb() {
+  awk '/^VmHWM/ { print $2 }' /proc/$1/status 2>/dev/null || echo 0
+}
+
+# Prints the value of a counter in the client's metrics.
+metric() {
+  ./ctcpctl $tmp/control metrics 2>/dev/null |
+    awk -v name=$1 '$1 == name { print $2 }'
+}
+
+# Turns a profile into options for ctcp, e.g. drop:1+delay:2 into
+# "--drop 1 --delay 2".
+profile_args() {
+  [ "$1" = clean ] && return
+  echo "$1" | tr '+' '\n' |
+    awk -F: '{ printf "--%s %s ", $1, $2 }'
+}
+
+# Runs one transfer and prints its results, comma-separated.
+#
+# size: Transfer size, in bytes.
+# window: Window size.
+# profile: Unreliability profile.
+run() {
+  local size=$1 window=$2 profile=$3
+  local port=$((20000 + RANDOM % 20000))
+  local args="-w $window $(profile_args $profile) $extra"
+  local status=ok start= end= output=$tmp/output
+
+  rm -f $output $tmp/control $tmp/received $tmp/server_log $tmp/times
+  mkfifo $tmp/received $tmp/server_log
+
+  # Read the server's output, and write down the time when the first byte
+  # arrives and when the last one does. Reads block until there is output.
+  timeout $timeout bash -c \
+    'head -c 1 && date +%s.%N >&3 && head -c $0 && date +%s.%N >&3' \
+    $((size - 1)) < $tmp/received > $output 3> $tmp/times &
+  local receiver=$!
+  ./ctcp -s -p $port $args < $tmp/stdin > $tmp/received \
+    2> $tmp/server_log &
+  local server=$!
+
+  # The server takes clients once it has finished cleaning up old connections
+  # and says it has started. Keep reading what it writes afterwards, so it
+  # never blocks on STDERR.
+  exec 4< $tmp/server_log
+  grep -q -m 1 "Server started" <&4 || status=failed
+  cat <&4 > /dev/null &
+  exec 4<&-
+
+  ./ctcp -p $((port + 1)) -c localhost:$port $args --control $tmp/control \
+    < $tmp/input > /dev/null 2>/dev/null &
+  local client=$!
+
+  wait $receiver
+  [ $? -eq 124 ] && status=timeout
+  { read start; read end; } < $tmp/times
+
+  local sent=$(metric ctcp_segments_sent_total)
+  local retransmits=$(metric ctcp_retransmits_total)
+  local client_cpu=$(cpu_seconds $client) server_cpu=$(cpu_seconds $server)
+  local client_rss=$(peak_rss_kb $client) server_rss=$(peak_rss_kb $server)
+
+  pkill -f "^./ctcp -p $((port + 1)) "
+  pkill -f "^./ctcp -s -p $port "
+  wait $server $client 2>/dev/null
+
+  [ $status = ok ] && ! cmp -s $tmp/input $output && status=corrupt
+  awk -v size=$size -v window=$window -v profile=$profile -v status=$status \
+      -v start=$start -v end=$end -v sent=${sent:-0} \
+      -v retransmits=${retransmits:-0} -v client_cpu=$client_cpu \
+      -v server_cpu=$server_cpu -v client_rss=${client_rss:-0} \
+      -v server_rss=${server_rss:-0} 'BEGIN {
+    # No end time if the transfer timed out before all of it arrived.
+    seconds = (start != "" && end != "") ? end - start : 0
+    goodput = (status == "ok" && seconds > 0) ? size * 8 / seconds / 1e6 : 0
+    ratio = sent > 0 ? retransmits / sent : 0
+    printf "%d,%d,%s,%s,%.3f,%.3f,%d,%d,%.4f,%s,%s,%d,%d\n", size, window,
+           profile, status, seconds, goodput, sent, retransmits, ratio,
+           client_cpu, server_cpu, client_rss, server_rss
+  }'
+}
+
+###############################################################################
+# Transfers.
+###############################################################################
+
+columns="size_bytes,window,profile,status,seconds,goodput_mbps,segments_sent"
+columns="$columns,retransmits,retransmit_ratio,client_cpu_seconds"
+columns="$columns,server_cpu_seconds,client_peak_rss_kb,server_peak_rss_kb"
+echo $columns > $tmp/results
+
+for size in $sizes; do
+  bytes=$(numfmt --from=iec $size) || exit 1
+  head -c $bytes /dev/urandom > $tmp/input
+  for window in $windows; do
+    for profile in $profiles; do
+      for ((i = 0; i < runs; i++)); do
+        echo "size $size, window $window, $profile, run $((i + 1))" >&2
+        run $bytes $window $profile >> $tmp/results
+      done
+    done
+  done
+done
+
+###############################################################################
+# Results.
+###############################################################################
+
+if [ $format = csv ]; then
+  cat $tmp/results > "$out"
+else
+  awk -F, '
+    NR == 1 { n = split($0, names, ","); print "["; next }
+    {
+      if (NR > 2) print ","
+      printf "  {"
+      for (i = 1; i <= n; i++) {
+        value = ($i ~ /^[0-9.]+$/) ? $i : "\"" $i "\""
+        printf "%s\"%s\": %s", (i > 1 ? ", " : ""), names[i], value
+      }
+      printf "}"
+    }
+    END { print "\n]" }' $tmp/results > "$out"
+fi
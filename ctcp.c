@@ -11,13 +11,50 @@
  *
  *****************************************************************************/
 
+#include <stddef.h>
+
 #include "ctcp.h"
 #include "ctcp_linked_list.h"
 #include "ctcp_sys.h"
+#include "ctcp_trace.h"
 #include "ctcp_utils.h"
 
 #undef ENABLE_DBG_PRINTS
 
+/* Input is read straight into the data of new segments, up to this many
+** segments (about 90 KB) per read, so a large input costs one system call per
+** block instead of one per segment. With a larger MSS there are fewer, bigger
+** segments per block, but always at least one. A smaller MSS gets a smaller
+** block. */
+#define READ_BLOCK_SEGMENTS 64
+#define READ_BLOCK_SIZE (READ_BLOCK_SEGMENTS * MAX_SEG_DATA_SIZE)
+#define READ_BLOCK_NUM_SEGMENTS(state) \
+  MIN(MAX(READ_BLOCK_SIZE / (state)->ctcp_config.mss, 1), READ_BLOCK_SEGMENTS)
+
+/* Mask of 'n' bits (1 to 64) of a received_bitmap word, starting at bit
+** 'shift'. */
+#define BITMAP_MASK(n, shift) \
+  (((n) == 64 ? ~0ULL : (1ULL << (n)) - 1) << (shift))
+
+/* In-order received segments are output straight from their data with one
+** conn_outputv(), up to this many at a time. */
+#define OUTPUT_BLOCK_SEGMENTS 64
+
+/* Wrappers of received segments that have been output are kept for the next
+** segments that arrive, up to this many. */
+#define SPARE_RX_WRAPPERS 64
+
+/* Input is only read while the send buffer (data that has been read but not
+** acked yet) has room, so the window bounds memory. The buffer holds the send
+** window, or one read block if that is larger. */
+#define SEND_BUFFER_SIZE(state) \
+  MAX((state)->ctcp_config.send_window, \
+      MAX(READ_BLOCK_SIZE, (state)->ctcp_config.mss))
+
+/* Windows larger than the 16-bit window field of a segment are sent as the
+** largest value it can hold. The real window was agreed on when connecting. */
+#define WINDOW_FIELD(window) htons((uint16_t) MIN((window), 0xffff))
+
 /******************************************************************************
  * Variable/struct declarations
  *****************************************************************************/
@@ -43,6 +80,15 @@ typedef struct {
   **             - timestamp of last send
   **             - ctcp_segment struct (see ctcp_sys.h)  */
   linked_list_t* wrapped_unacked_segments;
+
+  /* Full-sized segments allocated for a read but not filled, kept for the
+  ** next read. */
+  struct wrapped_ctcp_segment* spare_segments[READ_BLOCK_SEGMENTS];
+  unsigned int num_spare_segments;
+
+  /* Set when reading stopped because the send buffer was full rather than
+  ** because input ran out, so acks need to restart it. */
+  bool input_blocked;
 } tx_state_t;
 
 typedef struct {
@@ -52,16 +98,43 @@ typedef struct {
   uint32_t num_out_of_window_segments;
   uint32_t num_invalid_cksums;
 
-  /* This should be a linked list of ctcp_segment_t*'s.  */
+  /* This should be a linked list of wrapped_rx_segment_t*'s.  */
   linked_list_t* segments_to_output;
+  struct wrapped_rx_segment* spare_wrappers[SPARE_RX_WRAPPERS];
+  unsigned int num_spare_wrappers;
+
+  /* With direct output (see conn_output_direct()), segments are written out
+  ** as soon as they arrive instead of going in segments_to_output. This has
+  ** one bit per byte of the receive window, set once the byte is written.
+  ** Byte 'seqno' is bit (seqno - 1) % recv_window, and it's worked on 64 bits
+  ** at a time. */
+  uint64_t* received_bitmap;
+
+  /* Set when a FIN arrives before all of the data ahead of it. */
+  bool FIN_pending;
+  uint32_t FIN_seqno;
 } rx_state_t;
 
-typedef struct {
+typedef struct wrapped_ctcp_segment {
   uint32_t         num_xmits;
   long             timestamp_of_last_send;
+  uint64_t         time_read;   /* When the data was read, in us */
+  uint64_t         time_sent;   /* When it was last sent, in us */
+
+  /* Points into the input mapping (see conn_input_map()) or a shared buffer
+  ** (see conn_input_shared()) if the data isn't stored after the header. Only
+  ** the header is allocated then. */
+  const char*      data;
+  shared_buf_t*    shared;    /* Reference to the shared buffer, if any */
   ctcp_segment_t   ctcp_segment;
 } wrapped_ctcp_segment_t;
 
+/* A received segment waiting in segments_to_output. */
+typedef struct wrapped_rx_segment {
+  uint64_t         time_received; /* When it arrived, in us */
+  ctcp_segment_t*  ctcp_segment;
+} wrapped_rx_segment_t;
+
 /**
  * Connection state.
  *
@@ -88,9 +161,11 @@ struct ctcp_state {
 
 /**
  * Linked list of connection states. Go through this in ctcp_timer() to
- * resubmit segments and tear down connections.
+ * resubmit segments and tear down connections. A server started with
+ * --threads calls into this file from several threads, each owning its own
+ * connections, so every thread gets its own list.
  */
-static ctcp_state_t *state_list;
+static __thread ctcp_state_t *state_list;
 
 /******************************************************************************
  * Local function declarations.
@@ -99,14 +174,15 @@ static ctcp_state_t *state_list;
 /**
  * This is to be called by ctcp_read() and ctcp_timer(). This function is
  * responsible for examining 'state', and xmiting (or rexmiting) as many
- * segments as possible.
+ * segments as possible. Returns -1 if 'state' was destroyed, 0 otherwise.
  */
-void ctcp_send_what_we_can(ctcp_state_t *state);
+int ctcp_send_what_we_can(ctcp_state_t *state);
 
 /**
- * Sends 'wrapped_segment' and updates 'state' accordingly.
+ * Sends 'wrapped_segment' and updates 'state' accordingly. Returns -1 if
+ * 'state' was destroyed, 0 otherwise.
  */
-void ctcp_send_segment(ctcp_state_t *state, wrapped_ctcp_segment_t* wrapped_segment);
+int ctcp_send_segment(ctcp_state_t *state, wrapped_ctcp_segment_t* wrapped_segment);
 
 /**
  * This should be called after tx_state.last_ackno_rxed has been updated in
@@ -125,6 +201,55 @@ void ctcp_send_control_segment(ctcp_state_t *state);
  */
 uint16_t ctcp_get_num_data_bytes(ctcp_segment_t* ctcp_segment_ptr);
 
+/**
+ * Returns how many more bytes of input fit in the send buffer.
+ */
+uint32_t ctcp_send_buffer_space(ctcp_state_t *state);
+
+/**
+ * Reads as much input as the send buffer has room for into new segments,
+ * and adds them to wrapped_unacked_segments. Queues a FIN once EOF is read.
+ * Doesn't send anything, so 'state' is never destroyed.
+ */
+void ctcp_fill_send_buffer(ctcp_state_t *state);
+
+/**
+ * With direct output, writes the data of 'segment' straight to its place in
+ * the output, and marks it in rx_state.received_bitmap. Frees 'segment'.
+ * Destroys 'state' if the data goes past MAX_STREAM_LEN. Returns -1 if
+ * 'state' was destroyed, 0 otherwise.
+ */
+int ctcp_place_segment(ctcp_state_t *state, ctcp_segment_t *segment);
+
+/**
+ * Frees a received segment that has been output or thrown away, and keeps
+ * its wrapper for the next segment if there's room.
+ */
+void ctcp_free_rx_segment(ctcp_state_t *state,
+                          wrapped_rx_segment_t *wrapped_segment);
+
+/**
+ * With direct output, moves last_seqno_accepted past the bytes that have been
+ * written, outputs EOF once the FIN is reached, and acks.
+ */
+void ctcp_output_placed(ctcp_state_t *state);
+
+/**
+ * Like ctcp_fill_send_buffer(), but for input that is memory-mapped. New
+ * segments point into 'map' instead of holding a copy of the data. Returns -1
+ * once the whole mapping is buffered, 0 otherwise.
+ */
+int ctcp_fill_send_buffer_from_map(ctcp_state_t *state, const char *map,
+                                   size_t map_len);
+
+/**
+ * Like ctcp_fill_send_buffer(), but for input that is shared with other
+ * connections (--broadcast). New segments point into the shared buffers and
+ * hold a reference to them until they are acked. Returns -1 once EOF is
+ * reached, 0 otherwise.
+ */
+int ctcp_fill_send_buffer_shared(ctcp_state_t *state);
+
 /******************************************************************************
  * Function implementations.
  *****************************************************************************/
@@ -154,12 +279,14 @@ ctcp_state_t *ctcp_init(conn_t *conn, ctcp_config_t *cfg) {
   state->ctcp_config.send_window = cfg->send_window;
   state->ctcp_config.timer = cfg->timer;
   state->ctcp_config.rt_timeout = cfg->rt_timeout;
+  state->ctcp_config.mss = cfg->mss;
 
   #ifdef ENABLE_DBG_PRINTS
   fprintf(stderr, "state->ctcp_config.recv_window  : %d\n", state->ctcp_config.recv_window );
   fprintf(stderr, "state->ctcp_config.send_window  : %d\n", state->ctcp_config.send_window );
   fprintf(stderr, "state->ctcp_config.timer        : %d\n", state->ctcp_config.timer );
   fprintf(stderr, "state->ctcp_config.rt_timeout   : %d\n", state->ctcp_config.rt_timeout );
+  fprintf(stderr, "state->ctcp_config.mss          : %d\n", state->ctcp_config.mss );
   #endif
 
   /* Initialize tx_state */
@@ -176,6 +303,11 @@ ctcp_state_t *ctcp_init(conn_t *conn, ctcp_config_t *cfg) {
   state->rx_state.num_out_of_window_segments = 0;
   state->rx_state.num_invalid_cksums = 0;
   state->rx_state.segments_to_output = ll_create();
+  if (conn_output_direct(conn)) {
+    state->rx_state.received_bitmap = calloc((cfg->recv_window + 63) / 64,
+                                             sizeof(uint64_t));
+    assert(state->rx_state.received_bitmap != NULL);
+  }
 
   free(cfg);
   return state;
@@ -217,10 +349,13 @@ void ctcp_destroy(ctcp_state_t *state) {
                               (wrapped_ctcp_segment_t*) front_node_ptr->object;
       print_ctcp_segment(&wrapped_ctcp_segment_ptr->ctcp_segment);
       #endif
+      shared_buf_unref(((wrapped_ctcp_segment_t*) front_node_ptr->object)->shared);
       free(front_node_ptr->object);
       ll_remove(state->tx_state.wrapped_unacked_segments, front_node_ptr);
     }
     ll_destroy(state->tx_state.wrapped_unacked_segments);
+    for (i = 0; i < state->tx_state.num_spare_segments; ++i)
+      free(state->tx_state.spare_segments[i]);
 
     /* Free everything in the list of segments to output. */
     len = ll_length(state->rx_state.segments_to_output);
@@ -230,10 +365,14 @@ void ctcp_destroy(ctcp_state_t *state) {
     for (i = 0; i < len; ++i)
     {
       ll_node_t *front_node_ptr = ll_front(state->rx_state.segments_to_output);
+      free(((wrapped_rx_segment_t*) front_node_ptr->object)->ctcp_segment);
       free(front_node_ptr->object);
       ll_remove(state->rx_state.segments_to_output, front_node_ptr);
     }
     ll_destroy(state->rx_state.segments_to_output);
+    for (i = 0; i < state->rx_state.num_spare_wrappers; ++i)
+      free(state->rx_state.spare_wrappers[i]);
+    free(state->rx_state.received_bitmap);
 
     free(state);
   }
@@ -245,70 +384,177 @@ void ctcp_destroy(ctcp_state_t *state) {
 }
 
 void ctcp_read(ctcp_state_t *state) {
-  /* FIXME */
-  int bytes_read;
-  // I add 1 here so that I can add null terminator in debug code
-  uint8_t buf[MAX_SEG_DATA_SIZE+1];
+  ctcp_fill_send_buffer(state);
+
+  /* Try to send the data we just read. */
+  ctcp_send_what_we_can(state);
+}
+
+uint32_t ctcp_send_buffer_space(ctcp_state_t *state) {
+  uint32_t size = SEND_BUFFER_SIZE(state);
+  uint32_t buffered = state->tx_state.last_seqno_read;
+
+  // last_ackno_rxed is the first byte they still want, and starts at 0.
+  if (state->tx_state.last_ackno_rxed != 0)
+    buffered -= state->tx_state.last_ackno_rxed - 1;
+  return buffered < size ? size - buffered : 0;
+}
+
+void ctcp_fill_send_buffer(ctcp_state_t *state) {
+  tx_state_t *tx = &state->tx_state;
+  wrapped_ctcp_segment_t* segments[READ_BLOCK_SEGMENTS];
+  struct iovec iov[READ_BLOCK_SEGMENTS];
   wrapped_ctcp_segment_t* new_segment_ptr;
+  int bytes_read = 0, len, num_segments, seg_len, i;
+  int mss = state->ctcp_config.mss;
+  const char* map;
+  size_t map_len;
+  bool shared;
 
-  if (state->tx_state.has_EOF_been_read)
+  if (tx->has_EOF_been_read)
     return;
 
-  while ((bytes_read = conn_input(state->conn, buf, MAX_SEG_DATA_SIZE)) > 0)
+  /* A memory-mapped or shared input doesn't need to be read at all. */
+  tx->input_blocked = true;
+  map = conn_input_map(state->conn, &map_len);
+  shared = conn_input_broadcast(state->conn);
+  if (map != NULL)
+    bytes_read = ctcp_fill_send_buffer_from_map(state, map, map_len);
+  else if (shared)
+    bytes_read = ctcp_fill_send_buffer_shared(state);
+
+  /* Read as many whole segments as there is room for, straight into the
+  ** segments' data. Stop once the buffer is full (ctcp_receive() calls back
+  ** in when acks make room), or there is no more input for now. */
+  while (map == NULL && !shared &&
+         (num_segments = ctcp_send_buffer_space(state) / mss) > 0)
   {
-    #ifdef ENABLE_DBG_PRINTS
-    buf[bytes_read] = 0; // add null terminator
-    fprintf(stderr, "Read %d bytes: %s\n", bytes_read, buf);
-    #endif
+    if (num_segments > READ_BLOCK_NUM_SEGMENTS(state))
+      num_segments = READ_BLOCK_NUM_SEGMENTS(state);
 
-    /*
-    ** Create a new ctcp segment.
-    **
-    ** An implementation that would lead to less memory fragmentation
-    ** would be to allocate consistent sized blocks. Not sure if I'll have
-    ** time for that.
-    */
-    new_segment_ptr = (wrapped_ctcp_segment_t*) calloc(1,
-                                  sizeof(wrapped_ctcp_segment_t) + bytes_read);
-    assert(new_segment_ptr != NULL);
+    for (i = 0; i < num_segments; ++i) {
+      if (tx->num_spare_segments > 0)
+        segments[i] = tx->spare_segments[--tx->num_spare_segments];
+      else
+        segments[i] = malloc(sizeof(wrapped_ctcp_segment_t) + mss);
+      assert(segments[i] != NULL);
+      iov[i].iov_base = segments[i]->ctcp_segment.data;
+      iov[i].iov_len = mss;
+    }
 
-    /* Initialize the ctcp segment. Remember that calloc init'd everything to zero.
-    ** Most headers should be set by whatever fn actually ships this segment out. */
-    new_segment_ptr->ctcp_segment.len = htons((uint16_t) sizeof(ctcp_segment_t) + bytes_read);
+    bytes_read = conn_inputv(state->conn, iov, num_segments);
 
-    /* Set the segment's sequence number. */
-    new_segment_ptr->ctcp_segment.seqno = htonl(state->tx_state.last_seqno_read + 1);
+    #ifdef ENABLE_DBG_PRINTS
+    if (bytes_read > 0)
+      fprintf(stderr, "Read %d bytes\n", bytes_read);
+    #endif
 
-    /* Copy the data we just read into the segment we just allocated. */
-    memcpy(new_segment_ptr->ctcp_segment.data, buf, bytes_read);
+    /* Turn the filled buffers into segments. The last one may be partly
+    ** filled. */
+    for (i = 0, len = bytes_read; len > 0; ++i) {
+      seg_len = len < mss ? len : mss;
+      new_segment_ptr = segments[i];
+
+      /* Clear everything up to the data. Most headers should be set by
+      ** whatever fn actually ships this segment out. */
+      memset(new_segment_ptr, 0,
+             offsetof(wrapped_ctcp_segment_t, ctcp_segment.data));
+      new_segment_ptr->ctcp_segment.len = htons((uint16_t) sizeof(ctcp_segment_t) + seg_len);
+
+      /* Set the segment's sequence number. */
+      new_segment_ptr->ctcp_segment.seqno = htonl(tx->last_seqno_read + 1);
+      new_segment_ptr->time_read = current_time_us();
+
+      /* Set last_seqno_read. Sequence numbers start at 1, not 0, so we don't need
+      ** to subtract 1 here. */
+      tx->last_seqno_read += seg_len;
+
+      /* Add new ctcp segment to our list of unacknowledged segments. */
+      ll_add(tx->wrapped_unacked_segments, new_segment_ptr);
+      len -= seg_len;
+    }
 
-    /* Set last_seqno_read. Sequence numbers start at 1, not 0, so we don't need
-    ** to subtract 1 here. */
-    state->tx_state.last_seqno_read += bytes_read;
+    /* Keep the buffers that were not filled for next time. */
+    for (; i < num_segments; ++i)
+      tx->spare_segments[tx->num_spare_segments++] = segments[i];
 
-    /* Add new ctcp segment to our list of unacknowledged segments. */
-    ll_add(state->tx_state.wrapped_unacked_segments, new_segment_ptr);
+    if (bytes_read <= 0) {
+      tx->input_blocked = false;
+      break;
+    }
   }
 
   if (bytes_read == -1)
   {
-    state->tx_state.has_EOF_been_read = true;
+    tx->has_EOF_been_read = true;
 
     /* Create a FIN segment. */
     new_segment_ptr = (wrapped_ctcp_segment_t*) calloc(1, sizeof(wrapped_ctcp_segment_t));
     assert(new_segment_ptr != NULL);
     new_segment_ptr->ctcp_segment.len = htons((uint16_t) sizeof(ctcp_segment_t));
-    new_segment_ptr->ctcp_segment.seqno = htonl(state->tx_state.last_seqno_read + 1);
+    new_segment_ptr->ctcp_segment.seqno = htonl(tx->last_seqno_read + 1);
     new_segment_ptr->ctcp_segment.flags |= TH_FIN;
+    new_segment_ptr->time_read = current_time_us();
     /* Add new ctcp segment to our list of unacknowledged segments. */
-    ll_add(state->tx_state.wrapped_unacked_segments, new_segment_ptr);
+    ll_add(tx->wrapped_unacked_segments, new_segment_ptr);
   }
+}
 
-  /* Try to send the data we just read. */
-  ctcp_send_what_we_can(state_list);
+int ctcp_fill_send_buffer_from_map(ctcp_state_t *state, const char *map,
+                                   size_t map_len) {
+  tx_state_t *tx = &state->tx_state;
+  wrapped_ctcp_segment_t* new_segment_ptr;
+  size_t seg_len;
+
+  while (tx->last_seqno_read < map_len) {
+    seg_len = MIN(map_len - tx->last_seqno_read, state->ctcp_config.mss);
+    if (seg_len > ctcp_send_buffer_space(state))
+      return 0; // Full. ctcp_receive() calls back in.
+
+    /* Only the header is needed. */
+    new_segment_ptr = (wrapped_ctcp_segment_t*) calloc(1, sizeof(wrapped_ctcp_segment_t));
+    assert(new_segment_ptr != NULL);
+    new_segment_ptr->data = map + tx->last_seqno_read;
+    new_segment_ptr->ctcp_segment.len = htons((uint16_t) (sizeof(ctcp_segment_t) + seg_len));
+    new_segment_ptr->ctcp_segment.seqno = htonl(tx->last_seqno_read + 1);
+    new_segment_ptr->time_read = current_time_us();
+    tx->last_seqno_read += seg_len;
+    ll_add(tx->wrapped_unacked_segments, new_segment_ptr);
+  }
+
+  tx->input_blocked = false;
+  return -1;
+}
+
+int ctcp_fill_send_buffer_shared(ctcp_state_t *state) {
+  tx_state_t *tx = &state->tx_state;
+  wrapped_ctcp_segment_t* new_segment_ptr;
+  shared_buf_t* buf;
+  const char* data;
+  int seg_len;
+
+  while (ctcp_send_buffer_space(state) >= state->ctcp_config.mss) {
+    seg_len = conn_input_shared(state->conn, state->ctcp_config.mss, &buf, &data);
+    if (seg_len <= 0) {
+      tx->input_blocked = false;
+      return seg_len; // The library calls back in once there is more.
+    }
+
+    /* Only the header is needed. The reference is given up once acked. */
+    new_segment_ptr = (wrapped_ctcp_segment_t*) calloc(1, sizeof(wrapped_ctcp_segment_t));
+    assert(new_segment_ptr != NULL);
+    new_segment_ptr->data = data;
+    new_segment_ptr->shared = buf;
+    new_segment_ptr->ctcp_segment.len = htons((uint16_t) (sizeof(ctcp_segment_t) + seg_len));
+    new_segment_ptr->ctcp_segment.seqno = htonl(tx->last_seqno_read + 1);
+    new_segment_ptr->time_read = current_time_us();
+    tx->last_seqno_read += seg_len;
+    ll_add(tx->wrapped_unacked_segments, new_segment_ptr);
+  }
+  return 0; // Full. ctcp_receive() calls back in.
 }
 
-void ctcp_send_what_we_can(ctcp_state_t *state) {
+int ctcp_send_what_we_can(ctcp_state_t *state) {
 
   wrapped_ctcp_segment_t *wrapped_ctcp_segment_ptr;
   ll_node_t *curr_node_ptr;
@@ -317,12 +563,11 @@ void ctcp_send_what_we_can(ctcp_state_t *state) {
   uint32_t last_seqno_of_segment, last_allowable_seqno;
 
   if (state == NULL)
-    return;
+    return 0;
 
   length = ll_length(state->tx_state.wrapped_unacked_segments);
   if (length == 0)
-    /* todo - this will have to be 'continue' or something for multiple connections */
-    return;
+    return 0;
 
   for (i = 0; i < length; ++i) {
     if (i == 0) {
@@ -351,23 +596,29 @@ void ctcp_send_what_we_can(ctcp_state_t *state) {
     // If the segment is outside of the sliding window, then we're done.
     // "maintain invariant (LSS-LAR <= SWS)"
     if (last_seqno_of_segment > last_allowable_seqno) {
-      return;
+      if (wrapped_ctcp_segment_ptr->num_xmits == 0)
+        conn_count(state->conn, CONN_WINDOW_STALL);
+      return 0;
     }
 
     // If we got to this point, then we have a segment that's within the send
     // window. Any segments here that have not been sent can now be sent. The
     // first segment can be retransmitted if it timed out.
     if (wrapped_ctcp_segment_ptr->num_xmits == 0) {
-      ctcp_send_segment(state, wrapped_ctcp_segment_ptr);
+      if (ctcp_send_segment(state, wrapped_ctcp_segment_ptr) < 0)
+        return -1;
     } else if (i == 0) {
       // Check and see if we need to retrasnmit the first segment.
       ms_since_last_send = current_time() - wrapped_ctcp_segment_ptr->timestamp_of_last_send;
       if (ms_since_last_send > state->ctcp_config.rt_timeout) {
         // Timeout. Resend the segment.
-        ctcp_send_segment(state, wrapped_ctcp_segment_ptr);
+        conn_count(state->conn, CONN_RTO_EXPIRED);
+        if (ctcp_send_segment(state, wrapped_ctcp_segment_ptr) < 0)
+          return -1;
       }
     }
   }
+  return 0;
 
 
 #if 0
@@ -397,34 +648,60 @@ void ctcp_send_what_we_can(ctcp_state_t *state) {
 #endif
 }
 
-void ctcp_send_segment(ctcp_state_t *state, wrapped_ctcp_segment_t* wrapped_segment)
+int ctcp_send_segment(ctcp_state_t *state, wrapped_ctcp_segment_t* wrapped_segment)
 {
   long timestamp;
-  uint16_t segment_cksum;
+  uint16_t segment_cksum, num_data_bytes;
   int bytes_sent;
+  struct iovec iov[2];
 
   if (wrapped_segment->num_xmits >= MAX_NUM_XMITS) {
     // Assume the other side is unresponsive and destroy the connection.
     #ifdef ENABLE_DBG_PRINTS
     fprintf(stderr, "xmit limit reached\n");
     #endif
+    conn_flight_dump(state->conn, "retransmission limit reached");
     ctcp_destroy(state);
-    return;
+    return -1;
   }
+  if (wrapped_segment->num_xmits > 0)
+    conn_count(state->conn, CONN_RETRANSMIT);
+  CTCP_TRACE(send_segment, state->conn,
+             ntohl(wrapped_segment->ctcp_segment.seqno),
+             ctcp_get_num_data_bytes(&wrapped_segment->ctcp_segment),
+             wrapped_segment->num_xmits > 0);
 
   /* Set the segment's ctcp header fields. */
   wrapped_segment->ctcp_segment.ackno = htonl(state->rx_state.last_seqno_accepted + 1);
   wrapped_segment->ctcp_segment.flags |= TH_ACK;
-  wrapped_segment->ctcp_segment.window = htons(state->ctcp_config.recv_window);
+  wrapped_segment->ctcp_segment.window = WINDOW_FIELD(state->ctcp_config.recv_window);
 
   wrapped_segment->ctcp_segment.cksum = 0;
-  segment_cksum = cksum(&wrapped_segment->ctcp_segment, ntohs(wrapped_segment->ctcp_segment.len));
+  if (wrapped_segment->data != NULL) {
+    /* The data is in the input mapping, apart from the header. */
+    num_data_bytes = ctcp_get_num_data_bytes(&wrapped_segment->ctcp_segment);
+    iov[0].iov_base = &wrapped_segment->ctcp_segment;
+    iov[0].iov_len = sizeof(ctcp_segment_t);
+    iov[1].iov_base = (void*) wrapped_segment->data;
+    iov[1].iov_len = num_data_bytes;
+    segment_cksum = cksum_iov(iov, 2);
+  } else {
+    segment_cksum = cksum(&wrapped_segment->ctcp_segment, ntohs(wrapped_segment->ctcp_segment.len));
+  }
   wrapped_segment->ctcp_segment.cksum = segment_cksum;
 
   /* Try to send the segment. */
-  bytes_sent = conn_send(state->conn, &wrapped_segment->ctcp_segment,
-                         ntohs(wrapped_segment->ctcp_segment.len));
+  if (wrapped_segment->data != NULL)
+    bytes_sent = conn_sendv(state->conn, &wrapped_segment->ctcp_segment,
+                            wrapped_segment->data, num_data_bytes);
+  else
+    bytes_sent = conn_send(state->conn, &wrapped_segment->ctcp_segment,
+                           ntohs(wrapped_segment->ctcp_segment.len));
   timestamp = current_time();
+  wrapped_segment->time_sent = current_time_us();
+  if (wrapped_segment->num_xmits == 0)
+    conn_time(state->conn, CONN_SEND_DELAY,
+              wrapped_segment->time_sent - wrapped_segment->time_read);
   wrapped_segment->num_xmits++;
 
   /*if (bytes_sent == 0)*/
@@ -433,14 +710,14 @@ void ctcp_send_segment(ctcp_state_t *state, wrapped_ctcp_segment_t* wrapped_segm
     fprintf(stderr, "conn_send returned %d bytes instead of %d :-(\n",
             bytes_sent, ntohs(wrapped_segment->ctcp_segment.len));
     #endif
-    return; // can't send for some reason, try again later.
+    return 0; // can't send for some reason, try again later.
   }
   if (bytes_sent == -1) {
     #ifdef ENABLE_DBG_PRINTS
     fprintf(stderr, "conn_send returned -1.\n");
     #endif
     ctcp_destroy(state); // ya done now
-    return;
+    return -1;
   }
 
   #ifdef ENABLE_DBG_PRINTS
@@ -448,9 +725,15 @@ void ctcp_send_segment(ctcp_state_t *state, wrapped_ctcp_segment_t* wrapped_segm
   print_ctcp_segment(&wrapped_segment->ctcp_segment);
   #endif
 
-  /* Update state */
-  state->tx_state.last_seqno_sent += bytes_sent;
+  /* Update state. Retransmissions don't move last_seqno_sent, and a FIN
+  ** takes up a sequence number of its own. */
+  if (wrapped_segment->num_xmits == 1)
+    state->tx_state.last_seqno_sent =
+      ntohl(wrapped_segment->ctcp_segment.seqno)
+      + ctcp_get_num_data_bytes(&wrapped_segment->ctcp_segment) - 1
+      + ((wrapped_segment->ctcp_segment.flags & TH_FIN) ? 1 : 0);
   wrapped_segment->timestamp_of_last_send = timestamp;
+  return 0;
 }
 
 
@@ -461,6 +744,10 @@ void ctcp_receive(ctcp_state_t *state, ctcp_segment_t *segment, size_t len) {
   unsigned int length, i;
   ll_node_t* ll_node_ptr;
   ctcp_segment_t* ctcp_segment_ptr;
+  wrapped_rx_segment_t* wrapped_segment;
+
+  CTCP_TRACE(receive, state->conn, ntohl(segment->seqno), ntohl(segment->ackno),
+             len, segment->flags);
 
   /* If the segment was truncated, ignore it and hopefully retransmission will fix it. */
   if (len < ntohs(segment->len)) {
@@ -468,8 +755,10 @@ void ctcp_receive(ctcp_state_t *state, ctcp_segment_t *segment, size_t len) {
     fprintf(stderr, "Ignoring truncated segment.   ");
     print_ctcp_segment(segment);
     #endif
+    CTCP_TRACE(receive_drop, state->conn, ntohl(segment->seqno), CONN_TRUNCATED);
     free(segment);
     state->rx_state.num_truncated_segments++;
+    conn_count(state->conn, CONN_TRUNCATED);
     return;
   }
 
@@ -486,8 +775,10 @@ void ctcp_receive(ctcp_state_t *state, ctcp_segment_t *segment, size_t len) {
             computed_cksum, actual_cksum);
     print_ctcp_segment(segment);
     #endif
+    CTCP_TRACE(receive_drop, state->conn, ntohl(segment->seqno), CONN_BAD_CKSUM);
     free(segment);
     state->rx_state.num_invalid_cksums++;
+    conn_count(state->conn, CONN_BAD_CKSUM);
     return;
   }
 
@@ -506,6 +797,11 @@ void ctcp_receive(ctcp_state_t *state, ctcp_segment_t *segment, size_t len) {
       fprintf(stderr, "Ignoring out of window segment. ");
       print_ctcp_segment(segment);
       #endif
+      // Segments from before the window have been received already.
+      conn_event_t event = ntohl(segment->seqno) < smallest_allowable_seqno ?
+                           CONN_DUPLICATE : CONN_OUT_OF_WINDOW;
+      conn_count(state->conn, event);
+      CTCP_TRACE(receive_drop, state->conn, ntohl(segment->seqno), event);
       free(segment);
       // Let the sender know our state, since they sent a wonky packet. Maybe
       // our previous ack was lost.
@@ -542,6 +838,7 @@ void ctcp_receive(ctcp_state_t *state, ctcp_segment_t *segment, size_t len) {
   fprintf(stderr, "Looks like we got a valid segment with %d bytes\n", num_data_bytes);
   print_ctcp_segment(segment);
   #endif
+  CTCP_TRACE(receive_accept, state->conn, ntohl(segment->seqno), num_data_bytes);
 
   // if ACK flag is set, update tx_state.last_ackno_rxed
   if (segment->flags & TH_ACK) {
@@ -549,41 +846,62 @@ void ctcp_receive(ctcp_state_t *state, ctcp_segment_t *segment, size_t len) {
   }
 
 
+  /*
+  ** With direct output, the data goes straight to its place in the output, so
+  ** there is no need to keep it around.
+  */
+  if (state->rx_state.received_bitmap != NULL)
+  {
+    if (ctcp_place_segment(state, segment) < 0)
+      return;
+  }
   /*
   ** Try to add the segment to segments_to_output. We should only output data if
   ** the segment has data to output, or if we've received a FIN (in which case
   ** we'll need to output EOF.)
   */
-  if (num_data_bytes || (segment->flags & TH_FIN))
+  else if (num_data_bytes || (segment->flags & TH_FIN))
   {
     /*
     ** We need to add the segment to the linked list segments_to_output in
     ** sorted order, taking care to throw away/free it if it's a duplicate.
+    **
+    ** The time the segment arrived is kept with it, to time how long it waits
+    ** in the list.
     */
+    if (state->rx_state.num_spare_wrappers > 0)
+      wrapped_segment =
+        state->rx_state.spare_wrappers[--state->rx_state.num_spare_wrappers];
+    else
+      wrapped_segment = malloc(sizeof(wrapped_rx_segment_t));
+    wrapped_segment->time_received = current_time_us();
+    wrapped_segment->ctcp_segment = segment;
     length = ll_length(state->rx_state.segments_to_output);
 
     if (length == 0)
     {
-      ll_add(state->rx_state.segments_to_output, segment);
+      ll_add(state->rx_state.segments_to_output, wrapped_segment);
     }
     else if (length == 1)
     {
       ll_node_ptr = ll_front(state->rx_state.segments_to_output);
-      ctcp_segment_ptr = (ctcp_segment_t*) ll_node_ptr->object;
+      ctcp_segment_ptr = ((wrapped_rx_segment_t*) ll_node_ptr->object)->ctcp_segment;
       if (ntohl(segment->seqno) == ntohl(ctcp_segment_ptr->seqno))
       {
         // The segment we received is a duplicate, so throw it away.
-        free(segment);
+        CTCP_TRACE(receive_drop, state->conn, ntohl(segment->seqno), CONN_DUPLICATE);
+        ctcp_free_rx_segment(state, wrapped_segment);
+        conn_count(state->conn, CONN_DUPLICATE);
       }
       else if (ntohl(segment->seqno) > ntohl(ctcp_segment_ptr->seqno))
       {
         // the new segment comes after the one segment we have
-        ll_add(state->rx_state.segments_to_output, segment);
+        ll_add(state->rx_state.segments_to_output, wrapped_segment);
       }
       else
       {
         // the new segment comes earlier than the one segment we have
-        ll_add_front(state->rx_state.segments_to_output, segment);
+        ll_add_front(state->rx_state.segments_to_output, wrapped_segment);
       }
     }
     else
@@ -598,18 +916,18 @@ void ctcp_receive(ctcp_state_t *state, ctcp_segment_t *segment, size_t len) {
       first_ll_node_ptr = ll_front(state->rx_state.segments_to_output);
       last_ll_node_ptr  = ll_back(state->rx_state.segments_to_output);
 
-      first_ctcp_segment_ptr = (ctcp_segment_t*) first_ll_node_ptr->object;
-      last_ctcp_segment_ptr  = (ctcp_segment_t*) last_ll_node_ptr->object;
+      first_ctcp_segment_ptr = ((wrapped_rx_segment_t*) first_ll_node_ptr->object)->ctcp_segment;
+      last_ctcp_segment_ptr  = ((wrapped_rx_segment_t*) last_ll_node_ptr->object)->ctcp_segment;
 
       // See if we should add the segment to the end of the list.
       if (ntohl(segment->seqno) > ntohl(last_ctcp_segment_ptr->seqno))
       {
-        ll_add(state->rx_state.segments_to_output, segment);
+        ll_add(state->rx_state.segments_to_output, wrapped_segment);
       }
       // See if we should add the segment to the beginning of the list.
       else if (ntohl(segment->seqno) < ntohl(first_ctcp_segment_ptr->seqno))
       {
-        ll_add_front(state->rx_state.segments_to_output, segment);
+        ll_add_front(state->rx_state.segments_to_output, wrapped_segment);
       }
       // The segment is either a duplicate, or it belongs *between* two nodes.
       else
@@ -629,15 +947,18 @@ void ctcp_receive(ctcp_state_t *state, ctcp_segment_t *segment, size_t len) {
           }
           next_node_ptr = curr_node_ptr->next;
 
-          curr_ctcp_segment_ptr = (ctcp_segment_t*) curr_node_ptr->object;
-          next_ctcp_segment_ptr = (ctcp_segment_t*) next_node_ptr->object;
+          curr_ctcp_segment_ptr = ((wrapped_rx_segment_t*) curr_node_ptr->object)->ctcp_segment;
+          next_ctcp_segment_ptr = ((wrapped_rx_segment_t*) next_node_ptr->object)->ctcp_segment;
 
           // Check for duplicates.
           if ((ntohl(segment->seqno) == ntohl(curr_ctcp_segment_ptr->seqno)) ||
               (ntohl(segment->seqno) == ntohl(next_ctcp_segment_ptr->seqno)))
           {
             // Duplicate found.
-            free(segment);
+            CTCP_TRACE(receive_drop, state->conn, ntohl(segment->seqno),
+                       CONN_DUPLICATE);
+            ctcp_free_rx_segment(state, wrapped_segment);
+            conn_count(state->conn, CONN_DUPLICATE);
             break;
           }
           else
@@ -646,7 +967,7 @@ void ctcp_receive(ctcp_state_t *state, ctcp_segment_t *segment, size_t len) {
             if ((ntohl(segment->seqno) > ntohl(curr_ctcp_segment_ptr->seqno)) &&
                 (ntohl(segment->seqno) < ntohl(next_ctcp_segment_ptr->seqno)))
             {
-              ll_add_after(state->rx_state.segments_to_output, curr_node_ptr, segment);
+              ll_add_after(state->rx_state.segments_to_output, curr_node_ptr, wrapped_segment);
               break;
             }
           }
@@ -662,88 +983,241 @@ void ctcp_receive(ctcp_state_t *state, ctcp_segment_t *segment, size_t len) {
     free(segment);
   }
 
-  // Output as many received segments as we can.
-  ctcp_output(state);
+  // Output as many received segments as we can. Segments placed in a list are
+  // output once the segments that arrived with this one are in the list too,
+  // so they can go out together.
+  if (state->rx_state.received_bitmap != NULL)
+    ctcp_output(state);
+  else
+    conn_output_later(state->conn);
 
   /* The ackno has probably advanced, so clean up our list of unacked segments. */
   ctcp_clean_up_unacked_segment_list(state);
+
+  /* Acks may have made room in the send buffer. If reading stopped because it
+  ** was full, start again once half of it is free, so input keeps being read
+  ** in large blocks. */
+  if (state->tx_state.input_blocked &&
+      ctcp_send_buffer_space(state) >= SEND_BUFFER_SIZE(state) / 2)
+    ctcp_fill_send_buffer(state);
 }
 
 void ctcp_output(ctcp_state_t *state) {
 
   ll_node_t* front_node_ptr;
+  ll_node_t* node;
+  wrapped_rx_segment_t* wrapped_segment;
   ctcp_segment_t* ctcp_segment_ptr;
+  struct iovec iov[OUTPUT_BLOCK_SEGMENTS];
   size_t bufspace;
+  size_t len;
+  uint32_t seqno;
   int num_data_bytes;
   int return_value;
+  int num_segments;
+  int i;
   int num_segments_output = 0;
 
   if (state == NULL)
     return;
 
-  while (ll_length(state->rx_state.segments_to_output) != 0) {
-
-    // Grab the segment we're going to try to output.
-    front_node_ptr = ll_front(state->rx_state.segments_to_output);
-    ctcp_segment_ptr = (ctcp_segment_t*) front_node_ptr->object;
+  if (state->rx_state.received_bitmap != NULL) {
+    ctcp_output_placed(state);
+    return;
+  }
 
-    num_data_bytes = ntohs(ctcp_segment_ptr->len) - sizeof(ctcp_segment_t);
-    // Output any data in this segment.
-    if (num_data_bytes) {
+  while (ll_length(state->rx_state.segments_to_output) != 0) {
 
-      // Check the segment's sequence number. There might be a hole in
-      // segments_to_output, in which case we should give up.
-      if ( ntohl(ctcp_segment_ptr->seqno) != state->rx_state.last_seqno_accepted + 1)
-      {
-        return;
+    // Gather the data of the segments that are next in order, as many as
+    // there is bufspace for, up to and including a FIN.
+    bufspace = conn_bufspace(state->conn);
+    seqno = state->rx_state.last_seqno_accepted + 1;
+    len = 0;
+    num_segments = 0;
+    for (node = ll_front(state->rx_state.segments_to_output);
+         node != NULL && num_segments < OUTPUT_BLOCK_SEGMENTS;
+         node = node->next) {
+      ctcp_segment_ptr = ((wrapped_rx_segment_t*) node->object)->ctcp_segment;
+      num_data_bytes = ntohs(ctcp_segment_ptr->len) - sizeof(ctcp_segment_t);
+
+      if (num_data_bytes) {
+        // Check the segment's sequence number. There might be a hole in
+        // segments_to_output, in which case we should stop here.
+        if (ntohl(ctcp_segment_ptr->seqno) != seqno)
+          break;
+
+        // See if there's enough bufspace right now to output.
+        if (len + num_data_bytes > bufspace) {
+          // can't output the first one right now, try later.
+          if (num_segments == 0)
+            conn_count(state->conn, CONN_BUFSPACE_STALL);
+          break;
+        }
       }
 
-      // See if there's enough bufspace right now to output.
-      bufspace = conn_bufspace(state->conn);
-      if (bufspace < num_data_bytes) {
-        // can't send right now, give up and try later.
-        return;
-      }
+      iov[num_segments].iov_base = ctcp_segment_ptr->data;
+      iov[num_segments].iov_len = num_data_bytes;
+      num_segments++;
+      len += num_data_bytes;
+      seqno += num_data_bytes;
+      if (ctcp_segment_ptr->flags & TH_FIN)
+        break;
+    }
+    if (num_segments == 0)
+      break;
 
-      return_value = conn_output(state->conn, ctcp_segment_ptr->data, num_data_bytes);
+    // Output their data in one go.
+    if (len) {
+      return_value = conn_outputv(state->conn, iov, num_segments);
       if (return_value == -1) {
         #ifdef ENABLE_DBG_PRINTS
-        fprintf(stderr, "conn_output() returned -1\n");
+        fprintf(stderr, "conn_outputv() returned -1\n");
         #endif
 
         ctcp_destroy(state);
         return;
       }
-      assert(return_value == num_data_bytes);
-      num_segments_output++;
+      assert(return_value == len);
     }
 
-    // update rx_state.last_seqno_accepted
-    if (num_data_bytes) {
-      state->rx_state.last_seqno_accepted += num_data_bytes;
+    // They're out, so take them off the list.
+    for (i = 0; i < num_segments; i++) {
+      front_node_ptr = ll_front(state->rx_state.segments_to_output);
+      wrapped_segment = (wrapped_rx_segment_t*) front_node_ptr->object;
+      ctcp_segment_ptr = wrapped_segment->ctcp_segment;
+      num_data_bytes = ntohs(ctcp_segment_ptr->len) - sizeof(ctcp_segment_t);
+
+      // update rx_state.last_seqno_accepted
+      if (num_data_bytes) {
+        CTCP_TRACE(output, state->conn, ntohl(ctcp_segment_ptr->seqno),
+                   num_data_bytes);
+        state->rx_state.last_seqno_accepted += num_data_bytes;
+        num_segments_output++;
+      }
+
+      // If this segment's FIN flag is set, output EOF by setting length to 0,
+      // and update state.
+      if ((!state->rx_state.has_FIN_been_rxed) && (ctcp_segment_ptr->flags & TH_FIN)) {
+        state->rx_state.has_FIN_been_rxed = true;
+        #ifdef ENABLE_DBG_PRINTS
+        fprintf(stderr, "received FIN, incrementing state->rx_state.last_seqno_accepted\n");
+        #endif
+        state->rx_state.last_seqno_accepted++;
+        conn_output(state->conn, ctcp_segment_ptr->data, 0);
+        num_segments_output++;
+      }
+
+      // We've successfully output the segment, so remove it from the linked
+      // list.
+      conn_time(state->conn, CONN_REASSEMBLY_DELAY,
+                current_time_us() - wrapped_segment->time_received);
+      ctcp_free_rx_segment(state, wrapped_segment);
+      ll_remove(state->rx_state.segments_to_output, front_node_ptr);
     }
+  }
 
-    // If this segment's FIN flag is set, output EOF by setting length to 0,
-    // and update state.
-    if ((!state->rx_state.has_FIN_been_rxed) && (ctcp_segment_ptr->flags & TH_FIN)) {
-      state->rx_state.has_FIN_been_rxed = true;
+  if (num_segments_output) {
+    // Send an ack. Acking here (instead of in ctcp_receive) flow controls the
+    // sender until buffer space is available.
+    ctcp_send_control_segment(state);
+  }
+}
+
+int ctcp_place_segment(ctcp_state_t *state, ctcp_segment_t *segment) {
+
+  rx_state_t *rx = &state->rx_state;
+  uint32_t num_bits = state->ctcp_config.recv_window;
+  uint32_t offset = ntohl(segment->seqno) - 1;
+  uint16_t num_data_bytes = ctcp_get_num_data_bytes(segment);
+  uint32_t end = offset + num_data_bytes;
+  uint32_t bit, n;
+
+  // Output offsets are 32 bits like sequence numbers. Past MAX_STREAM_LEN
+  // they would wrap around and overwrite the start of the output, so give up
+  // on the connection instead.
+  if (num_data_bytes && (uint64_t) offset + num_data_bytes > MAX_STREAM_LEN) {
+    conn_flight_dump(state->conn, "stream longer than MAX_STREAM_LEN");
+    free(segment);
+    ctcp_destroy(state);
+    return -1;
+  }
+
+  if (segment->flags & TH_FIN) {
+    rx->FIN_pending = true;
+    rx->FIN_seqno = ntohl(segment->seqno) + num_data_bytes;
+  }
+
+  // ctcp_receive() already made sure the data is inside the receive window,
+  // so it can't overlap bytes from an earlier trip around the bitmap.
+  if (num_data_bytes) {
+    if (conn_output_at(state->conn, offset, (char*) segment->data, num_data_bytes) < 0) {
       #ifdef ENABLE_DBG_PRINTS
-      fprintf(stderr, "received FIN, incrementing state->rx_state.last_seqno_accepted\n");
+      fprintf(stderr, "conn_output_at() returned -1\n");
       #endif
-      state->rx_state.last_seqno_accepted++;
-      conn_output(state->conn, ctcp_segment_ptr->data, 0);
-      num_segments_output++;
+      free(segment);
+      ctcp_destroy(state);
+      return -1;
     }
+    CTCP_TRACE(output, state->conn, ntohl(segment->seqno), num_data_bytes);
+
+    // Set the bits a word at a time, stopping at the end of each word and
+    // where the bitmap wraps around.
+    while (offset < end) {
+      bit = offset % num_bits;
+      n = MIN(MIN(end - offset, 64 - (bit & 63)), num_bits - bit);
+      rx->received_bitmap[bit >> 6] |= BITMAP_MASK(n, bit & 63);
+      offset += n;
+    }
+  }
+
+  free(segment);
+  return 0;
+}
+
+void ctcp_free_rx_segment(ctcp_state_t *state,
+                          wrapped_rx_segment_t *wrapped_segment) {
+  rx_state_t *rx = &state->rx_state;
+
+  free(wrapped_segment->ctcp_segment);
+  if (rx->num_spare_wrappers < SPARE_RX_WRAPPERS)
+    rx->spare_wrappers[rx->num_spare_wrappers++] = wrapped_segment;
+  else
+    free(wrapped_segment);
+}
 
-    // We've successfully output the segment, so remove it from the linked
-    // list.
-    free(ctcp_segment_ptr);
-    ll_remove(state->rx_state.segments_to_output, front_node_ptr);
+void ctcp_output_placed(ctcp_state_t *state) {
+
+  rx_state_t *rx = &state->rx_state;
+  uint32_t num_bits = state->ctcp_config.recv_window;
+  uint32_t bit, n;
+  uint64_t word;
+  bool advanced = false;
+
+  // last_seqno_accepted is also the offset of the next byte we're missing.
+  // The bytes from there up to the first hole are the set bits from there up
+  // to the first clear one, which is found a word at a time.
+  for (;;) {
+    bit = rx->last_seqno_accepted % num_bits;
+    word = rx->received_bitmap[bit >> 6] >> (bit & 63);
+    n = ~word ? __builtin_ctzll(~word) : 64;
+    n = MIN(n, num_bits - bit);
+    if (n == 0)
+      break;
+    rx->received_bitmap[bit >> 6] &= ~BITMAP_MASK(n, bit & 63);
+    rx->last_seqno_accepted += n;
+    advanced = true;
   }
 
-  if (num_segments_output) {
-    // Send an ack. Acking here (instead of in ctcp_receive) flow controls the
-    // sender until buffer space is available.
+  // All the data before the FIN is out, so output EOF.
+  if (rx->FIN_pending && !rx->has_FIN_been_rxed &&
+      rx->FIN_seqno == rx->last_seqno_accepted + 1) {
+    rx->has_FIN_been_rxed = true;
+    rx->last_seqno_accepted++;
+    conn_output(state->conn, NULL, 0);
+    advanced = true;
+  }
+
+  if (advanced) {
     ctcp_send_control_segment(state);
   }
 }
@@ -770,6 +1244,12 @@ void ctcp_clean_up_unacked_segment_list(ctcp_state_t *state) {
               "Cleaning out acknowledged segment with seqno_of_last_byte: %d\n",
               seqno_of_last_byte);
       #endif
+      // Only time segments sent once, since it isn't known which of several
+      // transmissions was acked.
+      if (wrapped_ctcp_segment_ptr->num_xmits == 1)
+        conn_time(state->conn, CONN_RTT,
+                  current_time_us() - wrapped_ctcp_segment_ptr->time_sent);
+      shared_buf_unref(wrapped_ctcp_segment_ptr->shared);
       free(wrapped_ctcp_segment_ptr);
       ll_remove(state->tx_state.wrapped_unacked_segments, front_node_ptr);
     } else {
@@ -786,7 +1266,7 @@ void ctcp_send_control_segment(ctcp_state_t *state) {
   ctcp_segment.ackno = htonl(state->rx_state.last_seqno_accepted + 1);
   ctcp_segment.len   = sizeof(ctcp_segment_t);
   ctcp_segment.flags = TH_ACK;
-  ctcp_segment.window = htons(state->ctcp_config.recv_window);
+  ctcp_segment.window = WINDOW_FIELD(state->ctcp_config.recv_window);
   ctcp_segment.cksum = 0;
   ctcp_segment.cksum = cksum(&ctcp_segment, sizeof(ctcp_segment_t));
 
@@ -802,13 +1282,27 @@ uint16_t ctcp_get_num_data_bytes(ctcp_segment_t* ctcp_segment_ptr)
 void ctcp_timer() {
 
   ctcp_state_t * curr_state;
+  ctcp_state_t * next_state;
+  tx_state_t * tx;
 
   if (state_list == NULL) return;
 
-  for (curr_state = state_list; curr_state != NULL; curr_state = curr_state->next) {
+  // Grab the next state up front, since curr_state may be destroyed.
+  for (curr_state = state_list; curr_state != NULL; curr_state = next_state) {
+    next_state = curr_state->next;
 
     ctcp_output(curr_state);
-    ctcp_send_what_we_can(curr_state);
+    if (ctcp_send_what_we_can(curr_state) < 0)
+      continue;
+
+    /* Everything sent has been acked, so the input is idle for now. Give
+    ** back the buffers kept for the next read, which are most of an idle
+    ** connection's memory. */
+    tx = &curr_state->tx_state;
+    if (ll_length(tx->wrapped_unacked_segments) == 0) {
+      while (tx->num_spare_segments > 0)
+        free(tx->spare_segments[--tx->num_spare_segments]);
+    }
 
     /* See if we need close down the connection. We can do this if:
      *   - FIN has been received from the other end (i.e., they have no more data
@@ -839,3 +1333,12 @@ void ctcp_timer() {
     }
   }
 }
+
+void ctcp_get_info(ctcp_state_t *state, ctcp_info_t *info) {
+  info->last_ackno_rxed = state->tx_state.last_ackno_rxed;
+  info->last_seqno_sent = state->tx_state.last_seqno_sent;
+  info->last_seqno_accepted = state->rx_state.last_seqno_accepted;
+  info->unacked_segments = ll_length(state->tx_state.wrapped_unacked_segments);
+  info->segments_to_output = ll_length(state->rx_state.segments_to_output);
+  info->rt_timeout = state->ctcp_config.rt_timeout;
+}
@@ -13,7 +13,7 @@
 #include "ctcp_sys.h"
 
 /**
- * Maximum segment data size.
+ * Default maximum segment data size (MSS).
  *
  * For stop-and-wait, advertise a window of MAX_SEG_DATA_SIZE.
  * For sliding window, advertise a window of n * MAX_SEG_DATA_SIZE, where n is
@@ -25,6 +25,10 @@
  *
  * A sliding window of size n * MAX_SEG_DATA_SIZE may have more than n segments,
  * if not all the segments are of the full MAX_SEG_DATA_SIZE in size.
+ *
+ * The MSS can be changed with --mss, and is agreed on with the other host when
+ * connecting, so use the mss field of ctcp_config_t rather than this. Windows
+ * are then multiples of that MSS.
  */
 #define MAX_SEG_DATA_SIZE 1440
 
@@ -34,6 +38,13 @@
 // This is normally 60s, but I don't want to wait that long.
 #define MAX_SEG_LIFETIME_MS  4000
 
+/**
+ * Most data bytes one connection can carry, just under 4 GiB. Sequence numbers
+ * are 32 bits and start at 1, and the FIN and the ack after it take two more,
+ * so a longer stream would wrap around.
+ */
+#define MAX_STREAM_LEN (UINT32_MAX - 2)
+
 /**
  * cTCP flags.
  *
@@ -51,14 +62,16 @@
  * Use these values to adjust your cTCP implementation accordingly.
  */
 typedef struct {
-  uint16_t recv_window;    /* Receive window size (in multiples of
-                              MAX_SEG_DATA_SIZE) of THIS host. For Lab 1 this
-                              value will be 1 * MAX_SEG_DATA_SIZE */
-  uint16_t send_window;    /* Send window size (a.k.a. receive window size of
+  uint32_t recv_window;    /* Receive window size (in multiples of
+                              MAX_SEG_DATA_SIZE, or of mss) of THIS host. For
+                              Lab 1 this value will be 1 * MAX_SEG_DATA_SIZE */
+  uint32_t send_window;    /* Send window size (a.k.a. receive window size of
                               the OTHER host). For Lab 1 this value
                               will be 1 * MAX_SEG_DATA_SIZE */
   int timer;               /* How often ctcp_timer() is called, in ms */
   int rt_timeout;          /* Retransmission timeout, in ms */
+  uint16_t mss;            /* Maximum segment data size for this connection
+                              (MAX_SEG_DATA_SIZE unless changed with --mss) */
 } ctcp_config_t;
 
 /**
@@ -73,6 +86,20 @@ typedef struct {
 struct ctcp_state;
 typedef struct ctcp_state ctcp_state_t;
 
+/**
+ * What ctcp_get_info() reports about a connection.
+ */
+typedef struct {
+  uint32_t last_ackno_rxed;     /* Last ackno received from the other host */
+  uint32_t last_seqno_sent;     /* Sequence number of the last byte sent, not
+                                   counting retransmissions */
+  uint32_t last_seqno_accepted; /* Sequence number of the last byte received
+                                   in order */
+  unsigned int unacked_segments;   /* Segments sent but not yet acked */
+  unsigned int segments_to_output; /* Segments received but not yet output */
+  int rt_timeout;               /* Current retransmission timeout, in ms */
+} ctcp_info_t;
+
 
 ////////////////////////////////// YOUR CODE //////////////////////////////////
 
@@ -187,4 +214,15 @@ void ctcp_output(ctcp_state_t *state);
  */
 void ctcp_timer();
 
+/**
+ * Called by the library to describe a connection, for the "conns" command
+ * of the control socket (see --control). Called from the thread that owns
+ * the connection, so the state can be read without locks. Must not send,
+ * output or change the state.
+ *
+ * state: The connection state.
+ * info: Filled in with what the state holds.
+ */
+void ctcp_get_info(ctcp_state_t *state, ctcp_info_t *info);
+
 #endif /* CTCP_H */
@@ -0,0 +1,162 @@
+#include "ctcp_conn_table.h"
+
+/**
+ * Returns the hash bucket for an address. The number of buckets is always a
+ * power of two.
+ */
+static unsigned int ct_bucket(conn_table_t *table, in_addr_t ip_addr,
+                              int port) {
+  uint32_t h = (uint32_t) ip_addr ^ ((uint32_t) port * 0x9e3779b1);
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  return h & (table->capacity - 1);
+}
+
+/**
+ * Adds a slot to the front of its hash bucket's chain.
+ */
+static void ct_link(conn_table_t *table, unsigned int slot) {
+  ct_entry_t *entry = &table->slots[slot];
+  unsigned int bucket = ct_bucket(table, entry->ip_addr, entry->port);
+  entry->next = table->buckets[bucket];
+  table->buckets[bucket] = slot;
+}
+
+/**
+ * Removes a slot from its hash bucket's chain.
+ */
+static void ct_unlink(conn_table_t *table, unsigned int slot) {
+  ct_entry_t *entry = &table->slots[slot];
+  int *curr = &table->buckets[ct_bucket(table, entry->ip_addr, entry->port)];
+  while (*curr != slot)
+    curr = &table->slots[*curr].next;
+  *curr = entry->next;
+}
+
+conn_table_t *ct_create(unsigned int max_length) {
+  conn_table_t *table = calloc(sizeof(conn_table_t), 1);
+  table->capacity = CT_INITIAL_CAPACITY;
+  table->slots = calloc(sizeof(ct_entry_t), table->capacity);
+  table->free_slots = calloc(sizeof(unsigned int), table->capacity);
+  table->buckets = malloc(sizeof(int) * table->capacity);
+  memset(table->buckets, -1, sizeof(int) * table->capacity);
+  table->length = 0;
+  table->max_length = max_length;
+  table->num_free = 0;
+  return table;
+}
+
+void ct_destroy(conn_table_t *table) {
+  if (table == NULL)
+    return;
+
+  free(table->slots);
+  free(table->free_slots);
+  free(table->buckets);
+  free(table);
+}
+
+/**
+ * Doubles the number of slots in a table and rehashes the slots in use.
+ *
+ * returns: 0 on success, -1 if memory could not be allocated.
+ */
+static int ct_grow(conn_table_t *table) {
+  unsigned int capacity = table->capacity * 2;
+  unsigned int slot;
+
+  ct_entry_t *slots = realloc(table->slots, capacity * sizeof(ct_entry_t));
+  if (slots == NULL)
+    return -1;
+  table->slots = slots;
+
+  unsigned int *free_slots = realloc(table->free_slots,
+                                     capacity * sizeof(unsigned int));
+  if (free_slots == NULL)
+    return -1;
+  table->free_slots = free_slots;
+
+  int *buckets = realloc(table->buckets, capacity * sizeof(int));
+  if (buckets == NULL)
+    return -1;
+  table->buckets = buckets;
+
+  memset(table->slots + table->capacity, 0,
+         (capacity - table->capacity) * sizeof(ct_entry_t));
+  memset(table->buckets, -1, capacity * sizeof(int));
+  table->capacity = capacity;
+
+  /* Bucket numbers depend on the capacity, so rebuild every chain. */
+  for (slot = 0; slot < capacity / 2; slot++) {
+    if (table->slots[slot].object != NULL)
+      ct_link(table, slot);
+  }
+  return 0;
+}
+
+int ct_add(conn_table_t *table, in_addr_t ip_addr, int port, void *object) {
+  if (table == NULL || object == NULL)
+    return -1;
+
+  /* Table is at its limit. */
+  if (table->max_length && table->length >= table->max_length)
+    return -1;
+
+  /* Reuse a slot from a removed object if there is one. Otherwise take the
+     next unused slot, growing the table if all slots have been used. */
+  unsigned int slot;
+  if (table->num_free > 0) {
+    slot = table->free_slots[--table->num_free];
+  }
+  else {
+    if (table->length == table->capacity && ct_grow(table) < 0)
+      return -1;
+    slot = table->length;
+  }
+
+  ct_entry_t *entry = &table->slots[slot];
+  entry->object = object;
+  entry->ip_addr = ip_addr;
+  entry->port = port;
+  ct_link(table, slot);
+
+  table->length++;
+  return slot;
+}
+
+void *ct_remove(conn_table_t *table, int slot) {
+  void *object = ct_get(table, slot);
+  if (object == NULL)
+    return NULL;
+
+  ct_unlink(table, slot);
+  table->slots[slot].object = NULL;
+  table->free_slots[table->num_free++] = slot;
+  table->length--;
+  return object;
+}
+
+void *ct_find(conn_table_t *table, in_addr_t ip_addr, int port) {
+  if (table == NULL)
+    return NULL;
+
+  int slot = table->buckets[ct_bucket(table, ip_addr, port)];
+  while (slot >= 0) {
+    ct_entry_t *entry = &table->slots[slot];
+    if (entry->port == port && entry->ip_addr == ip_addr)
+      return entry->object;
+    slot = entry->next;
+  }
+  return NULL;
+}
+
+void *ct_get(conn_table_t *table, int slot) {
+  if (table == NULL || slot < 0 || slot >= table->capacity)
+    return NULL;
+  return table->slots[slot].object;
+}
+
+unsigned int ct_length(conn_table_t *table) {
+  return table->length;
+}
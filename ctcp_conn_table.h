@@ -0,0 +1,113 @@
+/******************************************************************************
+ * ctcp_conn_table.h
+ * -----------------
+ * Connection table. Stores the connections of a host in a growable array of
+ * slots. Slots are handed out when a connection is added and reclaimed when it
+ * is removed, so a long-running server can keep accepting new clients.
+ *
+ * Connections are also indexed by the address of the other host (IP address
+ * and port) in a hash table, so the connection an incoming packet belongs to
+ * can be found in constant time.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_CONN_TABLE_H
+#define CTCP_CONN_TABLE_H
+
+#include "ctcp_sys.h"
+
+/** Initial number of slots in a connection table. */
+#define CT_INITIAL_CAPACITY 16
+
+/** A slot in the connection table. */
+struct ct_entry {
+  void *object;                /* Object stored in this slot, NULL if the
+                                  slot is free */
+  in_addr_t ip_addr;           /* IP address of the other host */
+  int port;                    /* Port of the other host */
+  int next;                    /* Next slot in the same hash bucket, -1 if
+                                  this is the last one */
+};
+typedef struct ct_entry ct_entry_t;
+
+/** A table of connections. */
+struct conn_table {
+  ct_entry_t *slots;           /* Slots, indexed by the value ct_add()
+                                  returns */
+  unsigned int capacity;       /* Number of slots allocated */
+  unsigned int length;         /* Number of slots in use */
+  unsigned int max_length;     /* Maximum number of slots in use, 0 if there
+                                  is no limit */
+
+  unsigned int *free_slots;    /* Stack of slots that can be reused */
+  unsigned int num_free;       /* Number of slots on the stack */
+
+  int *buckets;                /* Hash buckets. Each holds the first slot in
+                                  its chain, or -1 if empty. There are as
+                                  many buckets as slots */
+};
+typedef struct conn_table conn_table_t;
+
+
+/**
+ * Creates a new connection table and returns it. This must be freed later
+ * with ct_destroy().
+ *
+ * max_length: Maximum number of connections the table can hold, or 0 if there
+ *             is no limit.
+ * returns: The new connection table.
+ */
+conn_table_t *ct_create(unsigned int max_length);
+
+/**
+ * Destroys a connection table. This DOES NOT free up the memory taken up by
+ * the objects contained within the table.
+ *
+ * table: The table to destroy.
+ */
+void ct_destroy(conn_table_t *table);
+
+/**
+ * Adds an object to the table, growing the table if needed. Addresses should
+ * be unique. If they are not, ct_find() returns one of the matching objects.
+ *
+ * table: The table to add to.
+ * ip_addr: IP address of the other host.
+ * port: Port of the other host.
+ * object: The object to add.
+ * returns: The slot the object was stored in, or -1 if the table is full or
+ *          either table or object is NULL.
+ */
+int ct_add(conn_table_t *table, in_addr_t ip_addr, int port, void *object);
+
+/**
+ * Removes the object in a slot and makes the slot available for reuse.
+ *
+ * table: The table to remove from.
+ * slot: The slot returned by ct_add().
+ * returns: The object that was stored in the slot, or NULL if the slot is not
+ *          in use.
+ */
+void *ct_remove(conn_table_t *table, int slot);
+
+/**
+ * Finds the object associated with the address of another host.
+ *
+ * table: The table to search in.
+ * ip_addr: IP address of the other host.
+ * port: Port of the other host.
+ * returns: The object if found, NULL otherwise.
+ */
+void *ct_find(conn_table_t *table, in_addr_t ip_addr, int port);
+
+/**
+ * Returns the object stored in a slot, or NULL if the slot is not in use.
+ */
+void *ct_get(conn_table_t *table, int slot);
+
+/**
+ * Returns the number of objects in the table.
+ */
+unsigned int ct_length(conn_table_t *table);
+
+#endif /* CTCP_CONN_TABLE_H */
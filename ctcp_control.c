@@ -0,0 +1,195 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include "ctcp_control.h"
+#include "ctcp_utils.h"
+
+struct control_client {
+  ev_handler_t handler;        /* Watches the connection */
+  int fd;                      /* The connection */
+  char line[CONTROL_MAX_LINE]; /* Command line read so far */
+  size_t len;                  /* Length of the line */
+  bool running;                /* Whether its command has been run */
+  const control_command_t *command; /* The command, NULL for the help */
+  char *reply;                 /* Response, once the command has run */
+  size_t reply_len;            /* Length of the response */
+  size_t sent;                 /* How much of it has been sent */
+};
+
+/** The control socket. There is one per process. */
+static struct {
+  ev_loop_t *loop;             /* Loop clients are served from */
+  int fd;                      /* Listening socket */
+  ev_handler_t handler;
+  const control_command_t *commands;
+  int num_commands;
+} control;
+
+/**
+ * Closes a client's connection and frees it. A command still working on the
+ * response is told to forget the client.
+ */
+static void control_close(control_client_t *client) {
+  if (client->reply == NULL && client->command != NULL &&
+      client->command->cancel != NULL)
+    client->command->cancel(client);
+  ev_remove(control.loop, &client->handler);
+  close(client->fd);
+  free(client->reply);
+  free(client);
+}
+
+/**
+ * Sends as much of the response as the connection takes. Closes it once all
+ * of it is sent, or on an error.
+ */
+static void control_write(control_client_t *client) {
+  ssize_t w;
+
+  while (client->sent < client->reply_len) {
+    w = send(client->fd, client->reply + client->sent,
+             client->reply_len - client->sent, MSG_NOSIGNAL);
+    if (w < 0 && errno == EAGAIN)
+      return;
+    if (w <= 0)
+      break;
+    client->sent += w;
+  }
+  control_close(client);
+}
+
+void control_reply(control_client_t *client, char *buf, size_t len) {
+  client->reply = buf;
+  client->reply_len = len;
+  ev_modify(control.loop, &client->handler, EV_WRITE);
+  control_write(client);
+}
+
+/**
+ * Replies with the list of commands.
+ */
+static void control_help(control_client_t *client, const char *command) {
+  char *buf = NULL;
+  size_t len;
+  FILE *out = open_memstream(&buf, &len);
+  int i;
+
+  if (*command)
+    fprintf(out, "Unknown command: %s\n", command);
+  fprintf(out, "Commands:\n");
+  for (i = 0; i < control.num_commands; i++) {
+    fprintf(out, "  %-10s %s\n", control.commands[i].name,
+            control.commands[i].help);
+  }
+  fclose(out);
+  control_reply(client, buf, len);
+}
+
+/**
+ * Runs the command on the line a client sent.
+ */
+static void control_run(control_client_t *client) {
+  char *command = client->line;
+  int i;
+
+  client->line[client->len] = '\0';
+  command[strcspn(command, " \t\r\n")] = '\0';
+
+  /* Nothing more is read from the client. */
+  client->running = true;
+  ev_modify(control.loop, &client->handler, 0);
+  for (i = 0; i < control.num_commands; i++) {
+    if (strcmp(command, control.commands[i].name) == 0) {
+      client->command = &control.commands[i];
+      control.commands[i].run(client);
+      return;
+    }
+  }
+  control_help(client, command);
+}
+
+/**
+ * Called by the event loop when a client's connection is ready. Reads the
+ * command line until a newline or EOF, then sends the response. While the
+ * command is running, nothing is read, but a client that hangs up is closed.
+ *
+ * handler: The client's handler.
+ * events: The events that occurred.
+ */
+static void on_control_client(ev_handler_t *handler, uint32_t events) {
+  control_client_t *client = handler->arg;
+  ssize_t r;
+
+  if (client->reply != NULL) {
+    control_write(client);
+    return;
+  }
+  if (client->running) {
+    if (events & EV_HUP)
+      control_close(client);
+    return;
+  }
+
+  r = read(client->fd, client->line + client->len,
+           sizeof(client->line) - 1 - client->len);
+  if (r < 0 && errno == EAGAIN)
+    return;
+  if (r < 0) {
+    control_close(client);
+    return;
+  }
+  client->len += r;
+  if (r > 0 && memchr(client->line, '\n', client->len) == NULL &&
+      client->len < sizeof(client->line) - 1)
+    return;
+  control_run(client);
+}
+
+/**
+ * Called by the event loop when clients connect.
+ *
+ * handler: The listening socket's handler.
+ * events: The events that occurred.
+ */
+static void on_control_accept(ev_handler_t *handler, uint32_t events) {
+  control_client_t *client;
+  int fd;
+
+  while ((fd = accept4(control.fd, NULL, NULL,
+                       SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+    client = calloc(1, sizeof(control_client_t));
+    client->fd = fd;
+    if (ev_add(control.loop, &client->handler, fd, EV_READ, on_control_client,
+               client) < 0) {
+      close(fd);
+      free(client);
+    }
+  }
+}
+
+int control_listen(ev_loop_t *loop, const char *path,
+                   const control_command_t *commands, int num_commands) {
+  struct sockaddr_un addr;
+  int fd;
+
+  if (strlen(path) >= sizeof(addr.sun_path))
+    return -1;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+  unlink(path);
+  if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+      listen(fd, 16) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  control.loop = loop;
+  control.fd = fd;
+  control.commands = commands;
+  control.num_commands = num_commands;
+  return ev_add(loop, &control.handler, fd, EV_READ, on_control_accept, NULL);
+}
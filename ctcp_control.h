@@ -0,0 +1,62 @@
+/******************************************************************************
+ * ctcp_control.h
+ * --------------
+ * Control socket (see --control). Clients connect to a Unix stream socket,
+ * send a command on a line of its own, and get back the response, after which
+ * the connection is closed. Commands are read and responses written from the
+ * event loop without blocking, so a slow client never holds up the
+ * connections. See ctcpctl.c for a client.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_CONTROL_H
+#define CTCP_CONTROL_H
+
+#include "ctcp_event_loop.h"
+
+/** Longest command line read from a client. */
+#define CONTROL_MAX_LINE 128
+
+/** A client of the control socket. Definition can be found in
+    ctcp_control.c. */
+struct control_client;
+typedef struct control_client control_client_t;
+
+/** A command clients can send. */
+typedef struct control_command {
+  const char *name;            /* What the client sends */
+  const char *help;            /* What it does, for the list of commands */
+  void (*run)(control_client_t *client); /* Runs the command. Must call
+                                            control_reply(), now or later */
+  void (*cancel)(control_client_t *client); /* Called if the client hangs
+                                               up before control_reply(),
+                                               which must then not be
+                                               called. NULL if the command
+                                               always replies right away */
+} control_command_t;
+
+
+/**
+ * Creates the control socket and registers it with an event loop. Any old
+ * socket file at the path is removed first.
+ *
+ * loop: The event loop. Clients are served from it.
+ * path: Path of the socket.
+ * commands: Commands clients can send. The array is not copied.
+ * num_commands: Number of commands.
+ * returns: 0 on success, -1 on failure.
+ */
+int control_listen(ev_loop_t *loop, const char *path,
+                   const control_command_t *commands, int num_commands);
+
+/**
+ * Sends the response to a command, then closes the connection. Must be
+ * called from the event loop's thread.
+ *
+ * client: The client that sent the command.
+ * buf: The response, allocated with malloc(). It is freed once sent.
+ * len: Length of the response.
+ */
+void control_reply(control_client_t *client, char *buf, size_t len);
+
+#endif /* CTCP_CONTROL_H */
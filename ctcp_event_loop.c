@@ -0,0 +1,290 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "ctcp_event_loop.h"
+#include "ctcp_io_uring.h"
+
+/** Maximum number of ready events handled per call to epoll_wait(). */
+#define EV_MAX_EVENTS 64
+
+/** An event loop backed by epoll or io_uring. */
+struct ev_loop {
+  ev_backend_t backend;
+  uring_t *ring;                         /* io_uring instance */
+  int epfd;                              /* epoll instance */
+  ev_handler_t *always_ready;            /* Handlers epoll cannot watch */
+  struct epoll_event ready[EV_MAX_EVENTS];
+  int next_ready;                        /* Next of the ready events to */
+  int num_ready;                         /* dispatch, and how many there are */
+};
+
+/**
+ * Converts EV_* flags to edge-triggered epoll flags.
+ */
+static uint32_t ev_to_epoll(uint32_t events) {
+  uint32_t flags = EPOLLET;
+  if (events & EV_READ)
+    flags |= EPOLLIN | EPOLLRDHUP;
+  if (events & EV_WRITE)
+    flags |= EPOLLOUT;
+  return flags;
+}
+
+/**
+ * Converts epoll flags to EV_* flags.
+ */
+static uint32_t ev_from_epoll(uint32_t flags) {
+  uint32_t events = 0;
+  if (flags & EPOLLIN)
+    events |= EV_READ;
+  if (flags & EPOLLOUT)
+    events |= EV_WRITE;
+  if (flags & (EPOLLHUP | EPOLLRDHUP | EPOLLERR))
+    events |= EV_HUP;
+  return events;
+}
+
+ev_loop_t *ev_create(ev_backend_t backend) {
+  ev_loop_t *loop = calloc(sizeof(ev_loop_t), 1);
+  loop->backend = backend;
+  loop->epfd = -1;
+  loop->always_ready = NULL;
+
+  if (backend == EV_IO_URING) {
+    loop->ring = uring_create();
+    if (loop->ring == NULL) {
+      free(loop);
+      return NULL;
+    }
+    return loop;
+  }
+
+  loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (loop->epfd < 0) {
+    free(loop);
+    return NULL;
+  }
+  return loop;
+}
+
+void ev_destroy(ev_loop_t *loop) {
+  if (loop == NULL)
+    return;
+
+  if (loop->ring)
+    uring_destroy(loop->ring);
+  if (loop->epfd >= 0)
+    close(loop->epfd);
+  free(loop);
+}
+
+ev_backend_t ev_backend(ev_loop_t *loop) {
+  return loop->backend;
+}
+
+int ev_add(ev_loop_t *loop, ev_handler_t *handler, int fd, uint32_t events,
+           ev_callback_t callback, void *arg) {
+  if (loop == NULL || handler == NULL || callback == NULL)
+    return -1;
+
+  handler->fd = fd;
+  handler->events = events;
+  handler->callback = callback;
+  handler->arg = arg;
+  handler->recv_callback = NULL;
+  handler->recv_buf = NULL;
+  handler->recv_size = 0;
+  handler->op = NULL;
+  handler->always_ready = false;
+  handler->next_always = NULL;
+  handler->prev_always = NULL;
+
+  if (loop->ring)
+    return uring_poll(loop->ring, handler);
+
+  struct epoll_event ev;
+  ev.events = ev_to_epoll(events);
+  ev.data.ptr = handler;
+  if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) == 0)
+    return 0;
+
+  /* Regular files (e.g. STDIN redirected from a file) cannot be watched by
+     epoll. They never block, so treat them as always ready. */
+  if (errno != EPERM)
+    return -1;
+
+  handler->always_ready = true;
+  handler->next_always = loop->always_ready;
+  handler->prev_always = &loop->always_ready;
+  if (loop->always_ready)
+    loop->always_ready->prev_always = &handler->next_always;
+  loop->always_ready = handler;
+  return 0;
+}
+
+/**
+ * [epoll only]
+ * Called when a socket registered with ev_add_recv() is ready. Receives until
+ * there are no packets left, since readiness is edge-triggered.
+ */
+static void ev_recv_ready(ev_handler_t *handler, uint32_t events) {
+  int len;
+
+  /* Stop if the callback removes the handler. */
+  while (handler->callback != NULL) {
+    memset(handler->recv_buf, 0, handler->recv_size);
+    len = recv(handler->fd, handler->recv_buf, handler->recv_size,
+               MSG_DONTWAIT);
+    if (len < 0)
+      break;
+    handler->recv_callback(handler, handler->recv_buf, len);
+  }
+}
+
+int ev_add_recv(ev_loop_t *loop, ev_handler_t *handler, int fd, size_t size,
+                ev_recv_callback_t callback, void *arg) {
+  if (loop == NULL || handler == NULL || callback == NULL)
+    return -1;
+
+  /* With epoll, wait for the socket to be readable and receive from it in
+     ev_recv_ready(). io_uring receives on its own. */
+  if (ev_add(loop, handler, fd, loop->ring ? 0 : EV_READ, ev_recv_ready,
+             arg) < 0)
+    return -1;
+  handler->recv_callback = callback;
+  handler->recv_size = size;
+
+  if (loop->ring) {
+    handler->events = EV_READ;
+    if (uring_recv(loop->ring, handler) < 0) {
+      handler->callback = NULL;
+      return -1;
+    }
+    return 0;
+  }
+
+  handler->recv_buf = malloc(size);
+  return 0;
+}
+
+int ev_modify(ev_loop_t *loop, ev_handler_t *handler, uint32_t events) {
+  if (loop == NULL || handler == NULL)
+    return -1;
+  if (handler->events == events)
+    return 0;
+
+  handler->events = events;
+  if (loop->ring)
+    return uring_poll(loop->ring, handler);
+  if (handler->always_ready)
+    return 0;
+
+  struct epoll_event ev;
+  ev.events = ev_to_epoll(events);
+  ev.data.ptr = handler;
+  return epoll_ctl(loop->epfd, EPOLL_CTL_MOD, handler->fd, &ev);
+}
+
+void ev_remove(ev_loop_t *loop, ev_handler_t *handler) {
+  if (loop == NULL || handler == NULL || handler->callback == NULL)
+    return;
+
+  if (loop->ring) {
+    uring_remove(loop->ring, handler);
+  }
+  else if (handler->always_ready) {
+    if (handler->next_always)
+      handler->next_always->prev_always = handler->prev_always;
+    *handler->prev_always = handler->next_always;
+  }
+  else {
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, handler->fd, NULL);
+
+    /* The handler may be freed as soon as this returns, so forget events for
+       it that are still to be dispatched. */
+    int i;
+    for (i = loop->next_ready; i < loop->num_ready; i++) {
+      if (loop->ready[i].data.ptr == handler)
+        loop->ready[i].data.ptr = NULL;
+    }
+  }
+  free(handler->recv_buf);
+  handler->recv_buf = NULL;
+  handler->callback = NULL;
+}
+
+int ev_send(ev_loop_t *loop, int fd, const void *buf, size_t len,
+            const struct sockaddr *addr, socklen_t addrlen) {
+  if (loop->ring)
+    return uring_send(loop->ring, fd, buf, len, addr, addrlen);
+  return sendto(fd, buf, len, 0, addr, addrlen);
+}
+
+bool ev_async_writes(ev_loop_t *loop) {
+  return loop->ring != NULL;
+}
+
+ev_op_t *ev_writev(ev_loop_t *loop, int fd, const struct iovec *iov,
+                   int iovcnt, ev_write_callback_t callback, void *arg) {
+  if (loop->ring == NULL || callback == NULL || iovcnt < 1 ||
+      iovcnt > EV_MAX_IOV)
+    return NULL;
+  return uring_writev(loop->ring, fd, iov, iovcnt, callback, arg);
+}
+
+void ev_cancel(ev_loop_t *loop, ev_op_t *op, void *buf) {
+  if (loop->ring && op)
+    uring_cancel(loop->ring, op, buf);
+  else
+    free(buf);
+}
+
+void ev_flush(ev_loop_t *loop) {
+  if (loop->ring)
+    uring_submit(loop->ring);
+}
+
+int ev_wait(ev_loop_t *loop, int timeout) {
+  ev_handler_t *handler, *next;
+  int dispatched = 0;
+  int n, i;
+
+  if (loop->ring)
+    return uring_wait(loop->ring, timeout);
+
+  /* Don't sleep if there are descriptors that are always ready and wanted. */
+  for (handler = loop->always_ready; handler; handler = handler->next_always) {
+    if (handler->events != 0) {
+      timeout = 0;
+      break;
+    }
+  }
+
+  n = epoll_wait(loop->epfd, loop->ready, EV_MAX_EVENTS, timeout);
+  if (n < 0 && errno != EINTR)
+    return -1;
+
+  /* Dispatch only the handlers that are ready, and still registered. */
+  loop->num_ready = n;
+  for (loop->next_ready = 0; loop->next_ready < n;) {
+    i = loop->next_ready++;
+    handler = loop->ready[i].data.ptr;
+    if (handler == NULL || handler->callback == NULL)
+      continue;
+    handler->callback(handler, ev_from_epoll(loop->ready[i].events));
+    dispatched++;
+  }
+  loop->num_ready = 0;
+
+  for (handler = loop->always_ready; handler; handler = next) {
+    next = handler->next_always;
+    if (handler->events == 0)
+      continue;
+    handler->callback(handler, handler->events);
+    dispatched++;
+  }
+  return dispatched;
+}
@@ -0,0 +1,261 @@
+/******************************************************************************
+ * ctcp_event_loop.h
+ * -----------------
+ * Event loop (reactor) used by the cTCP library to wait for input, output and
+ * network readiness. File descriptors are registered along with a callback
+ * that is invoked when the descriptor becomes ready. Readiness is
+ * edge-triggered, so a callback must read or write until the descriptor
+ * returns EAGAIN before it will be invoked again.
+ *
+ * There are two backends, chosen when the loop is created:
+ *   - epoll: Readiness is reported by epoll, and all I/O is done by the caller
+ *     with ordinary system calls.
+ *   - io_uring: Readiness is reported by multishot polls. Sockets registered
+ *     with ev_add_recv() keep a multishot receive posted, so packets arrive
+ *     without a system call each. Sends (ev_send()) and writes (ev_writev())
+ *     are queued and submitted together on the next call to ev_wait(), so a
+ *     whole batch costs one system call.
+ * ev_add_recv() and ev_send() work with either backend. ev_writev() is only
+ * available with io_uring (see ev_async_writes()).
+ *
+ * Implementations can be found in ctcp_event_loop.c and ctcp_io_uring.c.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_EVENT_LOOP_H
+#define CTCP_EVENT_LOOP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+/** Maximum number of buffers written by one ev_writev(). */
+#define EV_MAX_IOV 4
+
+/** Readiness events a handler can be interested in. */
+#define EV_READ  0x1
+#define EV_WRITE 0x2
+#define EV_HUP   0x4
+
+/** Event loop backends. */
+typedef enum {
+  EV_EPOLL,
+  EV_IO_URING
+} ev_backend_t;
+
+struct ev_handler;
+
+/**
+ * Callback invoked when a registered file descriptor becomes ready.
+ *
+ * handler: The handler that was registered for the file descriptor.
+ * events: The events that occurred (EV_READ, EV_WRITE, EV_HUP).
+ */
+typedef void (*ev_callback_t)(struct ev_handler *handler, uint32_t events);
+
+/**
+ * Callback invoked for each packet received on a socket registered with
+ * ev_add_recv().
+ *
+ * handler: The handler that was registered for the socket.
+ * buf: The packet. The rest of the buffer, up to the size given to
+ *      ev_add_recv(), is zeroed. Only valid until the callback returns.
+ * len: Length of the packet.
+ */
+typedef void (*ev_recv_callback_t)(struct ev_handler *handler, char *buf,
+                                   int len);
+
+/**
+ * Callback invoked when a write started with ev_writev() completes.
+ *
+ * arg: The argument given to ev_writev().
+ * result: Number of bytes written, or a negative errno value on failure.
+ */
+typedef void (*ev_write_callback_t)(void *arg, int result);
+
+/** An operation in progress (io_uring only). Definition can be found in
+    ctcp_io_uring.c. */
+struct ev_op;
+typedef struct ev_op ev_op_t;
+
+/**
+ * A file descriptor registered with the event loop. Handlers are owned by the
+ * caller (usually embedded in a larger struct) and must stay valid until they
+ * are removed with ev_remove().
+ */
+struct ev_handler {
+  int fd;                         /* File descriptor being watched */
+  uint32_t events;                /* Events this handler is interested in */
+  ev_callback_t callback;         /* Called when the descriptor is ready */
+  void *arg;                      /* Passed back to the callback */
+
+  ev_recv_callback_t recv_callback; /* Called for each packet, if added with
+                                       ev_add_recv() */
+  char *recv_buf;                 /* Buffer packets are received into
+                                     (epoll) */
+  size_t recv_size;               /* Size of each receive buffer */
+  ev_op_t *op;                    /* Poll or receive posted for this
+                                     handler (io_uring) */
+
+  bool always_ready;              /* Descriptor cannot be watched by epoll
+                                     (e.g. a regular file), so it is
+                                     treated as always ready */
+  struct ev_handler *next_always; /* List of always-ready handlers */
+  struct ev_handler **prev_always;
+};
+typedef struct ev_handler ev_handler_t;
+
+/** An event loop. Definition can be found in ctcp_event_loop.c. */
+struct ev_loop;
+typedef struct ev_loop ev_loop_t;
+
+
+/**
+ * Creates a new event loop. This must be freed later with ev_destroy().
+ *
+ * backend: The backend to use.
+ * returns: The new event loop, or NULL on failure (e.g. io_uring is not
+ *          supported by the kernel).
+ */
+ev_loop_t *ev_create(ev_backend_t backend);
+
+/**
+ * Returns the backend an event loop was created with.
+ */
+ev_backend_t ev_backend(ev_loop_t *loop);
+
+/**
+ * Destroys an event loop. Registered handlers are not freed, and the file
+ * descriptors they refer to are not closed.
+ *
+ * loop: The loop to destroy.
+ */
+void ev_destroy(ev_loop_t *loop);
+
+/**
+ * Registers a file descriptor with the event loop.
+ *
+ * loop: The event loop.
+ * handler: Handler to register. Its fields are filled in by this function.
+ * fd: File descriptor to watch. Should be non-blocking.
+ * events: Events to watch for (EV_READ and/or EV_WRITE).
+ * callback: Function to call when the file descriptor is ready.
+ * arg: Argument stored in the handler for use by the callback.
+ * returns: 0 on success, -1 on failure.
+ */
+int ev_add(ev_loop_t *loop, ev_handler_t *handler, int fd, uint32_t events,
+           ev_callback_t callback, void *arg);
+
+/**
+ * Registers a datagram socket with the event loop. The callback is invoked
+ * once for every packet received, until the handler is removed.
+ *
+ * loop: The event loop.
+ * handler: Handler to register. Its fields are filled in by this function.
+ * fd: Socket to receive from.
+ * size: Size of the buffer each packet is received into. Longer packets are
+ *       truncated.
+ * callback: Function to call for each packet.
+ * arg: Argument stored in the handler for use by the callback.
+ * returns: 0 on success, -1 on failure.
+ */
+int ev_add_recv(ev_loop_t *loop, ev_handler_t *handler, int fd, size_t size,
+                ev_recv_callback_t callback, void *arg);
+
+/**
+ * Changes the events a registered handler is interested in. If the descriptor
+ * is already ready for one of the new events, the callback will be invoked on
+ * the next call to ev_wait().
+ *
+ * loop: The event loop.
+ * handler: A registered handler.
+ * events: New set of events to watch for.
+ * returns: 0 on success, -1 on failure.
+ */
+int ev_modify(ev_loop_t *loop, ev_handler_t *handler, uint32_t events);
+
+/**
+ * Unregisters a handler. Must be called before the file descriptor is closed
+ * or the handler's memory is freed. Does nothing if the handler was never
+ * registered.
+ *
+ * loop: The event loop.
+ * handler: The handler to remove.
+ */
+void ev_remove(ev_loop_t *loop, ev_handler_t *handler);
+
+/**
+ * Sends a packet to an address, like sendto(). With io_uring, the packet is
+ * copied and queued, and is sent the next time the loop submits work (see
+ * ev_flush()). Errors are then not reported, as if the packet was lost.
+ *
+ * loop: The event loop.
+ * fd: Socket to send from.
+ * buf: The packet.
+ * len: Length of the packet.
+ * addr: Destination address.
+ * addrlen: Size of the destination address.
+ * returns: Number of bytes sent or queued, or -1 on failure.
+ */
+int ev_send(ev_loop_t *loop, int fd, const void *buf, size_t len,
+            const struct sockaddr *addr, socklen_t addrlen);
+
+/**
+ * Returns true if the loop supports ev_writev().
+ */
+bool ev_async_writes(ev_loop_t *loop);
+
+/**
+ * [io_uring only]
+ * Starts writing buffers to a file descriptor, like writev(). The iovec array
+ * is copied, but the buffers are not, so they must stay valid until the
+ * callback is invoked or the write is cancelled. Like writev(), fewer bytes
+ * than requested may be written, and -EAGAIN is returned if a non-blocking
+ * descriptor is full.
+ *
+ * loop: The event loop.
+ * fd: File descriptor to write to.
+ * iov: Buffers to write.
+ * iovcnt: Number of buffers, at most EV_MAX_IOV.
+ * callback: Called from ev_wait() when the write completes.
+ * arg: Passed back to the callback.
+ * returns: The write in progress, or NULL on failure.
+ */
+ev_op_t *ev_writev(ev_loop_t *loop, int fd, const struct iovec *iov,
+                   int iovcnt, ev_write_callback_t callback, void *arg);
+
+/**
+ * [io_uring only]
+ * Cancels a write started with ev_writev(). Its callback will not be invoked.
+ * The write may already be under way, so the memory its buffers are in is
+ * handed over, and freed once the kernel is done with it.
+ *
+ * loop: The event loop.
+ * op: The write returned by ev_writev().
+ * buf: Memory the write's buffers are in, allocated with malloc(), or NULL.
+ */
+void ev_cancel(ev_loop_t *loop, ev_op_t *op, void *buf);
+
+/**
+ * Submits queued work right away instead of on the next call to ev_wait().
+ * Does nothing with epoll.
+ *
+ * loop: The event loop.
+ */
+void ev_flush(ev_loop_t *loop);
+
+/**
+ * Waits up to timeout milliseconds for registered file descriptors to become
+ * ready, and invokes the callbacks of those that are. Only ready handlers are
+ * visited, so the cost of a call does not depend on how many handlers are
+ * registered. With io_uring, queued work is submitted in the same system call.
+ *
+ * loop: The event loop.
+ * timeout: Maximum time to wait, in milliseconds. -1 waits forever.
+ * returns: The number of callbacks invoked, or -1 on error.
+ */
+int ev_wait(ev_loop_t *loop, int timeout);
+
+#endif /* CTCP_EVENT_LOOP_H */
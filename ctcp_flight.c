@@ -0,0 +1,35 @@
+#include "ctcp_flight.h"
+#include "ctcp_utils.h"
+
+/** Names of the events, in the order they are numbered. */
+static const char *flight_names[NUM_FLIGHT_EVENTS] = {
+  [CONN_RETRANSMIT] = "retransmit",
+  [CONN_DUPLICATE] = "duplicate",
+  [CONN_WINDOW_STALL] = "window_stall",
+  [CONN_BUFSPACE_STALL] = "bufspace_stall",
+  [CONN_TRUNCATED] = "truncated",
+  [CONN_BAD_CKSUM] = "bad_cksum",
+  [CONN_OUT_OF_WINDOW] = "out_of_window",
+  [CONN_RTO_EXPIRED] = "timeout",
+  [FLIGHT_SEND] = "send",
+  [FLIGHT_ACK] = "ack"
+};
+
+void flight_dump(const flight_t *f, FILE *out, uint64_t now) {
+  const flight_event_t *e;
+  uint32_t i = f->next > FLIGHT_EVENTS ? f->next - FLIGHT_EVENTS : 0;
+
+  for (; i != f->next; i++) {
+    e = &f->events[i & (FLIGHT_EVENTS - 1)];
+    fprintf(out, "  %12.3f ms  %-14s seqno=%u ackno=%u",
+            -((double) (now - e->time)) / 1000, flight_names[e->type],
+            e->seqno, e->ackno);
+    if (e->type == FLIGHT_SEND) {
+      fprintf(out, " len=%u%s%s%s", e->len, e->flags & TH_SYN ? " SYN" : "",
+              e->flags & TH_ACK ? " ACK" : "", e->flags & TH_FIN ? " FIN" : "");
+    } else if (e->type == FLIGHT_ACK) {
+      fprintf(out, " window=%u", e->len);
+    }
+    fprintf(out, "\n");
+  }
+}
@@ -0,0 +1,83 @@
+/******************************************************************************
+ * ctcp_flight.h
+ * -------------
+ * Flight recorder. Each connection keeps its last FLIGHT_EVENTS protocol
+ * events (segments sent, acks, retransmissions, drops, stalls) in a ring of
+ * compact binary records, always on, so a stall can be looked into after it
+ * happened without logging every segment. The ring is dumped as text when the
+ * student code asks (see conn_flight_dump()), when a round trip takes longer
+ * than --flight-threshold, and with the "flight" command of the control
+ * socket.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_FLIGHT_H
+#define CTCP_FLIGHT_H
+
+#include "ctcp_sys.h"
+
+/** Number of events kept for each connection. Must be a power of two. */
+#define FLIGHT_EVENTS 256
+
+/** Events recorded, numbered after the ones counted with conn_count(), which
+    are recorded too. */
+enum {
+  FLIGHT_SEND = NUM_CONN_EVENTS, /* A segment was sent */
+  FLIGHT_ACK,                  /* An ack moved the acked sequence number on */
+  NUM_FLIGHT_EVENTS
+};
+
+/** One event. */
+typedef struct flight_event {
+  uint64_t time;               /* When it happened, in us */
+  uint32_t seqno;              /* Sequence number of the segment sent or
+                                  received, else the highest one sent */
+  uint32_t ackno;              /* Ack number of the segment sent or received,
+                                  else the highest one received */
+  uint16_t len;                /* Data bytes sent, or window acked */
+  uint8_t type;                /* What happened */
+  uint8_t flags;               /* TCP flags of the segment sent */
+} flight_event_t;
+
+/** A connection's recent events. */
+typedef struct flight {
+  flight_event_t events[FLIGHT_EVENTS];
+  uint32_t next;               /* Number of events recorded so far. The next
+                                  one goes in events[next % FLIGHT_EVENTS] */
+} flight_t;
+
+
+/**
+ * Records an event, overwriting the oldest one if the ring is full.
+ *
+ * f: The flight recorder.
+ * type: What happened.
+ * time: When it happened, in us.
+ * seqno: Sequence number.
+ * ackno: Ack number.
+ * len: Data bytes or window.
+ * flags: TCP flags.
+ */
+static inline void flight_record(flight_t *f, int type, uint64_t time,
+                                 uint32_t seqno, uint32_t ackno, uint16_t len,
+                                 uint8_t flags) {
+  flight_event_t *e = &f->events[f->next++ & (FLIGHT_EVENTS - 1)];
+  e->time = time;
+  e->seqno = seqno;
+  e->ackno = ackno;
+  e->len = len;
+  e->type = type;
+  e->flags = flags;
+}
+
+/**
+ * Writes out the recorded events as text, oldest first, one per line, with
+ * their time relative to now.
+ *
+ * f: The flight recorder.
+ * out: Where to write.
+ * now: The current time, in us.
+ */
+void flight_dump(const flight_t *f, FILE *out, uint64_t now);
+
+#endif /* CTCP_FLIGHT_H */
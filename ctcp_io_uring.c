@@ -0,0 +1,610 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "ctcp_io_uring.h"
+
+/** Kinds of operations. */
+enum op_type {
+  OP_POLL,                     /* Multishot poll for a handler */
+  OP_RECV,                     /* Multishot receive for a handler */
+  OP_SEND,                     /* Packet being sent */
+  OP_WRITE                     /* Write started with ev_writev() */
+};
+
+/** Buffers provided to the kernel for a multishot receive to fill. */
+struct uring_bufs {
+  struct io_uring_buf_ring *ring; /* Ring of free buffers, shared with the
+                                     kernel */
+  char *mem;                   /* URING_RECV_BUFS buffers of size bytes */
+  size_t size;                 /* Size of each buffer */
+  uint16_t bgid;               /* Buffer group ID */
+};
+
+/**
+ * An operation that has been submitted and has not completed yet. Its address
+ * is the user_data of its submission, so it is found again on completion.
+ * Polls and receives are detached from their handler when it is removed, and
+ * freed once the kernel reports their last completion.
+ */
+struct ev_op {
+  enum op_type type;
+  ev_handler_t *handler;       /* Poll/receive: handler, NULL once removed */
+  struct uring_bufs *bufs;     /* Receive: buffers to receive into */
+
+  ev_write_callback_t callback;/* Write: called on completion, NULL once
+                                  cancelled */
+  void *arg;                   /* Write: passed to the callback */
+  void *buf;                   /* Write: freed on completion once cancelled */
+
+  ev_op_t *next_cancel;        /* Next in the list of cancellations that did
+                                  not fit in the submission queue */
+  bool cancel_queued;          /* Whether it is on that list */
+
+  struct iovec iov[EV_MAX_IOV];/* Send/write: buffers */
+
+  struct msghdr msg;           /* Send: message, destination and data. Kept
+                                  here until the send completes */
+  struct sockaddr_storage addr;
+  char data[];
+};
+
+/** An io_uring instance and the rings shared with the kernel. */
+struct uring {
+  int fd;
+
+  /* Submission queue. Entries are filled in at sq_local_tail and handed to
+     the kernel together by uring_enter(). */
+  unsigned int *sq_head;
+  unsigned int *sq_tail;
+  unsigned int *sq_array;
+  unsigned int sq_mask;
+  unsigned int sq_entries;
+  unsigned int sq_local_tail;
+  unsigned int to_submit;
+  struct io_uring_sqe *sqes;
+
+  /* Completion queue. */
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int cq_mask;
+  struct io_uring_cqe *cqes;
+
+  /* Mappings of the rings. */
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+
+  uint16_t next_bgid;          /* Buffer group ID for the next receive */
+  ev_op_t *cancels;            /* Operations to cancel once the submission
+                                  queue has room */
+};
+
+/**
+ * Calls io_uring_enter() after handing queued submissions to the kernel.
+ *
+ * min_complete: Number of completions to wait for.
+ * flags: IORING_ENTER_* flags.
+ * arg: Argument for IORING_ENTER_EXT_ARG, or NULL.
+ * returns: Result of io_uring_enter().
+ */
+static int uring_enter(uring_t *ring, unsigned int min_complete,
+                       unsigned int flags, struct io_uring_getevents_arg *arg) {
+  __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+  int r = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, min_complete,
+                  flags, arg, arg ? sizeof(*arg) : 0);
+  if (r > 0)
+    ring->to_submit -= r;
+  return r;
+}
+
+int uring_submit(uring_t *ring) {
+  if (ring->to_submit == 0)
+    return 0;
+  return uring_enter(ring, 0, 0, NULL) < 0 ? -1 : 0;
+}
+
+/**
+ * Returns a cleared submission queue entry to fill in, or NULL if the queue
+ * is full even after submitting what is in it.
+ */
+static struct io_uring_sqe *uring_get_sqe(uring_t *ring) {
+  unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  if (ring->sq_local_tail - head == ring->sq_entries) {
+    uring_submit(ring);
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_local_tail - head == ring->sq_entries)
+      return NULL;
+  }
+
+  unsigned int index = ring->sq_local_tail & ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_array[index] = index;
+  ring->sq_local_tail++;
+  ring->to_submit++;
+  return sqe;
+}
+
+/**
+ * Checks that the kernel supports what this backend needs. Multishot receives
+ * were added in the same release (6.0) as IORING_OP_SEND_ZC, which can be
+ * probed for.
+ */
+static bool uring_supported(uring_t *ring, struct io_uring_params *params) {
+  if (!(params->features & IORING_FEAT_EXT_ARG) ||
+      !(params->features & IORING_FEAT_NODROP))
+    return false;
+
+  size_t size = sizeof(struct io_uring_probe) +
+                IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = calloc(size, 1);
+  bool supported =
+    syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe,
+            IORING_OP_LAST) == 0 &&
+    probe->last_op >= IORING_OP_SEND_ZC &&
+    (probe->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED);
+  free(probe);
+  return supported;
+}
+
+uring_t *uring_create() {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = URING_ENTRIES * 4;
+
+  uring_t *ring = calloc(sizeof(uring_t), 1);
+  ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+  if (ring->fd < 0) {
+    free(ring);
+    return NULL;
+  }
+  if (!uring_supported(ring, &params)) {
+    close(ring->fd);
+    free(ring);
+    return NULL;
+  }
+
+  /* Map the submission and completion rings, and the submission entries. */
+  ring->sq_ring_size = params.sq_off.array +
+                       params.sq_entries * sizeof(unsigned int);
+  ring->cq_ring_size = params.cq_off.cqes +
+                       params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_ring_size > ring->sq_ring_size)
+      ring->sq_ring_size = ring->cq_ring_size;
+    ring->cq_ring_size = 0;
+  }
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  ring->cq_ring = ring->sq_ring;
+  if (ring->cq_ring_size > 0)
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_CQ_RING);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED ||
+      ring->sqes == MAP_FAILED) {
+    close(ring->fd);
+    free(ring);
+    return NULL;
+  }
+
+  char *sq = ring->sq_ring;
+  ring->sq_head = (unsigned int *) (sq + params.sq_off.head);
+  ring->sq_tail = (unsigned int *) (sq + params.sq_off.tail);
+  ring->sq_mask = *(unsigned int *) (sq + params.sq_off.ring_mask);
+  ring->sq_entries = *(unsigned int *) (sq + params.sq_off.ring_entries);
+  ring->sq_array = (unsigned int *) (sq + params.sq_off.array);
+  ring->sq_local_tail = *ring->sq_tail;
+
+  char *cq = ring->cq_ring;
+  ring->cq_head = (unsigned int *) (cq + params.cq_off.head);
+  ring->cq_tail = (unsigned int *) (cq + params.cq_off.tail);
+  ring->cq_mask = *(unsigned int *) (cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+  return ring;
+}
+
+void uring_destroy(uring_t *ring) {
+  if (ring == NULL)
+    return;
+
+  munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ring != ring->sq_ring)
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  munmap(ring->sq_ring, ring->sq_ring_size);
+  close(ring->fd);
+  free(ring);
+}
+
+/**
+ * Gives a receive buffer back to the kernel.
+ */
+static void uring_bufs_put(struct uring_bufs *bufs, uint16_t bid) {
+  /* The tail overlays the resv field of the first buffer, so only fill in
+     the other fields. */
+  uint16_t tail = bufs->ring->tail;
+  struct io_uring_buf *buf = &bufs->ring->bufs[tail & (URING_RECV_BUFS - 1)];
+  buf->addr = (uintptr_t) (bufs->mem + bid * bufs->size);
+  buf->len = bufs->size;
+  buf->bid = bid;
+  __atomic_store_n(&bufs->ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Allocates receive buffers and registers them with the kernel.
+ *
+ * size: Size of each buffer.
+ * returns: The buffers, or NULL on failure.
+ */
+static struct uring_bufs *uring_bufs_create(uring_t *ring, size_t size) {
+  struct uring_bufs *bufs = calloc(sizeof(struct uring_bufs), 1);
+  void *mem;
+  uint16_t bid;
+
+  if (posix_memalign(&mem, sysconf(_SC_PAGESIZE),
+                     URING_RECV_BUFS * sizeof(struct io_uring_buf)) != 0) {
+    free(bufs);
+    return NULL;
+  }
+  memset(mem, 0, URING_RECV_BUFS * sizeof(struct io_uring_buf));
+  bufs->ring = mem;
+  bufs->mem = malloc(URING_RECV_BUFS * size);
+  bufs->size = size;
+  bufs->bgid = ring->next_bgid++;
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uintptr_t) bufs->ring;
+  reg.ring_entries = URING_RECV_BUFS;
+  reg.bgid = bufs->bgid;
+  if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING,
+              &reg, 1) < 0) {
+    free(bufs->mem);
+    free(bufs->ring);
+    free(bufs);
+    return NULL;
+  }
+
+  for (bid = 0; bid < URING_RECV_BUFS; bid++)
+    uring_bufs_put(bufs, bid);
+  return bufs;
+}
+
+/**
+ * Unregisters receive buffers and frees them.
+ */
+static void uring_bufs_destroy(uring_t *ring, struct uring_bufs *bufs) {
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.bgid = bufs->bgid;
+  syscall(__NR_io_uring_register, ring->fd, IORING_UNREGISTER_PBUF_RING,
+          &reg, 1);
+  free(bufs->mem);
+  free(bufs->ring);
+  free(bufs);
+}
+
+/**
+ * Submits a poll or receive for the handler an operation belongs to.
+ *
+ * returns: 0 on success, -1 if the submission queue is full.
+ */
+static int uring_post(uring_t *ring, ev_op_t *op) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  if (sqe == NULL)
+    return -1;
+
+  ev_handler_t *handler = op->handler;
+  sqe->fd = handler->fd;
+  sqe->user_data = (uintptr_t) op;
+  if (op->type == OP_POLL) {
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    if (handler->events & EV_READ)
+      sqe->poll32_events |= EPOLLIN | EPOLLRDHUP;
+    if (handler->events & EV_WRITE)
+      sqe->poll32_events |= EPOLLOUT;
+  }
+  else {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = op->bufs->bgid;
+  }
+  return 0;
+}
+
+/**
+ * Asks the kernel to cancel an operation. Its completion still arrives. If
+ * the submission queue is full, the cancellation is queued and submitted
+ * again by uring_wait() (see uring_retry_cancels()).
+ */
+static void uring_cancel_op(uring_t *ring, ev_op_t *op) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  if (sqe == NULL) {
+    if (!op->cancel_queued) {
+      op->cancel_queued = true;
+      op->next_cancel = ring->cancels;
+      ring->cancels = op;
+    }
+    return;
+  }
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = (uintptr_t) op;
+  sqe->user_data = 0;
+}
+
+/**
+ * Submits the cancellations that did not fit in the submission queue, for
+ * as long as there is room.
+ */
+static void uring_retry_cancels(uring_t *ring) {
+  while (ring->cancels != NULL) {
+    ev_op_t *op = ring->cancels;
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (sqe == NULL)
+      return;
+    ring->cancels = op->next_cancel;
+    op->cancel_queued = false;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t) op;
+    sqe->user_data = 0;
+  }
+}
+
+/**
+ * Frees an operation once the kernel has reported its last completion,
+ * taking it off the list of cancellations still to submit.
+ */
+static void uring_free_op(uring_t *ring, ev_op_t *op) {
+  if (op->cancel_queued) {
+    ev_op_t **o = &ring->cancels;
+    while (*o != op)
+      o = &(*o)->next_cancel;
+    *o = op->next_cancel;
+  }
+  free(op);
+}
+
+void uring_remove(uring_t *ring, ev_handler_t *handler) {
+  ev_op_t *op = handler->op;
+  if (op == NULL)
+    return;
+
+  op->handler = NULL;
+  handler->op = NULL;
+  uring_cancel_op(ring, op);
+}
+
+int uring_poll(uring_t *ring, ev_handler_t *handler) {
+  uring_remove(ring, handler);
+  if (handler->events == 0)
+    return 0;
+
+  ev_op_t *op = calloc(sizeof(ev_op_t), 1);
+  op->type = OP_POLL;
+  op->handler = handler;
+  if (uring_post(ring, op) < 0) {
+    free(op);
+    return -1;
+  }
+  handler->op = op;
+  return 0;
+}
+
+int uring_recv(uring_t *ring, ev_handler_t *handler) {
+  ev_op_t *op = calloc(sizeof(ev_op_t), 1);
+  op->type = OP_RECV;
+  op->handler = handler;
+  op->bufs = uring_bufs_create(ring, handler->recv_size);
+  if (op->bufs == NULL) {
+    free(op);
+    return -1;
+  }
+  if (uring_post(ring, op) < 0) {
+    uring_bufs_destroy(ring, op->bufs);
+    free(op);
+    return -1;
+  }
+  handler->op = op;
+  return 0;
+}
+
+int uring_send(uring_t *ring, int fd, const void *buf, size_t len,
+               const struct sockaddr *addr, socklen_t addrlen) {
+  if (addrlen > sizeof(struct sockaddr_storage))
+    return -1;
+
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  if (sqe == NULL)
+    return -1;
+
+  ev_op_t *op = malloc(sizeof(ev_op_t) + len);
+  op->type = OP_SEND;
+  memcpy(op->data, buf, len);
+  memcpy(&op->addr, addr, addrlen);
+  op->iov[0].iov_base = op->data;
+  op->iov[0].iov_len = len;
+  memset(&op->msg, 0, sizeof(op->msg));
+  op->msg.msg_name = &op->addr;
+  op->msg.msg_namelen = addrlen;
+  op->msg.msg_iov = op->iov;
+  op->msg.msg_iovlen = 1;
+
+  /* Like sendto() on the non-blocking socket, drop the packet if there is no
+     room for it. Otherwise the kernel tries again by itself, and a Unix
+     socket sends an empty packet. */
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = fd;
+  sqe->msg_flags = MSG_DONTWAIT;
+  sqe->addr = (uintptr_t) &op->msg;
+  sqe->len = 1;
+  sqe->user_data = (uintptr_t) op;
+  return len;
+}
+
+ev_op_t *uring_writev(uring_t *ring, int fd, const struct iovec *iov,
+                      int iovcnt, ev_write_callback_t callback, void *arg) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  if (sqe == NULL)
+    return NULL;
+
+  ev_op_t *op = calloc(sizeof(ev_op_t), 1);
+  op->type = OP_WRITE;
+  op->callback = callback;
+  op->arg = arg;
+  memcpy(op->iov, iov, iovcnt * sizeof(struct iovec));
+
+  /* An offset of -1 writes at the file position, so pipes and regular files
+     behave as they would with writev(). */
+  sqe->opcode = IORING_OP_WRITEV;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t) op->iov;
+  sqe->len = iovcnt;
+  sqe->off = (uint64_t) -1;
+  sqe->user_data = (uintptr_t) op;
+  return op;
+}
+
+void uring_cancel(uring_t *ring, ev_op_t *op, void *buf) {
+  /* The cancellation may come too late to stop the write, so the kernel may
+     still read the buffer until the write completes. */
+  op->callback = NULL;
+  op->arg = NULL;
+  op->buf = buf;
+  uring_cancel_op(ring, op);
+}
+
+/**
+ * Called when a poll or receive will not complete again. Posts it again if
+ * its handler still wants it, otherwise frees it.
+ *
+ * res: Result of the last completion.
+ */
+static void uring_finish(uring_t *ring, ev_op_t *op, int res) {
+  /* Multishot operations end when the kernel runs out of receive buffers or
+     room in the completion queue, and polls on regular files complete only
+     once. Keep them going. Other errors end them for good. */
+  if (op->handler != NULL && (res >= 0 || res == -ENOBUFS) &&
+      uring_post(ring, op) == 0)
+    return;
+
+  if (op->handler != NULL)
+    op->handler->op = NULL;
+  if (op->bufs != NULL)
+    uring_bufs_destroy(ring, op->bufs);
+  uring_free_op(ring, op);
+}
+
+/**
+ * Handles a completion.
+ *
+ * returns: The number of callbacks invoked.
+ */
+static int uring_complete(uring_t *ring, struct io_uring_cqe *cqe) {
+  ev_op_t *op = (ev_op_t *) (uintptr_t) cqe->user_data;
+  bool more = cqe->flags & IORING_CQE_F_MORE;
+  int dispatched = 0;
+
+  /* Cancellations. */
+  if (op == NULL)
+    return 0;
+
+  switch (op->type) {
+  case OP_POLL:
+    if (op->handler != NULL && cqe->res > 0) {
+      uint32_t events = 0;
+      if (cqe->res & EPOLLIN)
+        events |= EV_READ;
+      if (cqe->res & EPOLLOUT)
+        events |= EV_WRITE;
+      if (cqe->res & (EPOLLHUP | EPOLLRDHUP | EPOLLERR))
+        events |= EV_HUP;
+      op->handler->callback(op->handler, events);
+      dispatched++;
+    }
+    if (!more)
+      uring_finish(ring, op, cqe->res);
+    break;
+
+  case OP_RECV:
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+      uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+      char *buf = op->bufs->mem + bid * op->bufs->size;
+      if (op->handler != NULL && cqe->res >= 0) {
+        memset(buf + cqe->res, 0, op->bufs->size - cqe->res);
+        op->handler->recv_callback(op->handler, buf, cqe->res);
+        dispatched++;
+      }
+      uring_bufs_put(op->bufs, bid);
+    }
+    if (!more)
+      uring_finish(ring, op, cqe->res);
+    break;
+
+  case OP_SEND:
+    free(op);
+    break;
+
+  case OP_WRITE:
+    if (op->callback != NULL) {
+      op->callback(op->arg, cqe->res);
+      dispatched++;
+    }
+    free(op->buf);
+    uring_free_op(ring, op);
+    break;
+  }
+  return dispatched;
+}
+
+int uring_wait(uring_t *ring, int timeout) {
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  unsigned int head;
+  int dispatched = 0;
+
+  /* Submit queued work and wait for a completion in one call. */
+  uring_retry_cancels(ring);
+  if (timeout != 0) {
+    memset(&arg, 0, sizeof(arg));
+    if (timeout > 0) {
+      ts.tv_sec = timeout / 1000;
+      ts.tv_nsec = (timeout % 1000) * 1000000L;
+      arg.ts = (uintptr_t) &ts;
+    }
+    if (uring_enter(ring, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                    &arg) < 0 &&
+        errno != ETIME && errno != EINTR && errno != EBUSY)
+      return -1;
+  }
+  else if (uring_submit(ring) < 0 && errno != EBUSY) {
+    return -1;
+  }
+
+  /* Callbacks may queue more work, but never reap completions, so the head
+     only moves here. */
+  while ((head = *ring->cq_head) !=
+         __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe cqe = ring->cqes[head & ring->cq_mask];
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    dispatched += uring_complete(ring, &cqe);
+  }
+  return dispatched;
+}
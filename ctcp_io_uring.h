@@ -0,0 +1,88 @@
+/******************************************************************************
+ * ctcp_io_uring.h
+ * ---------------
+ * io_uring backend for the event loop (see ctcp_event_loop.h). Talks to the
+ * kernel directly through the io_uring system calls, so no library is needed.
+ *
+ * These functions are only called by ctcp_event_loop.c. Each one does the
+ * io_uring part of the ev_* function with the same name, after the handler's
+ * fields have been filled in.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_IO_URING_H
+#define CTCP_IO_URING_H
+
+#include "ctcp_event_loop.h"
+
+/** Number of submission queue entries. The completion queue is four times as
+    large, since multishot operations complete many times. */
+#define URING_ENTRIES 256
+
+/** Number of buffers provided for each multishot receive. Must be a power of
+    two. */
+#define URING_RECV_BUFS 64
+
+/** An io_uring instance. Definition can be found in ctcp_io_uring.c. */
+struct uring;
+typedef struct uring uring_t;
+
+
+/**
+ * Sets up an io_uring instance.
+ *
+ * returns: The new instance, or NULL if io_uring (or a feature the backend
+ *          needs, such as multishot receives) is not supported.
+ */
+uring_t *uring_create();
+
+/**
+ * Tears down an io_uring instance. Operations still in progress are
+ * abandoned.
+ */
+void uring_destroy(uring_t *ring);
+
+/**
+ * Posts a multishot poll for handler->events on handler->fd. If the handler
+ * already has one, it is replaced.
+ *
+ * returns: 0 on success, -1 on failure.
+ */
+int uring_poll(uring_t *ring, ev_handler_t *handler);
+
+/**
+ * Posts a multishot receive on handler->fd, with handler->recv_size byte
+ * buffers.
+ *
+ * returns: 0 on success, -1 on failure.
+ */
+int uring_recv(uring_t *ring, ev_handler_t *handler);
+
+/**
+ * Cancels the poll or receive posted for a handler. Completions that are
+ * still on their way are ignored.
+ */
+void uring_remove(uring_t *ring, ev_handler_t *handler);
+
+/** See ev_send(). */
+int uring_send(uring_t *ring, int fd, const void *buf, size_t len,
+               const struct sockaddr *addr, socklen_t addrlen);
+
+/** See ev_writev(). */
+ev_op_t *uring_writev(uring_t *ring, int fd, const struct iovec *iov,
+                      int iovcnt, ev_write_callback_t callback, void *arg);
+
+/** See ev_cancel(). */
+void uring_cancel(uring_t *ring, ev_op_t *op, void *buf);
+
+/**
+ * Submits queued work.
+ *
+ * returns: 0 on success, -1 on failure.
+ */
+int uring_submit(uring_t *ring);
+
+/** See ev_wait(). */
+int uring_wait(uring_t *ring, int timeout);
+
+#endif /* CTCP_IO_URING_H */
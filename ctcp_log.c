@@ -0,0 +1,258 @@
+#include <pthread.h>
+#include "ctcp_log.h"
+#include "ctcp_utils.h"
+
+#define ADDR_FORMAT_STR "%s\t%d\t%s\t%d\t"
+#define LOCALHOST_STR "localhost"
+
+/** Lines are gathered into a buffer of at least this size and written out
+    together. */
+#define LOG_WRITE_SIZE (64 * 1024)
+
+struct log_ring {
+  unsigned int head;           /* Next record to write out (writer) */
+  unsigned int tail;           /* Next free record (producer) */
+  uint64_t dropped;            /* Records dropped because the ring was full.
+                                  Written only by the producer */
+  int fd;                      /* File the records are written to */
+  log_output_t output;         /* How they are written */
+  size_t payload;              /* Data bytes each record can keep */
+  size_t record_size;          /* Size of each record, with its data */
+  unsigned int size;           /* Number of records. A power of two */
+  char *records;               /* The records */
+};
+
+/** Header of a pcap file. */
+struct pcap_header {
+  uint32_t magic;
+  uint16_t version_major;
+  uint16_t version_minor;
+  int32_t thiszone;
+  uint32_t sigfigs;
+  uint32_t snaplen;
+  uint32_t linktype;
+};
+
+/** Header of a packet in a pcap file. */
+struct pcap_record {
+  uint32_t ts_sec;
+  uint32_t ts_usec;
+  uint32_t incl_len;           /* Bytes captured */
+  uint32_t orig_len;           /* Length of the packet */
+};
+
+/** The writer thread. There is one per process. */
+static struct {
+  pthread_t thread;
+  pthread_mutex_t lock;        /* Held while writing out records */
+  log_ring_t **rings;          /* Rings to write out */
+  int num_rings;
+  char *buf;                   /* Lines waiting to be written */
+  size_t buf_size;
+  bool stop;                   /* Set to stop the thread */
+  pid_t pid;                   /* Process the thread runs in */
+  bool started;
+} writer = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static log_record_t *log_ring_record(log_ring_t *ring, unsigned int index) {
+  index &= ring->size - 1;
+  return (log_record_t *) (ring->records + index * ring->record_size);
+}
+
+log_ring_t *log_ring_create(int fd, log_output_t output, size_t payload) {
+  log_ring_t *ring = calloc(sizeof(log_ring_t), 1);
+  ring->fd = fd;
+  ring->output = output;
+  ring->payload = payload;
+
+  /* Keep every record aligned like the first one. */
+  ring->record_size = (sizeof(log_record_t) + payload + 7) & ~(size_t) 7;
+  ring->size = LOG_RING_SIZE;
+  while (ring->size > 16 &&
+         (size_t) ring->size * ring->record_size > LOG_RING_MAX_BYTES)
+    ring->size /= 2;
+  ring->records = calloc(ring->size, ring->record_size);
+  return ring;
+}
+
+size_t log_ring_payload(log_ring_t *ring) {
+  return ring->payload;
+}
+
+log_record_t *log_ring_reserve(log_ring_t *ring) {
+  unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  if (ring->tail - head == ring->size) {
+    __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+  return log_ring_record(ring, ring->tail);
+}
+
+void log_ring_commit(log_ring_t *ring) {
+  __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+size_t log_format(const log_record_t *rec, bool with_data, char *buf) {
+  char src[INET_ADDRSTRLEN] = LOCALHOST_STR;
+  char dst[INET_ADDRSTRLEN] = LOCALHOST_STR;
+  size_t len;
+  int i;
+
+  if (!rec->localhost) {
+    inet_ntop(AF_INET, &rec->src_ip, src, sizeof(src));
+    inet_ntop(AF_INET, &rec->dst_ip, dst, sizeof(dst));
+  }
+
+  /* Timestamp, source and destination, sequence number, ack number and
+     length. */
+  len = sprintf(buf, "%lu\t" ADDR_FORMAT_STR "%d\t%d\t%d\t",
+                (unsigned long) (rec->time / 1000), src, rec->src_port, dst,
+                rec->dst_port, rec->seqno, rec->ackno, rec->len);
+
+  /* TCP flags. */
+  if (rec->flags & TH_SYN)
+    len += sprintf(buf + len, "SYN ");
+  if (rec->flags & TH_ACK)
+    len += sprintf(buf + len, "ACK ");
+  if (rec->flags & TH_FIN)
+    len += sprintf(buf + len, "FIN ");
+
+  /* Window and checksum. */
+  len += sprintf(buf + len, "\t%d\t0x%x", rec->window, rec->cksum);
+  if (!with_data)
+    return len;
+
+  /* Data. */
+  buf[len++] = '\t';
+  for (i = 0; i < rec->data_len; i++) {
+    buf[len++] = hex_digits[rec->data[i] >> 4];
+    buf[len++] = hex_digits[rec->data[i] & 0xf];
+    buf[len++] = ' ';
+  }
+  buf[len++] = '\n';
+  buf[len] = '\0';
+  return len;
+}
+
+void log_pcap_header(int fd, size_t snaplen) {
+  struct pcap_header hdr = {
+    .magic = 0xa1b2c3d4,
+    .version_major = 2,
+    .version_minor = 4,
+    .snaplen = snaplen,
+    .linktype = PCAP_LINKTYPE_RAW
+  };
+  write(fd, &hdr, sizeof(hdr));
+}
+
+size_t log_format_pcap(const log_record_t *rec, char *buf) {
+  struct pcap_record hdr = {
+    .ts_sec = rec->time / 1000000,
+    .ts_usec = rec->time % 1000000,
+    .incl_len = rec->data_len,
+    .orig_len = rec->len
+  };
+  memcpy(buf, &hdr, sizeof(hdr));
+  memcpy(buf + sizeof(hdr), rec->data, rec->data_len);
+  return sizeof(hdr) + rec->data_len;
+}
+
+/**
+ * Writes out the lines (or pcap records) gathered so far.
+ */
+static void log_writer_flush(int fd, size_t *used) {
+  size_t off = 0;
+  ssize_t w;
+
+  while (off < *used) {
+    w = write(fd, writer.buf + off, *used - off);
+    if (w <= 0)
+      break;
+    off += w;
+  }
+  *used = 0;
+}
+
+/**
+ * Writes out every record waiting in the rings.
+ */
+static void log_writer_drain() {
+  size_t used = 0;
+  int i;
+
+  pthread_mutex_lock(&writer.lock);
+  for (i = 0; i < writer.num_rings; i++) {
+    log_ring_t *ring = writer.rings[i];
+    while (ring->head != __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) {
+      log_record_t *rec = log_ring_record(ring, ring->head);
+      if (writer.buf_size - used < LOG_LINE_SIZE(rec->data_len))
+        log_writer_flush(ring->fd, &used);
+      if (ring->output == LOG_PCAP)
+        used += log_format_pcap(rec, writer.buf + used);
+      else
+        used += log_format(rec, true, writer.buf + used);
+      __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+    }
+    log_writer_flush(ring->fd, &used);
+  }
+  pthread_mutex_unlock(&writer.lock);
+}
+
+static void *log_writer_main(void *arg) {
+  struct timespec interval = { 0, LOG_FLUSH_INTERVAL * 1000000L };
+
+  while (!__atomic_load_n(&writer.stop, __ATOMIC_ACQUIRE)) {
+    nanosleep(&interval, NULL);
+    log_writer_drain();
+  }
+  return NULL;
+}
+
+int log_writer_start(log_ring_t **rings, int num_rings) {
+  size_t payload = 0;
+  int i;
+
+  writer.num_rings = num_rings;
+  writer.rings = calloc(num_rings, sizeof(log_ring_t *));
+  memcpy(writer.rings, rings, num_rings * sizeof(log_ring_t *));
+  for (i = 0; i < num_rings; i++)
+    payload = MAX(payload, rings[i]->payload);
+  writer.buf_size = MAX(LOG_WRITE_SIZE, 2 * LOG_LINE_SIZE(payload));
+  writer.buf = malloc(writer.buf_size);
+  writer.pid = getpid();
+
+  if (pthread_create(&writer.thread, NULL, log_writer_main, NULL) != 0)
+    return -1;
+  writer.started = true;
+  atexit(log_writer_stop);
+  return 0;
+}
+
+void log_writer_stop(void) {
+  uint64_t dropped;
+
+  if (!writer.started || writer.pid != getpid())
+    return;
+
+  __atomic_store_n(&writer.stop, true, __ATOMIC_RELEASE);
+  pthread_join(writer.thread, NULL);
+  log_writer_drain();
+  writer.started = false;
+
+  dropped = log_dropped();
+  if (dropped > 0) {
+    fprintf(stderr, "[INFO] %llu segments or packets were not logged (the log "
+            "could not keep up)\n", (unsigned long long) dropped);
+  }
+}
+
+uint64_t log_dropped(void) {
+  uint64_t dropped = 0;
+  int i;
+
+  for (i = 0; i < writer.num_rings; i++)
+    dropped += __atomic_load_n(&writer.rings[i]->dropped, __ATOMIC_RELAXED);
+  return dropped;
+}
@@ -0,0 +1,167 @@
+/******************************************************************************
+ * ctcp_log.h
+ * ----------
+ * Segment logging (see --logging) and packet capture (see --pcap). Logging a
+ * segment or packet only copies a fixed-size binary record, and the first
+ * bytes of the segment's data or of the packet, into a ring. A writer thread
+ * formats the records of every ring (as lines of text, or as pcap records)
+ * and writes them out in bulk, so the event loops never wait on the files.
+ *
+ * Each ring has a single producer (the shard that owns it) and the writer
+ * thread as its only consumer, so no locks are taken when logging. If the
+ * writer falls behind and a ring fills up, records are dropped and counted
+ * (see log_dropped()).
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_LOG_H
+#define CTCP_LOG_H
+
+#include "ctcp_sys.h"
+
+/** Number of records a ring holds. Must be a power of two. Rings with large
+    records hold fewer, so that each takes at most LOG_RING_MAX_BYTES. */
+#define LOG_RING_SIZE 4096
+#define LOG_RING_MAX_BYTES (16 * 1024 * 1024)
+
+/** Number of data bytes kept per record, unless changed with
+    --log-payload. */
+#define LOG_DEFAULT_PAYLOAD 64
+
+/** How often the writer thread writes out records, in ms. */
+#define LOG_FLUSH_INTERVAL 50
+
+/** Space needed to format a record with data_len bytes of data. */
+#define LOG_LINE_SIZE(data_len) (400 + 3 * (data_len) + 2)
+
+/** Space needed to format a packet with data_len bytes captured. */
+#define PCAP_RECORD_SIZE(data_len) (16 + (data_len))
+
+/** Default number of bytes of each packet captured (see --snaplen). */
+#define PCAP_DEFAULT_SNAPLEN 65535
+
+/** Link type of captured packets: raw IP, with no link-layer header. */
+#define PCAP_LINKTYPE_RAW 101
+
+/** What the records of a ring are, and how they are written out. */
+typedef enum {
+  LOG_TEXT,                    /* Segments, written as lines of text */
+  LOG_PCAP                     /* Packets, written as pcap records */
+} log_output_t;
+
+/**
+ * A logged segment or packet. Fields are in host byte order unless noted.
+ * Packets only use time, len and data.
+ */
+struct log_record {
+  uint64_t time;               /* When it was sent or received, in us */
+  in_addr_t src_ip;            /* Source address (network byte order) */
+  in_addr_t dst_ip;            /* Destination address (network byte order) */
+  uint16_t src_port;           /* Source port */
+  uint16_t dst_port;           /* Destination port */
+  bool localhost;              /* Print both addresses as "localhost" (Unix
+                                  sockets) */
+  uint8_t flags;               /* TCP flags */
+  uint16_t len;                /* Length of the segment, including the cTCP
+                                  header, or of the packet */
+  uint32_t seqno;              /* Sequence number */
+  uint32_t ackno;              /* Acknowledgement number */
+  uint16_t window;             /* Window */
+  uint16_t cksum;              /* Checksum, as sent (network byte order) */
+  uint16_t data_len;           /* Number of data bytes kept */
+  unsigned char data[];        /* The first bytes of the segment's data, or
+                                  of the packet */
+};
+typedef struct log_record log_record_t;
+
+/** A ring of records. Definition can be found in ctcp_log.c. */
+struct log_ring;
+typedef struct log_ring log_ring_t;
+
+
+/**
+ * Creates a ring of up to LOG_RING_SIZE records.
+ *
+ * fd: File the writer thread writes the records to.
+ * output: What the records are.
+ * payload: Number of data bytes each record can keep.
+ * returns: The new ring.
+ */
+log_ring_t *log_ring_create(int fd, log_output_t output, size_t payload);
+
+/**
+ * Returns the number of data bytes each record of a ring can keep.
+ */
+size_t log_ring_payload(log_ring_t *ring);
+
+/**
+ * Returns the next free record of a ring, to be filled in and then added with
+ * log_ring_commit(). Only the ring's producer may call this.
+ *
+ * ring: The ring.
+ * returns: The record, or NULL if the ring is full. The record is then
+ *          counted as dropped.
+ */
+log_record_t *log_ring_reserve(log_ring_t *ring);
+
+/**
+ * Adds the record returned by log_ring_reserve() to the ring, for the writer
+ * thread to write out.
+ *
+ * ring: The ring.
+ */
+void log_ring_commit(log_ring_t *ring);
+
+/**
+ * Formats a record as a line of the log:
+ *    time fromIP fromPort toIP toPort seqno ackno len flags window cksum data
+ *
+ * rec: The record.
+ * with_data: Whether to end the line with a hex dump of the data and a
+ *            newline. Without it, the line stops after the checksum.
+ * buf: Buffer for the line, at least LOG_LINE_SIZE(rec->data_len) bytes.
+ * returns: Length of the line.
+ */
+size_t log_format(const log_record_t *rec, bool with_data, char *buf);
+
+/**
+ * Writes the header of a pcap file, for packets of raw IP.
+ *
+ * fd: The file.
+ * snaplen: Most bytes captured of each packet.
+ */
+void log_pcap_header(int fd, size_t snaplen);
+
+/**
+ * Formats a packet as a pcap record.
+ *
+ * rec: The packet.
+ * buf: Buffer for the pcap record, at least PCAP_RECORD_SIZE(rec->data_len)
+ *      bytes.
+ * returns: Length of the pcap record.
+ */
+size_t log_format_pcap(const log_record_t *rec, char *buf);
+
+/**
+ * Starts the writer thread. It writes out the records of the given rings
+ * every LOG_FLUSH_INTERVAL ms, and once more when the process exits.
+ *
+ * rings: The rings. The array is copied.
+ * num_rings: Number of rings.
+ * returns: 0 on success, -1 on failure.
+ */
+int log_writer_start(log_ring_t **rings, int num_rings);
+
+/**
+ * Stops the writer thread after writing out every record left in the rings,
+ * and reports how many were dropped. Called when the process exits. Does
+ * nothing in a process forked after the writer was started.
+ */
+void log_writer_stop(void);
+
+/**
+ * Returns the number of records dropped so far because a ring was full.
+ */
+uint64_t log_dropped(void);
+
+#endif /* CTCP_LOG_H */
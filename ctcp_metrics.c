@@ -0,0 +1,222 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sys/signalfd.h>
+#include "ctcp_metrics.h"
+#include "ctcp_utils.h"
+
+/** Names and help text of the counters, in the order they are numbered. */
+static const struct {
+  const char *name;
+  const char *help;
+} metric_info[NUM_METRICS] = {
+  [CONN_RETRANSMIT] =
+    { "retransmits", "Segments sent again after a timeout." },
+  [CONN_DUPLICATE] =
+    { "duplicates", "Segments received that already had been." },
+  [CONN_WINDOW_STALL] =
+    { "window_stalls", "Times a segment was ready to send but outside of the "
+      "send window." },
+  [CONN_BUFSPACE_STALL] =
+    { "bufspace_stalls", "Times output was held back for lack of buffer "
+      "space." },
+  [CONN_TRUNCATED] =
+    { "truncated_segments", "Truncated segments received." },
+  [CONN_BAD_CKSUM] =
+    { "bad_cksums", "Segments received with a bad checksum." },
+  [CONN_OUT_OF_WINDOW] =
+    { "out_of_window_segments", "Segments received beyond the receive "
+      "window." },
+  [CONN_RTO_EXPIRED] =
+    { "timeouts", "Times a segment's retransmission timer expired." },
+  [METRIC_SEGMENTS_SENT] =
+    { "segments_sent", "Segments sent." },
+  [METRIC_BYTES_SENT] =
+    { "bytes_sent", "Data bytes sent, including retransmissions." },
+  [METRIC_SEGMENTS_RECEIVED] =
+    { "segments_received", "Segments received." },
+  [METRIC_BYTES_RECEIVED] =
+    { "bytes_received", "Data bytes received, including duplicates." },
+  [METRIC_CONNECTIONS_OPENED] =
+    { "connections_opened", "Connections established." },
+  [METRIC_CONNECTIONS_CLOSED] =
+    { "connections_closed", "Connections torn down." }
+};
+
+/** Names and help text of the histograms, in the order they are numbered. */
+static const struct {
+  const char *name;
+  const char *help;
+} timing_info[NUM_TIMINGS] = {
+  [CONN_RTT] =
+    { "rtt", "Time from sending a segment to the ack that covers it, for "
+      "segments sent once." },
+  [CONN_REASSEMBLY_DELAY] =
+    { "reassembly_delay", "Time from receiving a segment to outputting it." },
+  [CONN_SEND_DELAY] =
+    { "send_delay", "Time from reading input to first sending it." },
+  [TIMING_OUTPUT_QUEUE] =
+    { "output_queue_delay", "Time output waits in the output queue before "
+      "it is written out." }
+};
+
+/** Percentiles reported for each histogram. */
+static const struct {
+  double p;
+  const char *label;
+} percentiles[] = {
+  { 0.5, "0.5" },
+  { 0.99, "0.99" },
+  { 0.999, "0.999" }
+};
+
+uint64_t metrics_get(const metrics_t *m, int metric) {
+  return __atomic_load_n(&m->count[metric], __ATOMIC_RELAXED);
+}
+
+/**
+ * Returns the bucket a value goes in. Below HIST_SUB_BUCKETS, each value has
+ * a bucket of its own. Above, the top HIST_SUB_BITS + 1 bits of the value
+ * pick the bucket within its power of two.
+ */
+static int hist_bucket(uint64_t value) {
+  int shift;
+
+  if (value < HIST_SUB_BUCKETS)
+    return value;
+  if (value >> HIST_MAX_BITS)
+    return HIST_BUCKETS - 1;
+  shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+  return shift * HIST_SUB_BUCKETS + (value >> shift);
+}
+
+/**
+ * Returns the highest value that goes in a bucket.
+ */
+static uint64_t hist_bucket_max(int bucket) {
+  int shift;
+
+  if (bucket < 2 * HIST_SUB_BUCKETS)
+    return bucket;
+  shift = bucket / HIST_SUB_BUCKETS - 1;
+  return ((uint64_t) (bucket - shift * HIST_SUB_BUCKETS + 1) << shift) - 1;
+}
+
+void hist_record(histogram_t *h, uint64_t value) {
+  int bucket = hist_bucket(value);
+  __atomic_store_n(&h->count[bucket], h->count[bucket] + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&h->total, h->total + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&h->sum, h->sum + value, __ATOMIC_RELAXED);
+}
+
+void hist_merge(histogram_t *into, const histogram_t *h) {
+  int i;
+
+  for (i = 0; i < HIST_BUCKETS; i++)
+    into->count[i] += __atomic_load_n(&h->count[i], __ATOMIC_RELAXED);
+  into->total += __atomic_load_n(&h->total, __ATOMIC_RELAXED);
+  into->sum += __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+}
+
+uint64_t hist_percentile(const histogram_t *h, double p) {
+  uint64_t total = 0;
+  uint64_t seen = 0;
+  uint64_t rank;
+  int i;
+
+  /* Count the buckets rather than use h->total, which may be ahead of them
+     if another thread is adding to the histogram. */
+  for (i = 0; i < HIST_BUCKETS; i++)
+    total += h->count[i];
+  if (total == 0)
+    return 0;
+
+  rank = p * total;
+  if (rank < p * total || rank == 0)
+    rank++;
+  for (i = 0; i < HIST_BUCKETS; i++) {
+    seen += h->count[i];
+    if (seen >= rank)
+      break;
+  }
+  return hist_bucket_max(MIN(i, HIST_BUCKETS - 1));
+}
+
+const char *timing_name(int timing) {
+  return timing_info[timing].name;
+}
+
+const char *timing_help(int timing) {
+  return timing_info[timing].help;
+}
+
+const char *metric_name(int metric) {
+  return metric_info[metric].name;
+}
+
+const char *metric_help(int metric) {
+  return metric_info[metric].help;
+}
+
+void metrics_family(FILE *out, const char *name, const char *type,
+                    const char *help) {
+  fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void metrics_sample(FILE *out, const char *name, const char *labels,
+                    uint64_t value) {
+  if (labels != NULL)
+    fprintf(out, "%s{%s} %llu\n", name, labels, (unsigned long long) value);
+  else
+    fprintf(out, "%s %llu\n", name, (unsigned long long) value);
+}
+
+void metrics_summary(FILE *out, const char *name, const char *labels,
+                     const histogram_t *h) {
+  const char *sep = labels != NULL ? "," : "";
+  size_t i;
+
+  if (labels == NULL)
+    labels = "";
+  for (i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++) {
+    fprintf(out, "%s{%s%squantile=\"%s\"} %.6f\n", name, labels, sep,
+            percentiles[i].label,
+            hist_percentile(h, percentiles[i].p) / 1e6);
+  }
+  fprintf(out, "%s_sum%s%s%s %.6f\n", name, *labels ? "{" : "", labels,
+          *labels ? "}" : "", h->sum / 1e6);
+  fprintf(out, "%s_count%s%s%s %llu\n", name, *labels ? "{" : "", labels,
+          *labels ? "}" : "", (unsigned long long) h->total);
+}
+
+char *metrics_render(metrics_report_t report, size_t *len) {
+  char *buf = NULL;
+  FILE *out = open_memstream(&buf, len);
+  if (out == NULL)
+    return NULL;
+  report(out);
+  fclose(out);
+  return buf;
+}
+
+int metrics_signal_fd(void) {
+  sigset_t mask;
+
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGUSR1);
+  if (pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0)
+    return -1;
+  return signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+}
+
+void metrics_dump(int fd, metrics_report_t report) {
+  struct signalfd_siginfo info;
+  char *buf;
+  size_t len;
+
+  while (read(fd, &info, sizeof(info)) == sizeof(info))
+    ;
+  buf = metrics_render(report, &len);
+  if (buf != NULL)
+    fwrite(buf, 1, len, stderr);
+  free(buf);
+}
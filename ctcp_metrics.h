@@ -0,0 +1,193 @@
+/******************************************************************************
+ * ctcp_metrics.h
+ * --------------
+ * Counters and latency histograms kept for each connection and for each
+ * shard, and their export in the Prometheus text format: on the control
+ * socket (see --control), and to STDERR on SIGUSR1.
+ *
+ * A set of counters or a histogram is only ever written by the thread that
+ * owns it, so counting takes no locks and no atomic read-modify-writes. The
+ * report may be written from another thread, which may see counts that are
+ * slightly behind.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_METRICS_H
+#define CTCP_METRICS_H
+
+#include "ctcp_sys.h"
+
+/** Counters kept by the library, numbered after the events counted with
+    conn_count(). Those before NUM_CONN_METRICS are kept for each connection
+    too. */
+enum {
+  METRIC_SEGMENTS_SENT = NUM_CONN_EVENTS,
+  METRIC_BYTES_SENT,
+  METRIC_SEGMENTS_RECEIVED,
+  METRIC_BYTES_RECEIVED,
+  NUM_CONN_METRICS,
+
+  METRIC_CONNECTIONS_OPENED = NUM_CONN_METRICS,
+  METRIC_CONNECTIONS_CLOSED,
+  NUM_METRICS
+};
+
+/** A set of counters. */
+typedef struct metrics {
+  uint64_t count[NUM_METRICS];
+} metrics_t;
+
+/** Histograms kept by the library, numbered after the ones timed with
+    conn_time(). */
+enum {
+  TIMING_OUTPUT_QUEUE = NUM_CONN_TIMINGS,
+  NUM_TIMINGS
+};
+
+/** Histograms split each power of two into HIST_SUB_BUCKETS buckets, so a
+    value is known to within 1/HIST_SUB_BUCKETS of itself. Values of
+    2^HIST_MAX_BITS and over go in the last bucket. */
+#define HIST_SUB_BITS 3
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 32
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+/** A log-linear histogram of times, in microseconds. */
+typedef struct histogram {
+  uint32_t count[HIST_BUCKETS];
+  uint64_t total;              /* Number of values */
+  uint64_t sum;                /* Sum of the values */
+} histogram_t;
+
+/** Called to write out the report, in the Prometheus text format. */
+typedef void (*metrics_report_t)(FILE *out);
+
+
+/**
+ * Adds to a counter. Only the thread that owns the counters may call this.
+ *
+ * m: The counters.
+ * metric: The counter to add to.
+ * n: Amount to add.
+ */
+static inline void metrics_add(metrics_t *m, int metric, uint64_t n) {
+  __atomic_store_n(&m->count[metric], m->count[metric] + n, __ATOMIC_RELAXED);
+}
+
+/**
+ * Returns the value of a counter. Can be called from any thread.
+ */
+uint64_t metrics_get(const metrics_t *m, int metric);
+
+/**
+ * Adds a value to a histogram. Only the thread that owns the histogram may
+ * call this.
+ *
+ * h: The histogram.
+ * value: The value, in microseconds.
+ */
+void hist_record(histogram_t *h, uint64_t value);
+
+/**
+ * Adds the values of one histogram to another. The histogram added can be
+ * owned by another thread.
+ *
+ * into: The histogram to add to.
+ * h: The histogram to add.
+ */
+void hist_merge(histogram_t *into, const histogram_t *h);
+
+/**
+ * Returns a percentile of a histogram: the highest value in the bucket that
+ * holds it.
+ *
+ * h: The histogram.
+ * p: The percentile, between 0 and 1 (e.g. 0.99).
+ * returns: The value, or 0 if the histogram is empty.
+ */
+uint64_t hist_percentile(const histogram_t *h, double p);
+
+/**
+ * Returns the name of a histogram, without the "ctcp_" prefix or the
+ * "_seconds" suffix, e.g. "rtt".
+ */
+const char *timing_name(int timing);
+
+/**
+ * Returns the help text of a histogram.
+ */
+const char *timing_help(int timing);
+
+/**
+ * Returns the name of a counter, without the "ctcp_" prefix or the "_total"
+ * suffix, e.g. "retransmits".
+ */
+const char *metric_name(int metric);
+
+/**
+ * Returns the help text of a counter.
+ */
+const char *metric_help(int metric);
+
+/**
+ * Writes the HELP and TYPE lines that start a metric family.
+ *
+ * out: Where to write.
+ * name: Full name of the metric, e.g. "ctcp_retransmits_total".
+ * type: "counter" or "gauge".
+ * help: Help text.
+ */
+void metrics_family(FILE *out, const char *name, const char *type,
+                    const char *help);
+
+/**
+ * Writes one sample of a metric family.
+ *
+ * out: Where to write.
+ * name: Full name of the metric.
+ * labels: Labels, e.g. "peer=\"localhost:5000\"", or NULL if none.
+ * value: The value.
+ */
+void metrics_sample(FILE *out, const char *name, const char *labels,
+                    uint64_t value);
+
+/**
+ * Writes a histogram as the samples of a summary: its 50th, 99th and 99.9th
+ * percentiles, sum and count, in seconds.
+ *
+ * out: Where to write.
+ * name: Full name of the metric, e.g. "ctcp_rtt_seconds".
+ * labels: Labels, or NULL if none.
+ * h: The histogram.
+ */
+void metrics_summary(FILE *out, const char *name, const char *labels,
+                     const histogram_t *h);
+
+/**
+ * Writes the report into a buffer, which must be freed.
+ *
+ * report: Writes the report.
+ * len: Set to the length of the report.
+ * returns: The report, or NULL on failure.
+ */
+char *metrics_render(metrics_report_t report, size_t *len);
+
+/**
+ * Blocks SIGUSR1 and returns a signalfd that becomes readable when it
+ * arrives. Call before starting any threads, so that none of them takes the
+ * signal.
+ *
+ * returns: The signalfd, or -1 on failure.
+ */
+int metrics_signal_fd(void);
+
+/**
+ * Reads the signals waiting on the signalfd, and writes the report to
+ * STDERR.
+ *
+ * fd: The signalfd.
+ * report: Writes the report.
+ */
+void metrics_dump(int fd, metrics_report_t report);
+
+#endif /* CTCP_METRICS_H */
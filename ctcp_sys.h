@@ -30,6 +30,7 @@
 #include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 
 /** Connection object. Used to identify the receiver of sent segments.
@@ -37,6 +38,11 @@
 typedef struct conn conn_t;
 struct conn;
 
+/** Reference-counted buffer, shared by every segment whose data is in it.
+    Definition can be found in ctcp_utils.h. */
+typedef struct shared_buf shared_buf_t;
+struct shared_buf;
+
 /**
  * cTCP segment.
  *
@@ -70,6 +76,24 @@ typedef struct ctcp_segment {
  */
 int conn_input(conn_t *conn, void *buf, size_t len);
 
+/**
+ * Like conn_input(), but reads into several buffers with one system call,
+ * filling each buffer before moving on to the next. Use this to read a large
+ * block of input straight into the data of several segments.
+ *
+ * If ctcp_read() returns before conn_input() or conn_inputv() has returned 0
+ * (for example, because there is no room left to buffer more input), the
+ * library stops calling ctcp_read() until it has. Call ctcp_read() yourself
+ * once there is room again.
+ *
+ * conn: Connection object to identify the eventual destination of this input.
+ * iov: Buffers to read into.
+ * iovcnt: Number of buffers.
+ * returns: -1 if error or EOF, otherwise the actual number of bytes read. If
+ *          no data is available, returns 0.
+ */
+int conn_inputv(conn_t *conn, const struct iovec *iov, int iovcnt);
+
 /**
  * Call on this to send a cTCP segment to a destination associated with the
  * provided connection object.
@@ -87,6 +111,76 @@ int conn_input(conn_t *conn, void *buf, size_t len);
  */
 int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len);
 
+/**
+ * Like conn_send(), but the segment's data is stored apart from its header,
+ * e.g. in the mapping returned by conn_input_map(). The data is copied
+ * straight into the packet, so nothing needs to be assembled first. The
+ * checksum in the header must cover the header followed by the data (see
+ * cksum_iov()).
+ *
+ * conn: Connection object.
+ * segment: cTCP header of the segment. Its len field includes the data.
+ * data: The segment's data.
+ * data_len: Length of the data.
+ *
+ * returns: The number of bytes actually sent (including the cTCP header), 0
+ *          if nothing was sent, or -1 if there was an error.
+ */
+int conn_sendv(conn_t *conn, ctcp_segment_t *segment, const void *data,
+               size_t data_len);
+
+/**
+ * [Client only]
+ * Returns the whole input when the client was started with --send-file, which
+ * memory-maps the file instead of reading it. Segments can then point into
+ * the mapping and be sent with conn_sendv(), so the data is never copied into
+ * a segment, and retransmissions read it from the mapping again. The mapping
+ * stays valid until the program exits.
+ *
+ * If this returns NULL, read input with conn_input() or conn_inputv() as
+ * usual. Otherwise, conn_input() still reads the same file, but there is no
+ * need to call it: the input ends where the mapping does.
+ *
+ * conn: Connection object.
+ * len: Set to the length of the input.
+ *
+ * returns: The input, or NULL if it is not memory-mapped.
+ */
+const char *conn_input_map(conn_t *conn, size_t *len);
+
+/**
+ * [Server only]
+ * Returns true if the server was started with --broadcast. Its input then goes
+ * to every client instead of only the most recently connected one, and must
+ * be taken with conn_input_shared() instead of conn_input().
+ *
+ * conn: Connection object.
+ */
+bool conn_input_broadcast(conn_t *conn);
+
+/**
+ * [Server only]
+ * Takes the next piece of input with --broadcast. The input is read once into
+ * a buffer shared by every client, so instead of copying the data, this
+ * points to it. A reference to the buffer is taken for the caller, who must
+ * give it up with shared_buf_unref() once the data is no longer needed (e.g.
+ * once the segment holding it is acked). Send the data with conn_sendv().
+ *
+ * More input is only read once every client has taken all of the buffer, so
+ * the slowest client sets the pace. If this returns 0, ctcp_read() is called
+ * again once there is more.
+ *
+ * conn: Connection object.
+ * len: Maximum number of bytes to take.
+ * buf: Set to the buffer holding the data.
+ * data: Set to the data.
+ *
+ * returns: -1 if error or EOF, otherwise the number of bytes taken. If no
+ *          input is available, returns 0.
+ */
+int conn_input_shared(conn_t *conn, size_t len, shared_buf_t **buf,
+                      const char **data);
+
 /**
  * Call on this to produce output from the segments you have received from the
  * associated connection. This will either write output to STDOUT or to the
@@ -109,6 +203,31 @@ int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len);
  */
 int conn_output(conn_t *conn, const char *buf, size_t len);
 
+/**
+ * Like conn_output(), but outputs several buffers in order with one system
+ * call, straight from the buffers. Use this to output the data of several
+ * received segments at once. Whatever cannot be written right away is copied,
+ * so the buffers can be freed as soon as this returns. As with conn_output(),
+ * check conn_bufspace() first; the buffers together should not hold more than
+ * it reports.
+ *
+ * conn: The associated connection object that sent the segments.
+ * iov: Buffers to output.
+ * iovcnt: Number of buffers.
+ * returns: -1 if error, otherwise the number of bytes written out.
+ */
+int conn_outputv(conn_t *conn, const struct iovec *iov, int iovcnt);
+
+/**
+ * Asks the library to call ctcp_output() once it has handled the segments that
+ * arrived together with the current one, instead of outputting right away.
+ * Segments that arrive together can then be output together, with one
+ * conn_outputv().
+ *
+ * conn: The connection object.
+ */
+void conn_output_later(conn_t *conn);
+
 /**
  * Checks how much space is available in STDOUT for output. conn_output() can
  * only write as many bytes as reported by conn_bufspace(). If you write out
@@ -121,6 +240,33 @@ int conn_output(conn_t *conn, const char *buf, size_t len);
  */
 size_t conn_bufspace(conn_t *conn);
 
+/**
+ * Returns true if output goes to a file given with --recv-file. Each segment's
+ * data can then be written with conn_output_at() as soon as it arrives, in
+ * any order, instead of being held until the data before it has arrived. The
+ * file takes the place of STDOUT, so conn_output() still works too, but the
+ * two should not be mixed. Use conn_output() with a length of 0 to signal an
+ * EOF either way.
+ *
+ * conn: The connection object.
+ */
+bool conn_output_direct(conn_t *conn);
+
+/**
+ * Writes data straight to its place in the output file (see
+ * conn_output_direct()). There is no need to check conn_bufspace() first.
+ * Writing the same data twice is harmless.
+ *
+ * conn: The associated connection object.
+ * offset: Offset of the data from the start of this connection's output, i.e.
+ *         the sequence number of its first byte minus one.
+ * buf: The buffer containing the output.
+ * len: Number of bytes to write out.
+ * returns: -1 if error, otherwise the number of bytes written out.
+ */
+int conn_output_at(conn_t *conn, uint32_t offset, const char *buf,
+                   size_t len);
+
 /**
  * Used to remove a connection object. This is already called on in the starter
  * code in ctcp_destroy(), so you do not need to add calls to it.
@@ -129,6 +275,68 @@ size_t conn_bufspace(conn_t *conn);
  */
 void conn_remove(conn_t *conn);
 
+/** Events counted with conn_count(). */
+typedef enum {
+  CONN_RETRANSMIT,             /* A segment was sent again after a timeout */
+  CONN_DUPLICATE,              /* A segment was received that already had
+                                  been */
+  CONN_WINDOW_STALL,           /* A segment was ready to send, but was outside
+                                  of the send window */
+  CONN_BUFSPACE_STALL,         /* Output was held back because
+                                  conn_bufspace() was too small */
+  CONN_TRUNCATED,              /* A truncated segment was received */
+  CONN_BAD_CKSUM,              /* A segment with a bad checksum was received */
+  CONN_OUT_OF_WINDOW,          /* A segment beyond the receive window was
+                                  received */
+  CONN_RTO_EXPIRED,            /* The retransmission timer of a segment
+                                  expired */
+  NUM_CONN_EVENTS
+} conn_event_t;
+
+/**
+ * Counts an event on a connection. The counts are reported, along with the
+ * segments and bytes sent and received (which the library counts itself),
+ * on the control socket (see --control) and on SIGUSR1. Each event is also
+ * kept in the connection's flight recorder (see conn_flight_dump()). Counting
+ * is cheap enough to do on every segment.
+ *
+ * conn: The connection object.
+ * event: The event.
+ */
+void conn_count(conn_t *conn, conn_event_t event);
+
+/**
+ * Writes a connection's last few hundred events to STDERR: segments sent,
+ * acks received and the events counted with conn_count(). Call this when
+ * something goes wrong that the events might explain, e.g. before giving up
+ * on a connection whose segments are never acked.
+ *
+ * conn: The connection object.
+ * reason: Why the events are dumped.
+ */
+void conn_flight_dump(conn_t *conn, const char *reason);
+
+/** Delays timed with conn_time(). */
+typedef enum {
+  CONN_RTT,                    /* From sending a segment to the ack that
+                                  covers it, if it was only sent once */
+  CONN_REASSEMBLY_DELAY,       /* From receiving a segment to outputting it,
+                                  e.g. while waiting for a hole to fill */
+  CONN_SEND_DELAY,             /* From reading input to first sending it */
+  NUM_CONN_TIMINGS
+} conn_timing_t;
+
+/**
+ * Records how long something took on a connection. The times are kept in
+ * histograms, whose percentiles are reported along with the counts (see
+ * conn_count()). Get the times with current_time_us().
+ *
+ * conn: The connection object.
+ * timing: What was timed.
+ * usec: How long it took, in microseconds.
+ */
+void conn_time(conn_t *conn, conn_timing_t timing, uint64_t usec);
+
 
 /** Whether or not the tester's debugging is turned on. You can ignore this. */
 bool test_debug_on;
@@ -10,15 +10,28 @@
  * this file.
  *****************************************************************************/
 
+#define _GNU_SOURCE
 #include <errno.h>
-#include <poll.h>
+#include <limits.h>
 #include <pthread.h>
 #include <stddef.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <malloc.h>
+
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include "ctcp_control.h"
 #include "ctcp_sys_internal.h"
 #include "ctcp_sys.h"
+#include "ctcp_trace.h"
 
 #define ASSERT_CLIENT_ONLY (assert(!SERVER))
 #define ASSERT_SERVER_ONLY (assert(SERVER))
@@ -39,8 +52,6 @@ struct config {
   conn_t *sconn;               /* Server connection details. */
 
   /* Server */
-  conn_t *connections;         /* Connection details for clients connected
-                                  to this server */
   char *program;               /* Program to start */
   int argc;                    /* Number of arguments to this program */
   char **argv;                 /* Array of arguments */
@@ -69,24 +80,187 @@ static bool tester_did_unreliable = false;
 /** Log file. */
 int log_file = -1;
 
-/** Port number of a new connection if a client just connected. Used to avoid
-    logging ACK segments in response to a SYN+ACK. */
-static int new_connection = 0;
+/** Number of data bytes logged per segment. Changed with --log-payload. */
+static int log_payload = LOG_DEFAULT_PAYLOAD;
+
+/** File packets are captured to with --pcap, and most bytes captured of each
+    packet (see --snaplen). */
+static int pcap_file = -1;
+static int snaplen = PCAP_DEFAULT_SNAPLEN;
+
+/** Control socket opened with --control, and signalfd the metrics are
+    dumped to STDERR from on SIGUSR1. */
+static char *control_path = NULL;
+static int signal_fd = -1;
+
+/** Round-trip time, in ms, over which a connection's flight recorder is dumped
+    to STDERR. Set with --flight-threshold. 0 means never. */
+static int flight_threshold = 0;
+
+/** Maximum number of clients that can be connected, and the number that are,
+    across all shards. */
+static unsigned int max_clients = MAX_NUM_CLIENTS;
+static unsigned int num_clients = 0;
+
+/** Maximum number of bytes of output queued for each connection. */
+static size_t buf_space = MAX_BUF_SPACE;
+
+/** File the client sends instead of STDIN (--send-file), and its memory
+    mapping (see conn_input_map()). */
+static char *send_file = NULL;
+static const char *send_map = NULL;
+static size_t send_map_len = 0;
+
+/** File output is written to with --recv-file, in place of STDOUT. Data can
+    then be written at any offset (see conn_output_at()). */
+static char *recv_file = NULL;
+
+/** With --resume, the client asks the server how much of the file it already
+    has and skips that much, and a server with --recv-file keeps a checkpoint
+    of how much of its file is complete (see write_checkpoint()). */
+static bool resume = false;
+static int resume_fd = -1;           /* File holding the checkpoint */
+static off_t resume_offset = 0;      /* Last checkpoint written */
+static long last_checkpoint = 0;     /* When it was written */
+static bool resume_rest = false;     /* The client sends the rest of its
+                                        file over another connection */
+static char **client_argv = NULL;    /* To start that connection */
+
+/** With --broadcast, the server reads its input once into a shared buffer,
+    and sends it to every client (see conn_input_shared()). */
+static bool broadcast = false;
+static shared_buf_t *bcast_buf = NULL; /* Input clients are taking */
+static bool bcast_eof = false;         /* EOF read */
+static bool bcast_wanted = false;      /* A client may have taken all of it */
+static bool bcast_watching = true;     /* STDIN is watched */
+
+/** With --stripes, the client splits its --send-file file into that many
+    chunks, and sends each over its own connection from its own process (see
+    fork_stripes()). Each process then only sees its chunk. */
+static int stripes = 1;
+static bool striped = false;         /* This process sends one stripe */
+static off_t stripe_offset = 0;      /* Where it starts in the file */
+static size_t send_map_pos = 0;      /* How much conn_input() has copied */
+
+/** Event loop backend. Changed to io_uring with --io-uring. */
+static ev_backend_t backend = EV_EPOLL;
+
+/** Whether or not this is a process forked to delay or duplicate a segment
+    (see conn_send()). */
+static bool forked = false;
+
+/** Largest packet (data and headers) that can be sent or received, which
+    depends on the MSS (see --mss). */
+static size_t max_packet_size = FULL_HDR_SIZE + MAX_SEG_DATA_SIZE;
+
+/** Packet handed from the receiving thread to a shard. The ring's slots
+    hold packets of up to SHARD_SLOT_DATA bytes (see shard_slot()). Larger
+    ones, with jumbo segments, are copied into memory of their own, which the
+    shard frees once it has handled them. */
+struct shard_packet {
+  int len;                     /* Length of the packet */
+  char *data;                  /* The packet, in buf or allocated */
+  char buf[];
+};
+
+/** Lists the current thread's connections, for a command of the control
+    socket. */
+typedef void (*conn_list_t)(FILE *out);
 
 /**
- * Polling configuration:
- *    0    STDIN
- *    1    STDOUT
- *    2    Network
- *    3... Program STDOUT/STDERR (if running as server)
+ * A shard owns a subset of the connections and runs its own event loop. The
+ * client and a single-threaded server have one shard, run on the main thread.
+ * With --threads N, the server runs N shards on their own threads. The main
+ * thread receives every packet and steers it to the shard that owns the
+ * sender's address (see shard_for()), so shards never share connections and
+ * no locks are taken on the per-packet path.
+ *
+ * Event loop handlers that are always registered:
+ *    STDIN    (main thread only, single-threaded)
+ *    STDOUT
+ *    Network  (main thread only)
+ *    Wake-up  (--threads only, signals packets waiting in the ring)
+ * Each connection also registers its program's STDIN and STDOUT (if running
+ * as a server with a program).
  */
-static struct pollfd *events;
+struct shard {
+  pthread_t thread;            /* Thread running this shard */
+  ev_loop_t *loop;             /* Event loop */
+  ev_handler_t stdout_handler; /* Used for waiting on STDOUT */
 
-/** When the last timer timeout occurred. */
-static struct timespec last_timeout;
+  conn_table_t *conn_table;    /* Table of connected clients */
+  conn_t *connections;         /* Connection details for clients connected
+                                  to this server */
+  conn_t *delete_list;         /* Connections that have been removed and are
+                                  waiting to be freed */
+  conn_t *flush_list;          /* Connections with newly queued output */
+  struct timespec last_timeout;/* When the last timer timeout occurred */
+
+  /* Port number of a new connection if a client just connected. Used to avoid
+     logging ACK segments in response to a SYN+ACK. */
+  int new_connection;
+
+  /* Packets steered to this shard. Written only by the receiving thread and
+     read only by the shard, so the indices need no lock. */
+  struct shard_packet *ring;
+  unsigned int ring_head;      /* Next packet to handle (shard) */
+  unsigned int ring_tail;      /* Next free slot (receiving thread) */
+  int wake_fd;                 /* eventfd used to wake the shard */
+  ev_handler_t wake_handler;
+  bool needs_wake;             /* Packets added since the last wake-up */
+
+  /* Segments waiting to be logged, if logging to a file, and packets waiting
+     to be captured, with --pcap (see ctcp_log.h). */
+  log_ring_t *log_ring;
+  log_ring_t *pcap_ring;
+
+  /* Counters and histograms for every connection this shard has had (see
+     --control). */
+  metrics_t metrics;
+  histogram_t timings[NUM_TIMINGS];
+
+  /* Connections listed for a command of the control socket (--threads only).
+     The main thread sets info_wanted to what lists them and wakes the shard,
+     which lists its connections in info and signals info_done_fd. */
+  conn_list_t info_wanted;
+  char *info;
+  size_t info_len;
+};
 
-/** Number of clients connected. MAX_NUM_CLIENTS can be connected. */
-static int num_connected = 0;
+/** Number of packets that can wait for a shard. Must be a power of two. */
+#define SHARD_RING_SIZE 1024
+
+/** Bytes of packet held in each slot of a shard's ring: a full segment with
+    the default MSS. Slots are kept aligned for struct shard_packet. */
+#define SHARD_SLOT_DATA (FULL_HDR_SIZE + MAX_SEG_DATA_SIZE)
+#define SHARD_SLOT_SIZE \
+  ((sizeof(struct shard_packet) + SHARD_SLOT_DATA + 7) & ~(size_t) 7)
+
+/** All shards, and the shard owned by the current thread. */
+static struct shard *shards;
+static int num_shards = 1;
+static __thread struct shard *shard;
+
+/** Handlers registered only by the main thread. */
+static ev_handler_t stdin_handler;
+static ev_handler_t socket_handler;
+static ev_handler_t signal_handler;
+
+/** [--threads only] Clients waiting for the shards to list their connections
+    (see list_command()), what the shards are listing, and number of shards
+    yet to list it. The shards list what the first client waiting asked for,
+    which stays what they are listing even if that client hangs up. */
+struct info_request {
+  control_client_t *client;
+  conn_list_t header;          /* Writes what comes before the connections */
+  conn_list_t list;            /* Lists a shard's connections */
+};
+static struct info_request *info_requests;
+static int num_info_requests;
+static struct info_request info_listing;
+static int info_pending;
+static int info_done_fd = -1;
+static ev_handler_t info_done_handler;
 
 /** Main thread and thread for sending rests. */
 static pthread_t thread_main;
@@ -103,7 +277,7 @@ static bool handling_resets = false;
  *          server), or to the connection to the server (for the client).
  */
 conn_t *get_connections() {
-  if (SERVER)  return config->connections;
+  if (SERVER)  return shard->connections;
   else         return config->sconn;
 }
 
@@ -146,7 +320,6 @@ int do_config(char *port) {
   /* Other configuration. */
   config->port = atoi(port);
   config->socket = s;
-  config->connections = NULL;
 
   /* Set up receive timeout. */
   struct timeval tv;
@@ -219,7 +392,7 @@ int do_config_server(char *server) { ASSERT_CLIENT_ONLY;
   server_port_str = strsep(&server, ":");
   server_port = atoi(server_port_str);
   config->sconn = calloc(sizeof(conn_t), 1);
-  conn_add(config->sconn);
+  config->sconn->out_queue.size = buf_space;
 
   /* Get IP address of server. See if this is a server on the same machine. */
   in_addr_t dst_ip = ip_from_hostname(_server);
@@ -228,9 +401,20 @@ int do_config_server(char *server) { ASSERT_CLIENT_ONLY;
   else if (dst_ip != LOCALHOST)
     unix_socket = false;
 
+  /* Real networks don't carry packets larger than their MTU. */
+  if (!unix_socket && ctcp_cfg->mss > MAX_SEG_DATA_SIZE) {
+    fprintf(stderr, "[ERROR] An MSS above %d only works with a server on "
+            "this machine\n", MAX_SEG_DATA_SIZE);
+    return -1;
+  }
+
   /* Set up connection details. */
   int port = server_port == 0 ? DEFAULT_PORT : server_port;
   conn_setup(config->sconn, dst_ip, port, unix_socket);
+  if (conn_add(config->sconn) < 0) {
+    fprintf(stderr, "[ERROR] Could not add the connection to the server\n");
+    return -1;
+  }
 
   return 0;
 }
@@ -273,39 +457,44 @@ char *create_tcp_rst(in_addr_t ip_dst, uint16_t port_src, uint16_t port_dst,
  *
  * dst: A conn_t containing details for the destination.
  * flags: TCP flags.
+ * opts: TCP options to add to the header, if any.
+ * opts_len: Length of the options. Must be a multiple of 4.
  * data: Buffer containing the data payload.
  * len: Data length (should not include the size of the headers).
  *
  * returns: A TCP segment with the specified fields.
  */
-char *create_tcp_seg(conn_t *dst, uint8_t flags, char *data, uint16_t len) {
-  uint16_t tcp_seg_len = TCP_HDR_SIZE + len;
+char *create_tcp_seg(conn_t *dst, uint8_t flags, const uint8_t *opts,
+                     uint8_t opts_len, char *data, uint16_t len) {
+  uint16_t tcp_seg_len = TCP_HDR_SIZE + opts_len + len;
   char *datagram = create_datagram(config->ip_addr, dst->ip_addr, tcp_seg_len);
   iphdr_t *ip_hdr = (iphdr_t *) datagram;
   tcphdr_t *tcp_hdr = (tcphdr_t *) (datagram + IP_HDR_SIZE);
 
-  /* Copy data over, if there is any. */
+  /* Copy options and data over, if there are any. */
+  if (opts_len > 0)
+    memcpy((uint8_t *) tcp_hdr + TCP_HDR_SIZE, opts, opts_len);
   if (len > 0 && data != NULL) {
-    char *payload = (char *)((uint8_t *) tcp_hdr + TCP_HDR_SIZE);
+    char *payload = (char *)((uint8_t *) tcp_hdr + TCP_HDR_SIZE + opts_len);
     memcpy(payload, data, len);
   }
 
   uint16_t window = 0;
   if (!(flags & TH_RST))
-    window = htons(ctcp_cfg->recv_window);
+    window = htons(MIN(ctcp_cfg->recv_window, 0xffff));
 
   /* TCP header. */
   tcp_hdr->th_sport = htons(config->port);
   tcp_hdr->th_dport = htons(dst->port);
   tcp_hdr->th_seq = htonl(dst->next_seqno);
   tcp_hdr->th_ack = htonl(dst->ackno);
-  tcp_hdr->th_off = TCP_HDR_SIZE / 4;
+  tcp_hdr->th_off = (TCP_HDR_SIZE + opts_len) / 4;
   tcp_hdr->th_flags = flags;
   tcp_hdr->th_win = window;
   tcp_hdr->th_sum = 0;
 
   /* TCP checksum. */
-  tcp_hdr->th_sum = cksum_tcp(ip_hdr, len);
+  tcp_hdr->th_sum = cksum_tcp(ip_hdr, opts_len + len);
 
   /* Update sequence numbers. */
   dst->seqno = dst->next_seqno;
@@ -361,11 +550,13 @@ ctcp_segment_t *convert_to_ctcp(conn_t *src, char *datagram, int actual_len) {
  * packet must be freed.
  *
  * dst: A conn_t containing connection details of the packet's receiver.
- * segment: The cTCP segment.
+ * segment: The cTCP segment's header.
+ * data: The cTCP segment's data, which need not follow the header.
  * len: Length of the cTCP segment (including the headers).
  * returns: A raw IP packet, NULL if it has an incorrect checksum.
  */
-char *convert_to_datagram(conn_t *dst, ctcp_segment_t *segment, int len) {
+char *convert_to_datagram(conn_t *dst, ctcp_segment_t *segment,
+                          const void *data, int len) {
   /* Create IP packet with TCP payload. */
   uint16_t tcp_pkt_len = len - sizeof(ctcp_segment_t) + TCP_HDR_SIZE;
   char *datagram = create_datagram(config->ip_addr, dst->ip_addr, tcp_pkt_len);
@@ -374,10 +565,9 @@ char *convert_to_datagram(conn_t *dst, ctcp_segment_t *segment, int len) {
 
   /* Copy data over, if there is any. */
   uint16_t data_len = len - sizeof(ctcp_segment_t);
-  if (data_len > 0 && segment->data != NULL) {
-    char *payload = (char *)((uint8_t *) tcp_hdr + TCP_HDR_SIZE);
-    memcpy(payload, segment->data, data_len);
-  }
+  char *payload = (char *)((uint8_t *) tcp_hdr + TCP_HDR_SIZE);
+  if (data_len > 0 && data != NULL)
+    memcpy(payload, data, data_len);
 
   /* TCP header. Convert relative sequence numbers to sequence numbers. */
   tcp_hdr->th_sport = htons(config->port);
@@ -398,9 +588,13 @@ char *convert_to_datagram(conn_t *dst, ctcp_segment_t *segment, int len) {
      correctly. Otherwise, an incorrect cTCP checksum will result in an
      incorrect TCP checksum. */
   uint16_t sum = segment->cksum;
-  segment->cksum = 0;
-  uint16_t correct_sum = cksum(segment, len);
-  segment->cksum = sum;
+  ctcp_segment_t header = *segment;
+  header.cksum = 0;
+  struct iovec iov[2] = {
+    { &header, sizeof(ctcp_segment_t) },
+    { payload, data_len }
+  };
+  uint16_t correct_sum = cksum_iov(iov, 2);
 
   /* TCP checksum. Add on the difference between the correct checksum and the
      student's checksum. */
@@ -411,31 +605,29 @@ char *convert_to_datagram(conn_t *dst, ctcp_segment_t *segment, int len) {
 
 /**
  * Naive filtering. Host might receive many unwanted packets or leftover
- * packets from a previous session. We drop these packets.
+ * packets from a previous session. We drop these packets. Connections are
+ * looked up in the current thread's shard.
  *
- * sockfd: Socket file descriptor.
- * buf: Buffer to receive data into.
- * len: Length of buffer and maximum size of data to receive.
- * flags: Flags for recv.
+ * buf: The received packet.
+ * r: Length of the received packet.
  * rconn: Return parameter. Pointer to the connection state associated with
  *        the sender of the packet.
  *
- * returns: Length of packet if packet wasn't dropped, 0 if no packet
- *          received, and -1 on failure.
+ * returns: Length of packet if packet wasn't dropped, 0 otherwise.
  */
-int recv_filter(int sockfd, void *buf, size_t len, int flags, conn_t **rconn) {
-  int r = recv(sockfd, buf, len, flags);
-  if (r < 0)
-    return -1;
-
-  if (r < FULL_HDR_SIZE)
+int filter_packet(void *buf, int r, conn_t **rconn) {
+  if (r < FULL_HDR_SIZE) {
+    CTCP_TRACE(filter_drop, 0, r, FILTER_SHORT);
     return 0;
+  }
 
   /* Is this packet to us? If not, ignore it. */
   iphdr_t *ip_hdr = (iphdr_t *) buf;
   tcphdr_t *tcp_hdr = (tcphdr_t *) (buf + IP_HDR_SIZE);
-  if (tcp_hdr->th_dport != htons(config->port))
+  if (tcp_hdr->th_dport != htons(config->port)) {
+    CTCP_TRACE(filter_drop, ntohs(tcp_hdr->th_sport), r, FILTER_PORT);
     return 0;
+  }
 
   /* A RST packet. End connection. */
   if (tcp_hdr->th_flags & TH_RST) {
@@ -450,36 +642,58 @@ int recv_filter(int sockfd, void *buf, size_t len, int flags, conn_t **rconn) {
   /* Some other packet from somewhere where we've already established a
      connection. Must have the correct source IP, port, and a sequence
      number we expect. */
-  conn_t *conn = get_connections();
-  while (conn != NULL) {
-    if (conn->port == ntohs(tcp_hdr->th_sport) &&
-        (unix_socket || (!unix_socket && conn->ip_addr == ip_hdr->saddr)) &&
-        ntohl(tcp_hdr->th_seq) >= conn->their_init_seqno &&
-        ntohl(tcp_hdr->th_ack) >= conn->init_seqno) {
-      /* Return associated connection. */
-      if (rconn != NULL)
-        *rconn = conn;
+  conn_t *conn = ct_find(shard->conn_table, unix_socket ? 0 : ip_hdr->saddr,
+                         ntohs(tcp_hdr->th_sport));
+  if (conn != NULL &&
+      ntohl(tcp_hdr->th_seq) >= conn->their_init_seqno &&
+      ntohl(tcp_hdr->th_ack) >= conn->init_seqno) {
+    /* Return associated connection. */
+    if (rconn != NULL)
+      *rconn = conn;
 
-      return r;
-    }
-    conn = conn->next;
+    return r;
   }
 
+  CTCP_TRACE(filter_drop, ntohs(tcp_hdr->th_sport), r, FILTER_UNKNOWN);
   return 0;
 }
 
 /**
- * Sends a packet out through the appropriate socket.
+ * Receives a packet and filters it with filter_packet().
+ *
+ * sockfd: Socket file descriptor.
+ * buf: Buffer to receive data into.
+ * len: Length of buffer and maximum size of data to receive.
+ * flags: Flags for recv.
+ * rconn: Return parameter. Pointer to the connection state associated with
+ *        the sender of the packet.
+ *
+ * returns: Length of packet if packet wasn't dropped, 0 if no packet
+ *          received, and -1 on failure.
+ */
+int recv_filter(int sockfd, void *buf, size_t len, int flags, conn_t **rconn) {
+  int r = recv(sockfd, buf, len, flags);
+  if (r < 0)
+    return -1;
+
+  return filter_packet(buf, r, rconn);
+}
+
+/**
+ * Sends a packet out through the appropriate socket. With io_uring, the packet
+ * is queued and sent along with others the next time the event loop submits
+ * work, unless it has to go right away.
  *
  * dst: Destination connection object.
  * sockfd: Socket file descriptor.
  * buf: Data to send.
  * len: Length of data.
- * flags: Flags for sendto.
+ * queue: Whether the packet may be queued. Otherwise it is sent with sendto().
  *
- * returns: Number of bytes actually sent, or -1 if error.
+ * returns: Number of bytes actually sent (or queued), or -1 if error.
  */
-int send_pkt(conn_t *dst, int sockfd, const void *buf, size_t len, int flags) {
+int send_pkt(conn_t *dst, int sockfd, const void *buf, size_t len,
+             bool queue) {
   struct sockaddr *addr;
   size_t size;
 
@@ -493,7 +707,11 @@ int send_pkt(conn_t *dst, int sockfd, const void *buf, size_t len, int flags) {
     size = sizeof(dst->saddr);
   }
 
-  return sendto(config->socket, buf, len, flags, addr, size);
+  /* A forked process shares its parent's io_uring, so it must not queue
+     anything on it. */
+  if (forked || !queue)
+    return sendto(config->socket, buf, len, 0, addr, size);
+  return ev_send(shard->loop, config->socket, buf, len, addr, size);
 }
 
 /**
@@ -502,12 +720,12 @@ int send_pkt(conn_t *dst, int sockfd, const void *buf, size_t len, int flags) {
  */
 void *send_resets(void *args) {
   fprintf(stderr, "[INFO] Cleaning up old connections... ");
-  char buf[MAX_PACKET_SIZE];
-  memset(buf, 0, MAX_PACKET_SIZE);
+  char buf[max_packet_size];
+  memset(buf, 0, max_packet_size);
   int r;
 
   /* See if there are leftover packets. If so, send resets to them. */
-  r = recv(config->socket, buf, MAX_PACKET_SIZE, 0);
+  r = recv(config->socket, buf, max_packet_size, 0);
   while (r > 0) {
     handling_resets = true;
 
@@ -523,7 +741,7 @@ void *send_resets(void *args) {
 
     int s = sendto(config->socket, rst, FULL_HDR_SIZE, 0,
                    (struct sockaddr *) &conn.saddr, sizeof(conn.saddr));
-    memset(buf, 0, MAX_PACKET_SIZE);
+    memset(buf, 0, max_packet_size);
     free(rst);
 
     /* Could not send resets. Give up. */
@@ -532,7 +750,7 @@ void *send_resets(void *args) {
 
     /* Continue checking for more packets to send resets to. */
     handling_resets = false;
-    r = recv(config->socket, buf, MAX_PACKET_SIZE, 0);
+    r = recv(config->socket, buf, max_packet_size, 0);
   }
 
   handling_resets = false;
@@ -544,12 +762,19 @@ void *send_resets(void *args) {
  *
  * dst: A conn_t object associated with the destination.
  * flags: TCP flags.
+ * opts: TCP options to add to the header, if any.
+ * opts_len: Length of the options. Must be a multiple of 4.
  *
  * returns: -1 if error, 0 otherwise.
  */
-int send_tcp_conn_seg(conn_t *dst, int flags) {
-  char *tcp_pkt = create_tcp_seg(dst, flags, NULL, 0);
-  int r = send_pkt(dst, config->socket, tcp_pkt, FULL_HDR_SIZE, 0);
+int send_tcp_conn_seg(conn_t *dst, int flags, const uint8_t *opts,
+                      uint8_t opts_len) {
+  char *tcp_pkt = create_tcp_seg(dst, flags, opts, opts_len, NULL, 0);
+  /* The client's handshake waits for a reply outside of the event loop,
+     which would never see a queued segment fail. Until the event loop starts,
+     the socket blocks, so sendto() waits until the other end has room. */
+  int r = send_pkt(dst, config->socket, tcp_pkt, FULL_HDR_SIZE + opts_len,
+                   false);
   free(tcp_pkt);
 
   if (r < 0) {
@@ -558,44 +783,323 @@ int send_tcp_conn_seg(conn_t *dst, int flags) {
   }
   return 0;
 }
+/**
+ * Fills in one of the experimental TCP options used by --resume, --stripes
+ * and --mss (see TCP_OPT_RESUME_EXID, TCP_OPT_STRIPE_EXID and
+ * TCP_OPT_WINDOW_EXID).
+ *
+ * opt: Buffer for the option.
+ * exid: The option's ExID.
+ * len: Length of the option, 4, 8 or 12. An 8-byte option carries a 32-bit
+ *      value, and a 12-byte one a 64-bit value.
+ * value: Value carried by the option (a file offset or a window).
+ */
+void exp_option(uint8_t *opt, uint16_t exid, uint8_t len, uint64_t value) {
+  opt[0] = TCP_OPT_EXP;
+  opt[1] = len;
+  opt[2] = exid >> 8;
+  opt[3] = exid & 0xff;
+  if (len >= 12) {
+    uint64_t n = htobe64(value);
+    memcpy(opt + 4, &n, sizeof(n));
+  }
+  else if (len >= 8) {
+    uint32_t n = htonl(value);
+    memcpy(opt + 4, &n, sizeof(n));
+  }
+}
+
+/**
+ * Reads the value carried by an option filled in by exp_option().
+ *
+ * opt: The option. Must be 8 or 12 bytes long.
+ */
+uint64_t exp_option_value(const uint8_t *opt) {
+  if (opt[1] < 12) {
+    uint32_t n;
+    memcpy(&n, opt + 4, sizeof(n));
+    return ntohl(n);
+  }
+  uint64_t n;
+  memcpy(&n, opt + 4, sizeof(n));
+  return be64toh(n);
+}
+
+/**
+ * Looks for a TCP option in a packet's TCP header.
+ *
+ * pkt: The packet.
+ * len: Length of the packet.
+ * kind: Kind of the option.
+ * exid: ExID of the option, if it is an experimental one (TCP_OPT_EXP).
+ * returns: The option, or NULL if there is none.
+ */
+const uint8_t *find_tcp_option(const char *pkt, int len, uint8_t kind,
+                               uint16_t exid) {
+  const tcphdr_t *tcp_hdr = (const tcphdr_t *) (pkt + IP_HDR_SIZE);
+  const uint8_t *opt = (const uint8_t *) tcp_hdr + TCP_HDR_SIZE;
+  const uint8_t *end = (const uint8_t *) tcp_hdr + tcp_hdr->th_off * 4;
+  if ((const char *) end > pkt + len)
+    return NULL;
+
+  /* Options other than the end of the list and no-ops have a length. */
+  while (opt < end && opt[0] != TCPOPT_EOL) {
+    if (opt[0] == TCPOPT_NOP) {
+      opt++;
+      continue;
+    }
+    if (end - opt < 2 || opt[1] < 2 || end - opt < opt[1])
+      return NULL;
+    if (opt[0] == kind && (kind != TCP_OPT_EXP ||
+                           (opt[1] >= 4 && ((opt[2] << 8) | opt[3]) == exid)))
+      return opt;
+    opt += opt[1];
+  }
+  return NULL;
+}
+
+/**
+ * Looks for an experimental TCP option in a packet's TCP header.
+ *
+ * pkt: The packet.
+ * len: Length of the packet.
+ * exid: ExID of the option.
+ * returns: The option, or NULL if there is none.
+ */
+const uint8_t *find_exp_option(const char *pkt, int len, uint16_t exid) {
+  return find_tcp_option(pkt, len, TCP_OPT_EXP, exid);
+}
+
+/**
+ * Fills in the TCP options of a SYN or SYN-ACK. The MSS is only sent if it
+ * was changed with --mss, and the window only if it does not fit in the
+ * header, so that by default a SYN carries no more than the option used by
+ * --resume or --stripes.
+ *
+ * opts: Buffer for the options, at least TCP_OPT_MAX_LEN bytes.
+ * dst: The connection the SYN or SYN-ACK is sent on.
+ * synack: Whether this is a SYN-ACK.
+ * returns: Length of the options.
+ */
+uint8_t syn_options(uint8_t *opts, conn_t *dst, bool synack) {
+  uint8_t len = 0;
+
+  if (ctcp_cfg->mss != MAX_SEG_DATA_SIZE) {
+    uint16_t mss = htons(ctcp_cfg->mss);
+    opts[len] = TCPOPT_MAXSEG;
+    opts[len + 1] = TCPOLEN_MAXSEG;
+    memcpy(opts + len + 2, &mss, sizeof(mss));
+    len += TCPOLEN_MAXSEG;
+  }
+  if (ctcp_cfg->recv_window > 0xffff) {
+    exp_option(opts + len, TCP_OPT_WINDOW_EXID, TCP_OPT_WINDOW_LEN,
+               ctcp_cfg->recv_window);
+    len += TCP_OPT_WINDOW_LEN;
+  }
+
+  /* With --resume, the SYN asks where to resume, and the SYN-ACK answers.
+     With --stripes, the SYN says where the stripe goes, and the SYN-ACK
+     agrees. */
+  if (synack ? dst->striped : striped) {
+    exp_option(opts + len, TCP_OPT_STRIPE_EXID, TCP_OPT_STRIPE_LEN,
+               synack ? dst->recv_base : (uint64_t) stripe_offset);
+    len += TCP_OPT_STRIPE_LEN;
+  }
+  else if (synack && dst->resume) {
+    exp_option(opts + len, TCP_OPT_RESUME_EXID, TCP_OPT_RESUME_SYNACK_LEN,
+               dst->recv_base);
+    len += TCP_OPT_RESUME_SYNACK_LEN;
+  }
+  else if (!synack && resume) {
+    exp_option(opts + len, TCP_OPT_RESUME_EXID, TCP_OPT_RESUME_SYN_LEN, 0);
+    len += TCP_OPT_RESUME_SYN_LEN;
+  }
+  return len;
+}
+
+/**
+ * Reads the MSS and window the other host sent in its SYN or SYN-ACK (see
+ * syn_options()). Both hosts use the smaller of their MSSes, and a host that
+ * does not send one uses the default.
+ *
+ * pkt: The SYN or SYN-ACK.
+ * len: Length of the packet.
+ * cfg: Configuration to update.
+ */
+void read_syn_options(const char *pkt, int len, ctcp_config_t *cfg) {
+  const tcphdr_t *tcp_hdr = (const tcphdr_t *) (pkt + IP_HDR_SIZE);
+  uint16_t mss = MAX_SEG_DATA_SIZE;
+
+  const uint8_t *opt = find_tcp_option(pkt, len, TCPOPT_MAXSEG, 0);
+  if (opt != NULL && opt[1] >= TCPOLEN_MAXSEG) {
+    memcpy(&mss, opt + 2, sizeof(mss));
+    mss = MAX(ntohs(mss), MIN_MSS);
+  }
+  cfg->mss = MIN(cfg->mss, mss);
+
+  opt = find_exp_option(pkt, len, TCP_OPT_WINDOW_EXID);
+  if (opt != NULL && opt[1] >= TCP_OPT_WINDOW_LEN)
+    cfg->send_window = exp_option_value(opt);
+  else
+    cfg->send_window = ntohs(tcp_hdr->th_win);
+}
+
 inline int send_ack(conn_t *dst) {
-  return send_tcp_conn_seg(dst, TH_ACK);
+  return send_tcp_conn_seg(dst, TH_ACK, NULL, 0);
 }
 inline int send_rst(conn_t *dst) {
-  return send_tcp_conn_seg(dst, TH_RST);
+  return send_tcp_conn_seg(dst, TH_RST, NULL, 0);
 }
+
 inline int send_syn(conn_t *dst) {
-  return send_tcp_conn_seg(dst, TH_SYN);
+  uint8_t opts[TCP_OPT_MAX_LEN];
+  return send_tcp_conn_seg(dst, TH_SYN, opts, syn_options(opts, dst, false));
 }
 inline int send_synack(conn_t *dst) {
-  return send_tcp_conn_seg(dst, TH_SYN | TH_ACK);
+  uint8_t opts[TCP_OPT_MAX_LEN];
+  return send_tcp_conn_seg(dst, TH_SYN | TH_ACK, opts,
+                           syn_options(opts, dst, true));
 }
 
 
 ////////////////////// CONNECTIONS AND SENDING/RECEIVING //////////////////////
 
 /**
- * Add to the conn_t list.
+ * Add to the conn_t list and the connection table.
  *
- * conn_list: Pointer to linked list of conn_t objects.
  * conn: The new conn_t to add.
+ * returns: 0 on success, -1 if the maximum number of connections is reached.
  */
-void conn_add(conn_t *conn) {
-  conn_t *conn_list = get_connections();
+int conn_add(conn_t *conn) {
+  conn_t **conn_list = SERVER ? &shard->connections : &config->sconn;
+
+  /* Output written at an offset starts after whatever earlier connections
+     wrote to the file, or where the file stops being complete with
+     --resume. */
+  struct stat st;
+  if (resume_fd >= 0)
+    conn->recv_base = resume_offset;
+  else if (recv_file != NULL && fstat(STDOUT_FILENO, &st) == 0)
+    conn->recv_base = st.st_size;
+
+  /* Clients are steered to shards by address, so the limit is kept for the
+     whole process rather than for each shard's table. */
+  if (__atomic_add_fetch(&num_clients, 1, __ATOMIC_RELAXED) > max_clients &&
+      max_clients != 0) {
+    __atomic_sub_fetch(&num_clients, 1, __ATOMIC_RELAXED);
+    return -1;
+  }
+
+  /* Index by the other host's address so recv_filter() can find it. IP
+     addresses are not compared for Unix sockets. */
+  conn->slot = ct_add(shard->conn_table, unix_socket ? 0 : conn->ip_addr,
+                      conn->port, conn);
+  if (conn->slot < 0) {
+    __atomic_sub_fetch(&num_clients, 1, __ATOMIC_RELAXED);
+    return -1;
+  }
+  conn->highest_seqno_sent = 1;
+  conn->highest_ackno = 1;
+  conn->last_active = current_time();
+  metrics_add(&shard->metrics, METRIC_CONNECTIONS_OPENED, 1);
+  CTCP_TRACE(conn_create, conn, conn->port);
 
-  if (conn != conn_list) {
-    conn->prev = &conn_list;
-    conn->next = conn_list;
+  if (conn != *conn_list) {
+    conn->next = *conn_list;
 
-    if (conn_list)
-      conn_list->prev = &conn->next;
+    if (*conn_list)
+      (*conn_list)->prev = &conn->next;
   }
-  conn->out_queue_tail = &conn->out_queue;
+  conn->prev = conn_list;
+  *conn_list = conn;
+  return 0;
+}
 
-  if (SERVER)
-    config->connections = conn;
-  else
-    config->sconn = conn;
+/**
+ * Writes a connection's address, as "addr:port".
+ *
+ * conn: The connection object.
+ * buf: Buffer for the address.
+ * len: Size of the buffer.
+ */
+void peer_name(conn_t *conn, char *buf, size_t len) {
+  char addr[INET_ADDRSTRLEN] = "localhost";
+  if (!unix_socket)
+    inet_ntop(AF_INET, &conn->ip_addr, addr, sizeof(addr));
+  snprintf(buf, len, "%s:%d", addr, conn->port);
+}
+
+/**
+ * Adds to one of a connection's counters, and to the shard's.
+ *
+ * conn: The connection object.
+ * metric: The counter to add to.
+ * n: Amount to add.
+ */
+void conn_metric_add(conn_t *conn, int metric, uint64_t n) {
+  metrics_add(&conn->metrics, metric, n);
+  metrics_add(&shard->metrics, metric, n);
+}
+
+void conn_count(conn_t *conn, conn_event_t event) {
+  conn_metric_add(conn, event, 1);
+  flight_record(&conn->flight, event, current_time_us(),
+                conn->highest_seqno_sent, conn->highest_ackno, 0, 0);
+}
+
+/**
+ * Writes a connection's flight recorder out, headed by its address.
+ *
+ * conn: The connection object.
+ * out: Where to write.
+ * reason: Why it is written out, or NULL.
+ */
+void flight_write(conn_t *conn, FILE *out, const char *reason) {
+  char peer[32];
+  peer_name(conn, peer, sizeof(peer));
+  fprintf(out, "%s%s%s (last %u events):\n", peer, reason ? ": " : "",
+          reason ? reason : "", MIN(conn->flight.next, FLIGHT_EVENTS));
+  flight_dump(&conn->flight, out, current_time_us());
+}
+
+void conn_flight_dump(conn_t *conn, const char *reason) {
+  char *buf = NULL;
+  size_t len;
+  FILE *out = open_memstream(&buf, &len);
+
+  /* Written all at once, so dumps from different threads don't mix. */
+  fprintf(out, "[FLIGHT] ");
+  flight_write(conn, out, reason);
+  fclose(out);
+  fwrite(buf, 1, len, stderr);
+  free(buf);
+  conn->flight_dumped = conn->flight.next;
+}
+
+/**
+ * Adds a time to one of a connection's histograms, and to the shard's.
+ *
+ * conn: The connection object.
+ * timing: The histogram to add to.
+ * usec: The time, in microseconds.
+ */
+void conn_timing_add(conn_t *conn, int timing, uint64_t usec) {
+  if (conn->timings[timing] == NULL)
+    conn->timings[timing] = calloc(1, sizeof(histogram_t));
+  hist_record(conn->timings[timing], usec);
+  hist_record(&shard->timings[timing], usec);
+}
+
+void conn_time(conn_t *conn, conn_timing_t timing, uint64_t usec) {
+  conn_timing_add(conn, timing, usec);
+
+  /* Dump the events that led up to a slow round trip, unless they have
+     already been, in part. */
+  if (timing == CONN_RTT && flight_threshold > 0 &&
+      usec > (uint64_t) flight_threshold * 1000 &&
+      (conn->flight_dumped == 0 ||
+       conn->flight.next - conn->flight_dumped >= FLIGHT_EVENTS))
+    conn_flight_dump(conn, "slow round trip");
 }
 
 /**
@@ -606,64 +1110,258 @@ void conn_add(conn_t *conn) {
  * returns: The number of bytes that can be written out.
  */
 size_t conn_bufspace(conn_t *conn) {
-  chunk_t *chunk;
-  size_t used = 0;
+  if (conn->splice)
+    conn_reclaim(conn);
+  return conn->out_queue.size - conn->out_queue.used;
+}
+
+/**
+ * Describes the queued bytes as at most two buffers: from the head to the end
+ * of the ring, and the part that wrapped around to the start.
+ *
+ * queue: The output queue.
+ * skip: Number of bytes at the front of the queue to leave out.
+ * iov: Filled in with the buffers. Must have room for two.
+ * returns: The number of buffers filled in.
+ */
+int out_queue_iov(out_queue_t *queue, size_t skip, struct iovec *iov) {
+  size_t start = (queue->head + skip) % queue->size;
+  size_t len = queue->used - skip;
+  size_t first = queue->size - start;
+  if (first > len)
+    first = len;
+
+  iov[0].iov_base = queue->buf + start;
+  iov[0].iov_len = first;
+  if (first == len)
+    return 1;
+  iov[1].iov_base = queue->buf;
+  iov[1].iov_len = len - first;
+  return 2;
+}
+
+/**
+ * Adds bytes to the end of an output queue. There must be room for them
+ * (see conn_bufspace()).
+ *
+ * queue: The output queue.
+ * buf: The bytes to add.
+ * len: Number of bytes.
+ */
+void out_queue_push(out_queue_t *queue, const char *buf, size_t len) {
+  if (queue->buf == NULL)
+    queue->buf = malloc(queue->size);
+
+  size_t tail = (queue->head + queue->used) % queue->size;
+  size_t first = queue->size - tail < len ? queue->size - tail : len;
+  memcpy(queue->buf + tail, buf, first);
+  memcpy(queue->buf, buf + first, len - first);
+  queue->used += len;
+
+  /* Remember when the bytes were queued. */
+  unsigned int stamp = queue->stamp_tail % OUT_QUEUE_STAMPS;
+  if (queue->stamp_tail - queue->stamp_head < OUT_QUEUE_STAMPS) {
+    queue->stamps[stamp].time = current_time_us();
+    queue->stamp_tail++;
+  }
+  else {
+    stamp = (queue->stamp_tail - 1) % OUT_QUEUE_STAMPS;
+  }
+  queue->pushed += len;
+  queue->stamps[stamp].end = queue->pushed;
+}
+
+/**
+ * Records that bytes at the front of a connection's output queue have been
+ * written out (or spliced into the program's pipe), timing how long each
+ * write to the queue waited.
+ *
+ * conn: The connection object.
+ * len: Number of bytes written out.
+ */
+void out_queue_written(conn_t *conn, size_t len) {
+  out_queue_t *queue = &conn->out_queue;
+  uint64_t now = current_time_us();
+
+  queue->written += len;
+  while (queue->stamp_head != queue->stamp_tail) {
+    unsigned int stamp = queue->stamp_head % OUT_QUEUE_STAMPS;
+    if (queue->stamps[stamp].end > queue->written)
+      break;
+    conn_timing_add(conn, TIMING_OUTPUT_QUEUE,
+                    now - queue->stamps[stamp].time);
+    queue->stamp_head++;
+  }
+}
+
+/**
+ * Removes bytes that have been written out from the front of an output
+ * queue.
+ *
+ * queue: The output queue.
+ * len: Number of bytes written out.
+ */
+void out_queue_pop(out_queue_t *queue, size_t len) {
+  queue->head = (queue->head + len) % queue->size;
+  queue->used -= len;
+
+  /* Start from the beginning again when empty, so more can be written out in
+     one go. */
+  if (queue->used == 0)
+    queue->head = 0;
+}
+
+/**
+ * [io_uring only]
+ * Called when a write from the output queue completes. Starts writing what
+ * is left, if there is anything.
+ *
+ * arg: The connection object.
+ * result: Number of bytes written, or a negative errno value.
+ */
+void conn_write_done(void *arg, int result) {
+  conn_t *conn = arg;
+  conn->write_op = NULL;
+
+  if (result < 0) {
+    /* Full. Try again once there is room (see on_stdout() and
+       on_program_input()). */
+    if (result == -EAGAIN) {
+      if (!run_program)
+        ev_modify(shard->loop, &shard->stdout_handler, EV_WRITE);
+      return;
+    }
+
+    if (run_program)
+      fprintf(stderr, "[INFO] Program exited\n");
+    conn->wrote_err = true;
+    return;
+  }
+
+  out_queue_pop(&conn->out_queue, result);
+  out_queue_written(conn, result);
+  conn_drain(conn);
+
+  /* Error in outputting if already wrote EOF but still stuff in the output
+     queue. */
+  if (conn->wrote_eof && !conn->wrote_err && !conn->out_queue.used)
+    conn->wrote_err = true;
+
+  /* Output queue has space. Call student code. */
+  if (result > 0 && !conn->delete_me)
+    ctcp_output(conn->state);
+}
+
+/**
+ * [Server only]
+ * Removes the bytes the program has read from its pipe from the front of the
+ * output queue. To save a system call, this is only checked once the queue
+ * is half full.
+ *
+ * conn: Associated connection object.
+ */
+void conn_reclaim(conn_t *conn) {
+  int unread;
+  if (conn->in_pipe == 0 || conn->out_queue.used <= conn->out_queue.size / 2)
+    return;
+  if (ioctl(conn->stdin, FIONREAD, &unread) < 0 || unread > conn->in_pipe)
+    return;
+  out_queue_pop(&conn->out_queue, conn->in_pipe - unread);
+  conn->in_pipe = unread;
+}
 
-  /* Count up how much output space already used. */
-  for (chunk = conn->out_queue; chunk; chunk = chunk->next) {
-    used += (chunk->size - chunk->used);
+/**
+ * [Server only]
+ * Splices the queued bytes that are not in the program's pipe yet into it
+ * with vmsplice(). The pipe refers to the queue's pages instead of copying
+ * them, so the bytes stay in the queue until the program has read them (see
+ * conn_reclaim()). The queue is as large as the pipe, and each buffer in the
+ * pipe holds at most a page, so once the queue is within a page of full the
+ * pipe is full too, and the program reading from it wakes up the event loop.
+ *
+ * conn: Associated connection object.
+ * returns: true if room was made in the output queue.
+ */
+bool conn_splice(conn_t *conn) {
+  out_queue_t *queue = &conn->out_queue;
+  size_t used = queue->used;
+  struct iovec iov[2];
+  ssize_t w;
+
+  conn_reclaim(conn);
+  if (queue->used > conn->in_pipe) {
+    w = vmsplice(conn->stdin, iov, out_queue_iov(queue, conn->in_pipe, iov),
+                 SPLICE_F_NONBLOCK);
+    if (w >= 0) {
+      conn->in_pipe += w;
+      out_queue_written(conn, w);
+    }
+    else if (errno != EAGAIN) {
+      fprintf(stderr, "[INFO] Program exited\n");
+      conn->wrote_err = true;
+    }
   }
-  return used > MAX_BUF_SPACE ? 0 : MAX_BUF_SPACE - used;
+  return queue->used < used;
 }
 
 /**
- * Drain the output queue.
+ * Drain the output queue. Everything queued is written out with a single
+ * writev(), even if it wraps around the end of the ring. With io_uring, this
+ * starts writing out the queue if it is not already being written, and
+ * conn_write_done() continues from there. Output to a program whose pipe
+ * could be enlarged is spliced instead (see conn_splice()).
  *
  * conn: Associated connection object.
  */
 void conn_drain(conn_t *conn) {
-  chunk_t *chunk;
-  int w;
+  out_queue_t *queue = &conn->out_queue;
+  int fd = run_program ? conn->stdin : STDOUT_FILENO;
+  struct iovec iov[2];
+  int iovcnt;
+  ssize_t w;
   bool outputted = false;
-  events[STDOUT_FILENO].events &= ~POLLOUT;
 
-  /* Already wrote an error, can't write anymore. */
-  if (conn->wrote_err)
-    return;
+  /* Already wrote an error, or nothing to write. */
+  if (conn->wrote_err || !queue->used)
+    goto check_eof;
 
-  /* Drain the output queue. Output as many chunks as possible. */
-  while ((chunk = conn->out_queue)) {
-    if (run_program)
-      w = write(conn->stdin, chunk->buf + chunk->used,
-                chunk->size - chunk->used);
-    else
-      w = write(STDOUT_FILENO, chunk->buf + chunk->used,
-                chunk->size - chunk->used);
+  if (conn->splice) {
+    outputted = conn_splice(conn);
+    goto check_eof;
+  }
 
-    if (w < 0) {
-      if (errno != EAGAIN)
-        conn->wrote_err = true;
-      break;
+  iovcnt = out_queue_iov(queue, 0, iov);
+  if (ev_async_writes(shard->loop)) {
+    if (!conn->write_op)
+      conn->write_op = ev_writev(shard->loop, fd, iov, iovcnt,
+                                 conn_write_done, conn);
+    return;
+  }
+
+  w = writev(fd, iov, iovcnt);
+  if (w < 0) {
+    if (errno != EAGAIN) {
+      if (run_program)
+        fprintf(stderr, "[INFO] Program exited\n");
+      conn->wrote_err = true;
     }
+  }
+  else {
     outputted = true;
-    chunk->used += w;
+    out_queue_pop(queue, w);
+    out_queue_written(conn, w);
+  }
 
-    /* Could not complete one chunk. Stop after this. */
-    if (chunk->used < chunk->size) {
-      events[STDOUT_FILENO].events |= POLLOUT;
-      break;
-    }
-    conn->out_queue = chunk->next;
+  /* If there is stuff left in the queue, wait until STDOUT can take more. A
+     program's STDIN is always watched, so nothing needs to be done for it. */
+  if (queue->used && !conn->wrote_err && !run_program)
+    ev_modify(shard->loop, &shard->stdout_handler, EV_WRITE);
 
-    /* Update pointers. */
-    if (!conn->out_queue)
-      conn->out_queue_tail = &conn->out_queue;
-    free(chunk);
-  }
+check_eof:
 
   /* Error in outputting if already wrote EOF but still stuff in the output
      queue. */
-  if (conn->wrote_eof && !conn->wrote_err && !conn->out_queue)
+  if (conn->wrote_eof && !conn->wrote_err && !queue->used)
     conn->wrote_err = true;
 
   /* Output queue has space. Call student code. */
@@ -677,34 +1375,64 @@ void conn_drain(conn_t *conn) {
  * conn: The conn_t to free.
  */
 void conn_free(conn_t *conn) {
-  /* Free up chunks. */
-  chunk_t *chunk, *next_chunk;
-  for (chunk = conn->out_queue; chunk; chunk = next_chunk) {
-    next_chunk = chunk->next;
-    free(chunk);
+  /* Record how far the connection got, for --resume. */
+  write_checkpoint(conn);
+
+  /* Free up the output queue. A write still in progress owns it, and it is
+     freed when the write completes. */
+  if (conn->splice)
+    munmap(conn->out_queue.buf, conn->out_queue.size);
+  else if (conn->write_op)
+    ev_cancel(shard->loop, conn->write_op, conn->out_queue.buf);
+  else
+    free(conn->out_queue.buf);
+
+  int i;
+  for (i = 0; i < NUM_TIMINGS; i++)
+    free(conn->timings[i]);
+
+  /* Take it off the flush list. */
+  if (conn->flush_pending) {
+    conn_t **c = &shard->flush_list;
+    while (*c != conn)
+      c = &(*c)->next_flush;
+    *c = conn->next_flush;
   }
 
-  /* Adjust pointers. */
+  /* Adjust pointers and make the slot available to new connections. */
   if (conn->next)
     conn->next->prev = conn->prev;
   if (conn->prev)
     *conn->prev = conn->next;
-
-  if (conn == get_connections()) {
-    if (SERVER)
-      config->connections = NULL;
-    else
-      config->sconn = NULL;
-  }
+  ct_remove(shard->conn_table, conn->slot);
+  __atomic_sub_fetch(&num_clients, 1, __ATOMIC_RELAXED);
 
   /* Close pipes to program, if it's running. */
   if (run_program) {
+    ev_remove(shard->loop, &conn->stdin_handler);
+    ev_remove(shard->loop, &conn->stdout_handler);
     close(conn->stdin);
     close(conn->stdout);
   }
   free(conn);
 }
 
+/**
+ * Copies input from the --send-file mapping, which only holds this process's
+ * stripe with --stripes, and what the server does not have yet with
+ * --resume.
+ *
+ * buf: Buffer to copy into.
+ * len: Maximum number of bytes to copy.
+ * returns: The number of bytes copied, 0 at the end of the input.
+ */
+int read_send_map(void *buf, size_t len) {
+  len = MIN(len, send_map_len - send_map_pos);
+  memcpy(buf, send_map + send_map_pos, len);
+  send_map_pos += len;
+  return len;
+}
+
 /**
  * Reads input that then needs to be put into segments to send off. Reads up to
  * to len bytes.
@@ -731,7 +1459,9 @@ int conn_input(conn_t *conn, void *buf, size_t len) { ASSERT_CONN;
   }
 
   /* Read from the appropriate place (STOUT of the associated program). */
-  if (run_program)
+  if (send_map != NULL)
+    r = read_send_map(buf, len);
+  else if (run_program)
     r = read(conn->stdout, buf, len);
   else if (unix_socket)
     r = read(STDIN_FILENO, buf, len);
@@ -746,27 +1476,168 @@ int conn_input(conn_t *conn, void *buf, size_t len) { ASSERT_CONN;
     }
   }
 
-  /* Received EOF. In tester mode, we let the EOF character represent an EOF. */
-  if (r == 0 || (r < 0 && errno != EAGAIN) ||
-      ((test_debug_on || lab5_mode) && r > 0 && ((char *) buf)[0] == 0x1a)) {
-    conn->read_eof = true;
+  return input_result(conn, r, buf);
+}
+
+/**
+ * Reads input into several buffers with a single readv(), filling each one
+ * before moving on to the next. See conn_input().
+ *
+ * conn: The connection object.
+ * iov: Buffers to read into.
+ * iovcnt: Number of buffers.
+ * returns: -1 if error or EOF, otherwise the actual number of bytes read. If
+ *          no data is available, returns 0.
+ */
+int conn_inputv(conn_t *conn, const struct iovec *iov, int iovcnt) {
+  ASSERT_CONN;
+  int r;
+
+  /* Check parameters. */
+  if (conn == NULL || iov == NULL || iovcnt < 1) {
+    fprintf(stderr, "[ERROR] NULL parameters in conn_inputv\n");
     return -1;
   }
-  /* No input. */
-  else if (r < 0 && errno == EAGAIN) {
-    r = 0;
+
+  /* Already read EOF. */
+  if (conn->read_eof) {
+    return -1;
   }
 
-  return r;
+  /* Network line endings are added one read at a time. */
+  if (send_map != NULL || (!run_program && !unix_socket))
+    return conn_input(conn, iov[0].iov_base, iov[0].iov_len);
+
+  r = readv(run_program ? conn->stdout : STDIN_FILENO, iov, iovcnt);
+  return input_result(conn, r, iov[0].iov_base);
 }
 
 /**
- * Schedules a connection object for removal.
+ * Returns the whole input if it was memory-mapped with --send-file.
  *
- * conn: The conn_t to remove.
+ * conn: The connection object.
+ * len: Set to the length of the input.
+ * returns: The input, or NULL if it is not memory-mapped.
  */
-void conn_remove(conn_t *conn) {
+const char *conn_input_map(conn_t *conn, size_t *len) { ASSERT_CONN;
+  /* Check parameters. */
+  if (conn == NULL || len == NULL) {
+    fprintf(stderr, "[ERROR] NULL parameters in conn_input_map\n");
+    return NULL;
+  }
+
+  if (send_map == NULL || conn != config->sconn)
+    return NULL;
+  *len = send_map_len;
+  return send_map;
+}
+
+/**
+ * Returns true if input is shared by every client (--broadcast).
+ *
+ * conn: The connection object.
+ */
+bool conn_input_broadcast(conn_t *conn) { ASSERT_CONN;
+  return broadcast;
+}
+
+/**
+ * Takes up to len bytes of the --broadcast buffer that the connection has not
+ * taken yet, with a reference to the buffer for the caller.
+ *
+ * conn: The connection object.
+ * len: Maximum number of bytes to take.
+ * buf: Set to the buffer holding the data.
+ * data: Set to the data.
+ * returns: -1 if error or EOF, otherwise the number of bytes taken. If the
+ *          connection has taken everything read so far, returns 0.
+ */
+int conn_input_shared(conn_t *conn, size_t len, shared_buf_t **buf,
+                      const char **data) { ASSERT_CONN;
+  /* Check parameters. */
+  if (conn == NULL || buf == NULL || data == NULL || !broadcast) {
+    fprintf(stderr, "[ERROR] Invalid parameters in conn_input_shared\n");
+    return -1;
+  }
+
+  if (conn->read_eof)
+    return -1;
+
+  /* Caught up. Read more once everyone else is too (see broadcast_read()). */
+  if (bcast_buf == NULL || conn->bcast_pos == bcast_buf->len) {
+    if (bcast_eof) {
+      conn->read_eof = true;
+      return -1;
+    }
+    bcast_wanted = true;
+    return 0;
+  }
+
+  len = MIN(len, bcast_buf->len - conn->bcast_pos);
+  shared_buf_ref(bcast_buf);
+  *buf = bcast_buf;
+  *data = bcast_buf->data + conn->bcast_pos;
+  conn->bcast_pos += len;
+  return len;
+}
+
+/**
+ * Returns the handler watching a connection's input: its program's STDOUT,
+ * or STDIN.
+ *
+ * conn: The connection object.
+ */
+ev_handler_t *input_handler(conn_t *conn) {
+  return run_program ? &conn->stdout_handler : &stdin_handler;
+}
+
+/**
+ * Interprets the result of reading input for a connection. Records EOF, and
+ * notes when the input has run dry, which starts watching it again if it was
+ * paused (see conn_read()).
+ *
+ * conn: The connection object.
+ * r: Result of read() or readv().
+ * buf: The (first) buffer that was read into.
+ * returns: What conn_input() returns.
+ */
+int input_result(conn_t *conn, int r, const char *buf) {
+  /* Received EOF. In tester mode, we let the EOF character represent an EOF. */
+  if (r == 0 || (r < 0 && errno != EAGAIN) ||
+      ((test_debug_on || lab5_mode) && r > 0 && buf[0] == 0x1a)) {
+    conn->read_eof = true;
+    return -1;
+  }
+  /* No input. */
+  else if (r < 0 && errno == EAGAIN) {
+    conn->input_drained = true;
+    if (conn->input_paused) {
+      conn->input_paused = false;
+      ev_modify(shard->loop, input_handler(conn), EV_READ);
+    }
+    r = 0;
+  }
+
+  return r;
+}
+
+/**
+ * Schedules a connection object for removal.
+ *
+ * conn: The conn_t to remove.
+ */
+void conn_remove(conn_t *conn) {
+  if (conn->delete_me)
+    return;
   conn->delete_me = true;
+  conn->next_delete = shard->delete_list;
+  shard->delete_list = conn;
+  metrics_add(&shard->metrics, METRIC_CONNECTIONS_CLOSED, 1);
+  CTCP_TRACE(conn_destroy, conn, metrics_get(&conn->metrics, METRIC_BYTES_SENT),
+             metrics_get(&conn->metrics, METRIC_BYTES_RECEIVED));
+
+  /* It may have been the client the others were waiting for. */
+  bcast_wanted = broadcast;
 
   /* Log to tester that this connection has been removed (as a result to a call
      to ctcp_destroy). */
@@ -792,10 +1663,78 @@ int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len) { ASSERT_CONN;
     fprintf(stderr, "[ERROR] NULL parameters in conn_send\n");
     return -1;
   }
+  if (len < sizeof(ctcp_segment_t)) {
+    fprintf(stderr, "[ERROR] Segment too short in conn_send\n");
+    return -1;
+  }
+
+  return conn_sendv(conn, segment, segment->data, len - sizeof(ctcp_segment_t));
+}
+
+/**
+ * Copies a segment's header and data into one contiguous segment, which must
+ * be freed.
+ *
+ * header: The segment's header.
+ * data: The segment's data.
+ * data_len: Length of the data.
+ * returns: The new segment.
+ */
+ctcp_segment_t *join_segment(const ctcp_segment_t *header, const void *data,
+                             size_t data_len) {
+  ctcp_segment_t *segment = malloc(sizeof(ctcp_segment_t) + data_len);
+  memcpy(segment, header, sizeof(ctcp_segment_t));
+  if (data_len > 0)
+    memcpy(segment->data, data, data_len);
+  return segment;
+}
 
-  /* Make a copy of the segment first. */
-  ctcp_segment_t *segment_copy = calloc(len, 1);
-  memcpy(segment_copy, segment, len);
+/**
+ * Sends a cTCP segment whose data is stored apart from its header. The data
+ * is only copied once, into the packet, unless the segment is corrupted or
+ * logged, which needs the whole segment in one place.
+ *
+ * conn: Connection object.
+ * segment: cTCP header of the segment.
+ * data: The segment's data.
+ * data_len: Length of the data.
+ *
+ * returns: The number of bytes actually sent, 0 if nothing was sent, -1 if
+ *          there in an error.
+ */
+int conn_sendv(conn_t *conn, ctcp_segment_t *segment, const void *data,
+               size_t data_len) { ASSERT_CONN;
+  /* Check parameters. */
+  if (conn == NULL || segment == NULL || (data == NULL && data_len > 0)) {
+    fprintf(stderr, "[ERROR] NULL parameters in conn_sendv\n");
+    return -1;
+  }
+  size_t len = sizeof(ctcp_segment_t) + data_len;
+
+  /* Work on a copy of the header, so the caller's is left alone. A copy of
+     the whole segment is only made when it is needed. */
+  ctcp_segment_t header = *segment;
+  ctcp_segment_t *segment_copy = NULL;
+
+  /* Data is only acked once it has been output, so with --resume, the ack
+     number tells how much of the file is complete. The FIN takes up a
+     sequence number too. */
+  if (resume_fd >= 0 && (header.flags & TH_ACK) && ntohl(header.ackno) > 1)
+    conn->delivered = ntohl(header.ackno) - 1 - (conn->wrote_eof ? 1 : 0);
+
+  /* Count the segment as sent even if it is then dropped on purpose, like the
+     network would. */
+  conn_metric_add(conn, METRIC_SEGMENTS_SENT, 1);
+  conn_metric_add(conn, METRIC_BYTES_SENT, data_len);
+  if (data_len > 0 &&
+      (int32_t) (ntohl(header.seqno) + data_len - conn->highest_seqno_sent) > 0)
+    conn->highest_seqno_sent = ntohl(header.seqno) + data_len;
+  uint64_t now = current_time_us();
+  conn->last_active = now / 1000;
+  flight_record(&conn->flight, FLIGHT_SEND, now, ntohl(header.seqno),
+                ntohl(header.ackno), data_len, header.flags);
+  CTCP_TRACE(conn_send, conn, ntohl(header.seqno), ntohl(header.ackno),
+             data_len, header.flags);
 
   /* Fork process off in order to do unreliability. Keep track of whether we
      are forked or not. */
@@ -809,9 +1748,8 @@ int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len) { ASSERT_CONN;
 
     if (DEBUG) {
       fprintf(stderr, "[DEBUG] Dropping segment\n");
-      print_hdr_ctcp(segment_copy);
+      print_hdr_ctcp(&header);
     }
-    free(segment_copy);
     return len;
   }
 
@@ -822,10 +1760,11 @@ int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len) { ASSERT_CONN;
 
     if (DEBUG) {
       fprintf(stderr, "[DEBUG] Duplicating segment\n");
-      print_hdr_ctcp(segment_copy);
+      print_hdr_ctcp(&header);
     }
     if (fork() == 0) {
       am_i_forked = 1;
+      forked = true;
       fork_level++;
     }
   }
@@ -838,17 +1777,17 @@ int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len) { ASSERT_CONN;
 
     if (DEBUG) {
       fprintf(stderr, "[DEBUG] Delaying segment\n");
-      print_hdr_ctcp(segment_copy);
+      print_hdr_ctcp(&header);
     }
     /* Forked process. Sleep for a bit. */
     if (fork() == 0) {
       am_i_forked = 1;
+      forked = true;
       fork_level++;
       sleep(rand() % 5);
     }
     /* Original process. */
     else {
-      free(segment_copy);
       return len;
     }
   }
@@ -866,25 +1805,32 @@ int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len) { ASSERT_CONN;
 
     if (DEBUG) {
       fprintf(stderr, "[DEBUG] Corrupting segment\n");
-      print_hdr_ctcp(segment_copy);
+      print_hdr_ctcp(&header);
     }
+    segment_copy = join_segment(&header, data, data_len);
     flipbit(segment_copy, rand_bit);
+    header = *segment_copy;
+    data = segment_copy->data;
   }
 
-  uint16_t data_len = len - sizeof(ctcp_segment_t);
   uint16_t total_len = FULL_HDR_SIZE + data_len;
 
+  /* A forked process has no writer thread to hand the segment to. */
   if (log_file != -1 || test_debug_on) {
-    log_segment(log_file, config->ip_addr, config->port, conn, segment_copy,
-                len, true, unix_socket);
+    log_segment(log_file, forked ? NULL : shard->log_ring, config->ip_addr,
+                config->port, conn, &header, data, true, unix_socket);
   }
 
   /* Convert from a cTCP segment to a real one and finally send the segment. */
-  char *pkt = convert_to_datagram(conn, segment_copy, len);
-  int n = send_pkt(conn, config->socket, pkt, total_len, 0);
+  char *pkt = convert_to_datagram(conn, &header, data, len);
+  if (pcap_file != -1) {
+    capture_packet(pcap_file, forked ? NULL : shard->pcap_ring, snaplen, pkt,
+                   total_len);
+  }
+  int n = send_pkt(conn, config->socket, pkt, total_len, true);
   if (DEBUG) {
     fprintf(stderr, "[DEBUG] Sent segment\n");
-    print_hdr_ctcp(segment_copy);
+    print_hdr_ctcp(&header);
   }
   free(pkt);
   free(segment_copy);
@@ -902,12 +1848,13 @@ int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len) { ASSERT_CONN;
 
 /**
  * Writes a buffer to STDOUT or the program associated with this connection.
- * If called with a length of 0, an EOF is recorded.
+ * If called with a length of 0, an EOF is recorded. Whatever can't be written
+ * right away is queued, as long as there is room (see conn_bufspace()).
  *
  * conn: The associated connection object.
  * buf: The buffer to output.
  * len: Number of bytes to write out.
- * returns: -1 if error, otherwise the number of bytes written out.
+ * returns: -1 if error, otherwise the number of bytes written out or queued.
  */
 int conn_output(conn_t *conn, const char *buf, size_t len) { ASSERT_CONN;
   /* If already wrote EOF, can't write more. */
@@ -926,21 +1873,55 @@ int conn_output(conn_t *conn, const char *buf, size_t len) { ASSERT_CONN;
     return -1;
   }
 
-  int left = len;
-  int w = 0;
+  /* Put as much in the output queue as there is room for. */
+  size_t queued = len;
+  if (queued > conn_bufspace(conn))
+    queued = conn_bufspace(conn);
+  if (queued == 0)
+    return 0;
+  out_queue_push(&conn->out_queue, buf, queued);
+
+  /* Write it out once the current batch of events has been handled, so
+     everything output in the meantime goes out in one writev(). */
+  conn_flush_later(conn);
+  return queued;
+}
+
+/**
+ * Outputs several buffers in order. When the output can be written right
+ * away, one writev() takes whatever is still queued followed by the buffers
+ * themselves, and only what it does not take is copied into the output
+ * queue. Otherwise (splicing, io_uring) the buffers are queued as with
+ * conn_output().
+ *
+ * conn: The connection object.
+ * iov: The buffers to output.
+ * iovcnt: Number of buffers.
+ * returns: -1 if error, otherwise the number of bytes written out or queued.
+ */
+int conn_outputv(conn_t *conn, const struct iovec *iov, int iovcnt) {
+  ASSERT_CONN;
+  out_queue_t *queue = &conn->out_queue;
+  int fd = run_program ? conn->stdin : STDOUT_FILENO;
+  size_t written = 0;
+  size_t queued = 0;
+  size_t skip, len;
+  int i;
 
-  /* See if there is actually room to output. */
-  if (!conn_bufspace(conn))
+  if (conn->wrote_eof)
     return 0;
+  if (conn->wrote_err) {
+    fprintf(stderr, "[ERROR] Attempting to write after error\n");
+    return -1;
+  }
 
-  /* Nothing in the output queue. Output immediately to the appropriate
-     interface. */
-  if (!conn->out_queue) {
-    if (run_program)
-      w = write(conn->stdin, buf, len);
-    else
-      w = write(STDOUT_FILENO, buf, len);
+  if (!conn->splice && !ev_async_writes(shard->loop) &&
+      iovcnt <= IOV_MAX - 2) {
+    struct iovec all[iovcnt + 2];
+    int n = queue->used ? out_queue_iov(queue, 0, all) : 0;
+    memcpy(all + n, iov, iovcnt * sizeof(struct iovec));
 
+    ssize_t w = writev(fd, all, n + iovcnt);
     if (w < 0) {
       if (errno != EAGAIN) {
         if (run_program)
@@ -948,37 +1929,158 @@ int conn_output(conn_t *conn, const char *buf, size_t len) { ASSERT_CONN;
         conn->wrote_err = true;
         return -1;
       }
+      w = 0;
     }
-    /* Write as much as possible. Keep track of how much was written. */
-    else {
-      buf += w;
-      left -= w;
+
+    /* The queue went out first. */
+    len = (size_t) w < queue->used ? (size_t) w : queue->used;
+    if (len) {
+      out_queue_pop(queue, len);
+      out_queue_written(conn, len);
+    }
+    written = w - len;
+    queue->pushed += written;
+    queue->written += written;
+  }
+
+  /* Queue what was not written, as far as there is room. */
+  skip = written;
+  for (i = 0; i < iovcnt; i++) {
+    if (skip >= iov[i].iov_len) {
+      skip -= iov[i].iov_len;
+      continue;
     }
+    len = iov[i].iov_len - skip;
+    if (len > conn_bufspace(conn))
+      len = conn_bufspace(conn);
+    if (len == 0)
+      break;
+    out_queue_push(queue, (const char *) iov[i].iov_base + skip, len);
+    queued += len;
+    skip = 0;
   }
 
-  /* Put the rest in an output queue. */
-  if (left > 0) {
-    chunk_t *chunk = calloc(offsetof(chunk_t, buf[left]), 1);
-    chunk->next = NULL;
-    chunk->size = left;
-    chunk->used = 0;
-    memcpy(chunk->buf, buf, left);
+  if (queue->used)
+    conn_flush_later(conn);
+  return written + queued;
+}
+
+/**
+ * Has ctcp_output() called once the current batch of events has been
+ * handled, so everything that arrived in the batch is output together.
+ *
+ * conn: The connection object.
+ */
+void conn_output_later(conn_t *conn) { ASSERT_CONN;
+  conn->output_later = true;
+  conn_flush_later(conn);
+}
 
-    /* Update pointers. */
-    *conn->out_queue_tail = chunk;
-    conn->out_queue_tail = &chunk->next;
+/**
+ * Puts a connection on the shard's flush list, so its output queue is
+ * written out once the current batch of events has been handled (see
+ * flush_output()).
+ *
+ * conn: The connection object.
+ */
+void conn_flush_later(conn_t *conn) {
+  if (!conn->flush_pending) {
+    conn->flush_pending = true;
+    conn->next_flush = shard->flush_list;
+    shard->flush_list = conn;
   }
+}
 
-  /* If there is stuff in the queue, create an event. */
-  if (conn->out_queue) {
-    if (run_program)
-      events[conn->stdin].events |= POLLOUT;
-    else
-      events[STDOUT_FILENO].events |= POLLOUT;
+/**
+ * Returns whether a connection's output can be written at any offset with
+ * conn_output_at().
+ *
+ * conn: The associated connection object.
+ */
+bool conn_output_direct(conn_t *conn) { ASSERT_CONN;
+  return recv_file != NULL;
+}
+
+/**
+ * Writes data straight to its place in the file given with --recv-file.
+ *
+ * conn: The associated connection object.
+ * offset: Offset of the data from the start of the connection's output.
+ * buf: The data.
+ * len: Number of bytes to write.
+ * returns: -1 if error, otherwise len.
+ */
+int conn_output_at(conn_t *conn, uint32_t offset, const char *buf,
+                   size_t len) { ASSERT_CONN;
+  /* Check parameters. */
+  if (conn == NULL || (buf == NULL && len > 0)) {
+    fprintf(stderr, "[ERROR] NULL parameters in conn_output_at\n");
+    return -1;
+  }
+  if (recv_file == NULL || conn->wrote_eof || conn->wrote_err) {
+    fprintf(stderr, "[ERROR] Cannot write output at an offset\n");
+    return -1;
+  }
+
+  size_t written = 0;
+  while (written < len) {
+    ssize_t r = pwrite(STDOUT_FILENO, buf + written, len - written,
+                       conn->recv_base + offset + written);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0) {
+      perror("[ERROR] pwrite");
+      conn->wrote_err = true;
+      return -1;
+    }
+    written += r;
   }
   return len;
 }
 
+/**
+ * [Server only]
+ * Records how much of the --recv-file file is complete, for --resume. The
+ * file's data is flushed to disk first, so the checkpoint never gets ahead of
+ * it. Does nothing if nothing changed since the last checkpoint.
+ *
+ * conn: The connection writing to the file.
+ */
+void write_checkpoint(conn_t *conn) {
+  off_t offset = conn->recv_base + conn->delivered;
+  char buf[32];
+  int len;
+
+  if (resume_fd < 0 || conn->striped || offset == resume_offset)
+    return;
+
+  fdatasync(STDOUT_FILENO);
+  len = snprintf(buf, sizeof(buf), "%020lld\n", (long long) offset);
+  if (pwrite(resume_fd, buf, len, 0) != len)
+    perror("[ERROR] Could not write checkpoint");
+  resume_offset = offset;
+  last_checkpoint = current_time();
+}
+
+/**
+ * Writes out the output queues of connections that were given output since
+ * the last call, first calling ctcp_output() for those that asked for it
+ * (see conn_output_later()). Draining lets the student code output more (see
+ * ctcp_output()), so this keeps going until nothing new is queued.
+ */
+void flush_output() {
+  conn_t *conn;
+  while ((conn = shard->flush_list) != NULL) {
+    shard->flush_list = conn->next_flush;
+    conn->flush_pending = false;
+    if (conn->output_later && !conn->delete_me) {
+      conn->output_later = false;
+      ctcp_output(conn->state);
+    }
+    conn_drain(conn);
+  }
+}
+
 /**
  * [Client-only]
  * TCP handshake with server. This includes the SYN, SYN-ACK, and ACK segments.
@@ -987,21 +2089,28 @@ int conn_output(conn_t *conn, const char *buf, size_t len) { ASSERT_CONN;
  *          object must be freed.
  */
 conn_t *tcp_handshake(void) { ASSERT_CLIENT_ONLY;
-  char buf[MAX_PACKET_SIZE];
+  char buf[max_packet_size];
 
   /* Send a SYN segment to the server. */
   if (send_syn(config->sconn))
     exit(EXIT_FAILURE);
 
-  /* Wait to receive SYN-ACK. */
-  int r = recv_filter(config->socket, buf, MAX_PACKET_SIZE, 0, NULL);
+  /* Wait to receive SYN-ACK. When resuming, it is always a new connection,
+     so segments the server is still sending to an earlier client on this
+     port are skipped. */
+  tcphdr_t *synack = (tcphdr_t *) (buf + IP_HDR_SIZE);
+  int r;
+  do {
+    r = recv_filter(config->socket, buf, max_packet_size, 0, NULL);
+  } while (resume && r > 0 && (synack->th_flags & TH_SYN) == 0);
   if (r <= 0)
     return NULL;
 
-  tcphdr_t *synack = (tcphdr_t *) (buf + IP_HDR_SIZE);
-
-  /* Set window size for the other host. */
-  ctcp_cfg->send_window = ntohs(synack->window);
+  /* Set window size for the other host, and agree on the MSS. */
+  if (synack->th_flags & TH_SYN)
+    read_syn_options(buf, r, ctcp_cfg);
+  else
+    ctcp_cfg->send_window = ntohs(synack->window);
 
   /* If an ACK is received instead of a SYN-ACK, continue previous
      connection. Get sequence numbers from previous connection. */
@@ -1019,6 +2128,46 @@ conn_t *tcp_handshake(void) { ASSERT_CLIENT_ONLY;
     config->sconn->their_init_seqno = ntohl(synack->th_seq);
     config->sconn->ackno = ntohl(synack->th_seq) + 1;
     send_ack(config->sconn);
+
+    /* A stripe must go where it belongs, or not at all. */
+    const uint8_t *opt = find_exp_option(buf, r, TCP_OPT_STRIPE_EXID);
+    if (striped && (opt == NULL || opt[1] < TCP_OPT_STRIPE_LEN ||
+                    exp_option_value(opt) != (uint64_t) stripe_offset)) {
+      fprintf(stderr, "[ERROR] Server cannot receive stripes (start it with "
+              "--recv-file)\n");
+      return NULL;
+    }
+
+    /* Skip what the server already has. */
+    opt = resume ? find_exp_option(buf, r, TCP_OPT_RESUME_EXID) : NULL;
+    if (opt != NULL && opt[1] >= TCP_OPT_RESUME_SYNACK_LEN) {
+      uint64_t offset = exp_option_value(opt);
+      if (offset > send_map_len) {
+        fprintf(stderr, "[ERROR] Server already has %llu bytes, more than "
+                "%s\n", (unsigned long long) offset, send_file);
+        return NULL;
+      }
+      send_map += offset;
+      send_map_len -= offset;
+      fprintf(stderr, "[INFO] Resuming at byte %llu\n",
+              (unsigned long long) offset);
+    }
+    else if (resume) {
+      fprintf(stderr, "[INFO] Server cannot resume, sending all of %s\n",
+              send_file);
+    }
+
+    /* A connection carries at most MAX_STREAM_LEN bytes. The next one sends
+       the rest, starting where the server says this one stopped. */
+    if (send_map_len > MAX_STREAM_LEN) {
+      if (opt == NULL) {
+        fprintf(stderr, "[ERROR] %s is too large for one connection, and the "
+                "server cannot resume\n", send_file);
+        return NULL;
+      }
+      send_map_len = MAX_STREAM_LEN;
+      resume_rest = true;
+    }
   }
 
   return config->sconn;
@@ -1033,31 +2182,42 @@ conn_t *tcp_handshake(void) { ASSERT_CLIENT_ONLY;
  * returns: The conn_t associated with the new connection.
  */
 conn_t *tcp_new_connection(char *pkt) { ASSERT_SERVER_ONLY;
-  /* Ignore if too many clients are connected. */
-  if (num_connected >= MAX_NUM_CLIENTS) {
-    fprintf(stderr, "[ERROR] Maximum number of clients (%d) reached\n",
-            MAX_NUM_CLIENTS);
-    return NULL;
-  }
-  num_connected++;
-
   iphdr_t *ip_hdr = (iphdr_t *) pkt;
   tcphdr_t *syn = (tcphdr_t *) (pkt + IP_HDR_SIZE);
 
-  /* Set up connection details and add to list of connections. */
+  /* Set up connection details and add to list of connections. Ignore if too
+     many clients are connected. */
   conn_t *conn = calloc(sizeof(conn_t), 1);
   conn_setup(conn, ntohl(ip_hdr->saddr), ntohs(syn->th_sport), unix_socket);
+  conn->out_queue.size = buf_space;
+  conn->resume = resume_fd >= 0 &&
+                 find_exp_option(pkt, ntohs(ip_hdr->tot_len),
+                                 TCP_OPT_RESUME_EXID) != NULL;
   conn->their_init_seqno = ntohl(syn->th_seq);
   conn->ackno = conn->their_init_seqno + 1;
-  conn_add(conn);
+  if (conn_add(conn) < 0) {
+    fprintf(stderr, "[ERROR] Maximum number of clients (%u) reached\n",
+            max_clients);
+    free(conn);
+    return NULL;
+  }
+
+  /* A stripe's output goes where the client says it starts in the file. */
+  const uint8_t *opt = find_exp_option(pkt, ntohs(ip_hdr->tot_len),
+                                       TCP_OPT_STRIPE_EXID);
+  if (recv_file != NULL && opt != NULL && opt[1] >= TCP_OPT_STRIPE_LEN) {
+    conn->striped = true;
+    conn->recv_base = exp_option_value(opt);
+  }
 
   /* Send a SYN-ACK to the client. */
   send_synack(conn);
 
-  /* Get window size of the client. */
-  ctcp_cfg->send_window = ntohs(syn->window);
+  /* Get window size and MSS of the client. Shards may be doing this at the
+     same time, so only change the copy. */
   ctcp_config_t *config_copy = calloc(sizeof(ctcp_config_t), 1);
   memcpy(config_copy, ctcp_cfg, sizeof(ctcp_config_t));
+  read_syn_options(pkt, ntohs(ip_hdr->tot_len), config_copy);
 
   /* Student code. */
   ctcp_state_t *state = ctcp_init(conn, config_copy);
@@ -1070,6 +2230,140 @@ conn_t *tcp_new_connection(char *pkt) { ASSERT_SERVER_ONLY;
 
 ///////////////////////////// SETUP AND MAIN LOOP /////////////////////////////
 
+/**
+ * Lets the student code read a connection's input. If it stops before the
+ * input runs dry (its send buffer is full), the input is not watched again
+ * until the student code reads and finds nothing left (see input_result()).
+ * Otherwise a regular file, which is always ready, would keep the event loop
+ * spinning.
+ *
+ * conn: The connection object.
+ * handler: The handler watching the input.
+ */
+void conn_read(conn_t *conn, ev_handler_t *handler) {
+  conn->input_drained = false;
+  ctcp_read(conn->state);
+
+  /* Stop watching once EOF is read. Otherwise a regular file would be
+     reported as ready forever. */
+  if (conn->read_eof)
+    ev_modify(shard->loop, handler, 0);
+  else if (!conn->input_drained && !conn->input_paused) {
+    conn->input_paused = true;
+    ev_modify(shard->loop, handler, 0);
+  }
+}
+
+/**
+ * [Server only]
+ * Reads the next block of input for --broadcast once every client has taken
+ * all of the last one, and lets each client's student code take it. The
+ * buffer the last block was read into is freed once no segment points into
+ * it. STDIN is only watched while there is no input to read, since a regular
+ * file is always ready.
+ */
+void broadcast_read() {
+  conn_t *conn;
+  bool behind, live;
+  int r;
+
+  do {
+    bcast_wanted = false;
+
+    /* Wait for the slowest client. Keep the input if nobody would get it. */
+    behind = live = false;
+    for (conn = shard->connections; conn != NULL; conn = conn->next) {
+      if (conn->delete_me)
+        continue;
+      live = true;
+      behind |= bcast_buf != NULL && conn->bcast_pos < bcast_buf->len;
+    }
+    if (behind || !live || bcast_eof)
+      break;
+
+    shared_buf_t *buf = shared_buf_new(BROADCAST_BLOCK_SIZE);
+    if (buf == NULL)
+      break;
+    r = read(STDIN_FILENO, buf->data, buf->len);
+    if (r < 0 && errno == EAGAIN) {
+      shared_buf_unref(buf);
+      if (!bcast_watching)
+        ev_modify(shard->loop, &stdin_handler, EV_READ);
+      bcast_watching = true;
+      return;
+    }
+
+    /* Segments hold on to the last block for as long as they need it. */
+    shared_buf_unref(bcast_buf);
+    if (r > 0) {
+      buf->len = r;
+      bcast_buf = buf;
+    }
+    else {
+      shared_buf_unref(buf);
+      bcast_buf = NULL;
+      bcast_eof = true;
+    }
+
+    for (conn = shard->connections; conn != NULL; conn = conn->next)
+      conn->bcast_pos = 0;
+    for (conn = shard->connections; conn != NULL; conn = conn->next) {
+      if (!conn->delete_me)
+        ctcp_read(conn->state);
+    }
+  } while (bcast_wanted);
+
+  if (bcast_watching)
+    ev_modify(shard->loop, &stdin_handler, 0);
+  bcast_watching = false;
+}
+
+/**
+ * [Server only]
+ * Called by the event loop when a program has output to send to its client.
+ *
+ * handler: The program's STDOUT handler.
+ * events: The events that occurred.
+ */
+void on_program_output(ev_handler_t *handler, uint32_t events) {
+  conn_t *conn = handler->arg;
+  if (!conn->delete_me)
+    conn_read(conn, handler);
+}
+
+/**
+ * [Server only]
+ * Called by the event loop when a program can take more input.
+ *
+ * handler: The program's STDIN handler.
+ * events: The events that occurred.
+ */
+void on_program_input(ev_handler_t *handler, uint32_t events) {
+  conn_drain(handler->arg);
+}
+
+/**
+ * [Server only]
+ * Enlarges a pipe so it can hold at least size bytes, or as close to that as
+ * the system allows (see /proc/sys/fs/pipe-max-size).
+ *
+ * fd: Either end of the pipe.
+ * size: Number of bytes wanted.
+ * returns: The capacity of the pipe, or 0 if pipes can't be resized.
+ */
+size_t pipe_resize(int fd, size_t size) {
+  int capacity = fcntl(fd, F_GETPIPE_SZ);
+  int r;
+
+  if (capacity < 0)
+    return 0;
+  for (; size > capacity; size /= 2) {
+    if ((r = fcntl(fd, F_SETPIPE_SZ, size)) >= 0)
+      return r;
+  }
+  return capacity;
+}
+
 /**
  * [Server only]
  * Executes a new program upon client connection. When the client sends a
@@ -1097,6 +2391,12 @@ void execute_program(conn_t *conn) { ASSERT_SERVER_ONLY;
     close(PARENT_READ_FD);
     close(PARENT_WRITE_FD);
 
+    /* SIGUSR1 is only blocked for the metrics (see metrics_signal_fd()). */
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+
     execvp(config->program, config->argv);
   }
 
@@ -1110,152 +2410,860 @@ void execute_program(conn_t *conn) { ASSERT_SERVER_ONLY;
     conn->stdin = PARENT_WRITE_FD;
     conn->stdout = PARENT_READ_FD;
 
-    /* Start polling the stdout. */
-    int id = NUM_POLL + num_connected - 1;
-    struct pollfd *stdout = &events[id];
-    stdout->fd = conn->stdout;
-    async(stdout->fd);
-    stdout->events = POLLIN | POLLHUP;
-    conn->poll_fd = stdout;
+    /* Let each pipe hold up to the buffer space, so the program and the
+       client can get that far ahead of each other. Output to the program is
+       then spliced into its pipe, and the pipe's capacity becomes the output
+       queue's size (and so what conn_bufspace() reports). The queue is
+       mapped on its own so that the pages stay untouched for the pipe even
+       after the connection is freed. Segments larger than a page (see --mss)
+       could leave no room in the queue while the pipe is not full, and the
+       program would never wake up the event loop, so they are written. */
+    size_t capacity = pipe_resize(conn->stdin, buf_space);
+    pipe_resize(conn->stdout, buf_space);
+    if (capacity > 0 && ctcp_cfg->mss <= sysconf(_SC_PAGESIZE)) {
+      char *buf = mmap(NULL, capacity, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (buf != MAP_FAILED) {
+        conn->splice = true;
+        conn->out_queue.buf = buf;
+        conn->out_queue.size = capacity;
+      }
+    }
+
+    /* Wait for output from the program, and for room to write to it. */
+    async(conn->stdout);
+    async(conn->stdin);
+    ev_add(shard->loop, &conn->stdout_handler, conn->stdout, EV_READ,
+           on_program_output, conn);
+    ev_add(shard->loop, &conn->stdin_handler, conn->stdin, EV_WRITE,
+           on_program_input, conn);
   }
 }
 
 /**
- * Delete all connections.
+ * Delete all connections that have been removed with conn_remove().
  */
 void delete_all_connections() {
-  /* Delete connections if needed. */
+  /* Delete connections that have been removed. */
   conn_t *conn, *next;
-  for (conn = get_connections(); conn != NULL; conn = next) {
-    next = conn->next;
-    if (conn->delete_me)
-      conn_free(conn);
+  for (conn = shard->delete_list; conn != NULL; conn = next) {
+    next = conn->next_delete;
+    conn_free(conn);
   }
+  shard->delete_list = NULL;
 }
 
 /**
- * Main loop. Handles the following:
- *   - Input from STDIN.
- *   - Messages from programs.
- *   - Packets from the socket.
- *   - Timeouts.
+ * [Server only]
+ * Decides whether a new client may write to the --recv-file file. Stripes
+ * (--stripes) each have their own part of the file, so any number of them
+ * can be received at once. Other clients append to the file, so they take
+ * turns with each other and with stripes. With --resume, a client that comes
+ * back after losing its connection takes over from the old one, which would
+ * otherwise linger.
+ *
+ * pkt: The SYN segment from the client.
+ * len: Length of the segment.
+ * returns: true if the client can connect.
  */
-void do_loop() {
-  char buf[MAX_PACKET_SIZE];
-  conn_t *conn = NULL;
+bool recv_file_admit(char *pkt, int len) {
+  bool stripe = find_exp_option(pkt, len, TCP_OPT_STRIPE_EXID) != NULL;
+  conn_t *old;
 
-  while (true) {
-    memset(buf, 0, MAX_PACKET_SIZE);
-    poll(events, NUM_POLL + num_connected,
-         need_timer_in(&last_timeout, ctcp_cfg->timer));
+  /* Finished connections do not count. */
+  delete_all_connections();
+  old = shard->connections;
+  if (old == NULL || (stripe && old->striped))
+    return true;
+
+  if (resume_fd >= 0 && !stripe && !old->striped) {
+    fprintf(stderr, "[INFO] New client, dropping the old one\n");
+    flush_output();
+    ctcp_destroy(old->state);
+    delete_all_connections();
+    return true;
+  }
 
-    /* Input from stdin. Server will only send to most-recently connected
-       client. */
-    if (!run_program && events[STDIN_FILENO].revents & POLLIN) {
-      conn = get_connections();
+  fprintf(stderr, "[ERROR] Already receiving %s, ignoring new client\n",
+          recv_file);
+  return false;
+}
 
-      if (conn != NULL)
-        ctcp_read(conn->state);
-    }
+/**
+ * Handles a packet received on the socket that made it through
+ * recv_filter().
+ *
+ * buf: The packet.
+ * len: Length of the packet.
+ * conn: Connection the packet belongs to, or NULL if it is a new connection.
+ */
+void handle_packet(char *buf, int len, conn_t *conn) {
+  tcphdr_t *tcp_hdr = (tcphdr_t *) (buf + IP_HDR_SIZE);
 
-    /* See if we can output more. */
-    if (events[STDOUT_FILENO].revents & (POLLOUT | POLLHUP | POLLERR)) {
-      for (conn = get_connections(); conn; conn = conn->next) {
-        conn_drain(conn);
-      }
+  /* Packet from an established connection. Pass to student code. */
+  if (conn != NULL) {
+    if (conn->delete_me)
+      return;
+
+    if (pcap_file != -1)
+      capture_packet(pcap_file, shard->pcap_ring, snaplen, buf, len);
+    ctcp_segment_t *segment = convert_to_ctcp(conn, buf, len);
+    len = len - FULL_HDR_SIZE + sizeof(ctcp_segment_t);
+
+    conn_metric_add(conn, METRIC_SEGMENTS_RECEIVED, 1);
+    conn_metric_add(conn, METRIC_BYTES_RECEIVED, len - sizeof(ctcp_segment_t));
+    uint64_t now = current_time_us();
+    conn->last_active = now / 1000;
+    if ((segment->flags & TH_ACK) &&
+        (int32_t) (ntohl(segment->ackno) - conn->highest_ackno) > 0) {
+      conn->highest_ackno = ntohl(segment->ackno);
+      flight_record(&conn->flight, FLIGHT_ACK, now, ntohl(segment->seqno),
+                    conn->highest_ackno, ntohs(segment->window), 0);
     }
 
-    /* Poll for output received from running programs. Send to client
-       client associated with this program instance. */
-    if (run_program) {
-      conn = get_connections();
-      while (conn != NULL) {
-        if (conn->poll_fd->revents & POLLIN) {
-          ctcp_read(conn->state);
-        }
-        conn = conn->next;
-      }
+    /* Don't log or forward to student code if it's an ACK from a new
+       connection. */
+    if (tcp_hdr->th_sport == shard->new_connection &&
+        (segment->flags & TH_ACK) &&
+        ntohl(segment->seqno) == 1 && ntohl(segment->ackno) == 1) {
+      shard->new_connection = 0;
+      free(segment);
     }
-
-    /* Receive packet on socket from other hosts. Ignore packets if they are
-       not large enough or not for us. */
-    if (events[2].revents & POLLIN) {
-      conn = NULL;
-      int len = recv_filter(config->socket, buf, MAX_PACKET_SIZE, 0, &conn);
-      if (len >= FULL_HDR_SIZE) {
-        tcphdr_t *tcp_hdr = (tcphdr_t *) (buf + IP_HDR_SIZE);
-
-        /* Packet from an established connection. Pass to student code. */
-        if (conn != NULL) {
-          ctcp_segment_t *segment = convert_to_ctcp(conn, buf, len);
-          len = len - FULL_HDR_SIZE + sizeof(ctcp_segment_t);
-
-          /* Don't log or forward to student code if it's an ACK from a new
-             connection. */
-          if (tcp_hdr->th_sport == new_connection &&
-              (segment->flags & TH_ACK) &&
-              ntohl(segment->seqno) == 1 && ntohl(segment->ackno) == 1) {
-            new_connection = 0;
-            free(segment);
-          }
-          else {
-            if (log_file != -1 || test_debug_on) {
-              log_segment(log_file, config->ip_addr, config->port, conn,
-                          segment, len, false, unix_socket);
-            }
-            ctcp_receive(conn->state, segment, len);
-          }
-        }
-
-        /* New connection. */
-        else if (tcp_hdr->th_flags & TH_SYN) {
-          conn_t *conn = tcp_new_connection(buf);
-
-          /* Start a new program associated with this client. */
-          if (run_program && conn)
-            execute_program(conn);
-          new_connection = tcp_hdr->th_sport;
-        }
+    else {
+      if (log_file != -1 || test_debug_on) {
+        log_segment(log_file, shard->log_ring, config->ip_addr, config->port,
+                    conn, segment, segment->data, false, unix_socket);
       }
+      ctcp_receive(conn->state, segment, len);
     }
+  }
+
+  /* New connection. */
+  else if (tcp_hdr->th_flags & TH_SYN) {
+    if (recv_file != NULL && !recv_file_admit(buf, len))
+      return;
+    conn_t *conn = tcp_new_connection(buf);
+
+    /* Start a new program associated with this client. */
+    if (run_program && conn)
+      execute_program(conn);
+    shard->new_connection = tcp_hdr->th_sport;
+
+    /* Input may have arrived on STDIN before anyone was connected to send it
+       to. Readiness is edge-triggered, so pick it up now. With --broadcast, a
+       new client starts with the next block of input. */
+    if (!run_program && conn) {
+      if (bcast_buf != NULL)
+        conn->bcast_pos = bcast_buf->len;
+      ctcp_read(conn->state);
+    }
+  }
+}
+
+/**
+ * Called by the event loop for each packet received on the socket. Ignore
+ * packets if they are not large enough or not for us.
+ *
+ * handler: The socket handler.
+ * buf: The packet.
+ * len: Length of the packet.
+ */
+void on_packet(ev_handler_t *handler, char *buf, int len) {
+  conn_t *conn = NULL;
+  len = filter_packet(buf, len, &conn);
+  if (len >= FULL_HDR_SIZE)
+    handle_packet(buf, len, conn);
+}
+
+/**
+ * Called by the event loop when there is input on STDIN. Server will only send
+ * to most-recently connected client, unless it broadcasts (--broadcast).
+ *
+ * handler: The STDIN handler.
+ * events: The events that occurred.
+ */
+void on_stdin(ev_handler_t *handler, uint32_t events) {
+  if (broadcast) {
+    broadcast_read();
+    return;
+  }
+
+  conn_t *conn = get_connections();
+  if (conn == NULL || conn->delete_me)
+    return;
+
+  conn_read(conn, handler);
+}
+
+/**
+ * Called by the event loop when more output can be written to STDOUT. Stops
+ * watching STDOUT once every connection's output queue is empty.
+ *
+ * handler: The STDOUT handler.
+ * events: The events that occurred.
+ */
+void on_stdout(ev_handler_t *handler, uint32_t events) {
+  conn_t *conn;
+  bool queued = false;
+
+  for (conn = get_connections(); conn; conn = conn->next) {
+    conn_drain(conn);
+    if (conn->out_queue.used && !conn->wrote_err)
+      queued = true;
+  }
+
+  if (!queued)
+    ev_modify(shard->loop, handler, 0);
+}
+
+/**
+ * [Server only]
+ * Returns the shard that owns connections from a given address. IP addresses
+ * are not used for Unix sockets, matching the connection table's keys.
+ *
+ * buf: A packet received on the socket.
+ */
+struct shard *shard_for(char *buf) {
+  iphdr_t *ip_hdr = (iphdr_t *) buf;
+  tcphdr_t *tcp_hdr = (tcphdr_t *) (buf + IP_HDR_SIZE);
+  uint32_t h = unix_socket ? 0 : ip_hdr->saddr;
+  h ^= ntohs(tcp_hdr->th_sport) * 0x9e3779b1;
+  h ^= h >> 16;
+  return &shards[h % num_shards];
+}
+
+/**
+ * [Server only]
+ * Returns a slot of a shard's ring.
+ *
+ * s: The shard.
+ * index: Index of the slot, wrapped around the size of the ring.
+ */
+struct shard_packet *shard_slot(struct shard *s, unsigned int index) {
+  index &= SHARD_RING_SIZE - 1;
+  return (struct shard_packet *) ((char *) s->ring + index * SHARD_SLOT_SIZE);
+}
+
+/**
+ * [Server only]
+ * Called by the main thread's event loop for each packet received on the
+ * socket when the server is running with --threads. Hands the packet to the
+ * shard that owns its sender. Packets are dropped if the shard has too many
+ * waiting, and will be retransmitted. Shards are woken up by wake_shards().
+ *
+ * handler: The socket handler.
+ * buf: The packet.
+ * len: Length of the packet.
+ */
+void on_packet_steer(ev_handler_t *handler, char *buf, int len) {
+  struct shard *target;
+
+  if (len < FULL_HDR_SIZE)
+    return;
+
+  target = shard_for(buf);
+  unsigned int head = __atomic_load_n(&target->ring_head, __ATOMIC_ACQUIRE);
+  if (target->ring_tail - head == SHARD_RING_SIZE)
+    return;
+
+  struct shard_packet *pkt = shard_slot(target, target->ring_tail);
+  pkt->data = len <= SHARD_SLOT_DATA ? pkt->buf : malloc(len);
+  if (pkt->data == NULL)
+    return;
+  memcpy(pkt->data, buf, len);
+  pkt->len = len;
+  __atomic_store_n(&target->ring_tail, target->ring_tail + 1,
+                   __ATOMIC_RELEASE);
+  target->needs_wake = true;
+}
+
+/** Columns of the "conns" command: the connection's address, the last ackno
+    received, last seqno sent and last seqno accepted, segments unacked and
+    waiting to be output, bytes of output queued, the retransmission timeout
+    and how long ago a segment was last sent or received. */
+#define CONNS_HEADER "%-21s %10s %10s %10s %7s %7s %9s %7s %8s\n"
+#define CONNS_ROW    "%-21s %10u %10u %10u %7u %7u %9zu %7d %8ld\n"
+
+/**
+ * Writes the header of the "conns" command's list.
+ */
+void conns_header(FILE *out) {
+  fprintf(out, CONNS_HEADER, "Peer", "Acked", "Sent", "Accepted", "Unacked",
+          "Reasm", "Backlog", "RTO(ms)", "Idle(ms)");
+}
+
+/**
+ * Lists the current thread's connections, one per line, for the "conns"
+ * command. Each is described by the student code (see ctcp_get_info()).
+ *
+ * out: Where to write.
+ */
+void list_conns(FILE *out) {
+  ctcp_info_t info;
+  char peer[32];
+  long now = current_time();
+  conn_t *conn;
+
+  for (conn = get_connections(); conn; conn = conn->next) {
+    if (conn->delete_me || conn->state == NULL)
+      continue;
+    ctcp_get_info(conn->state, &info);
+    peer_name(conn, peer, sizeof(peer));
+    fprintf(out, CONNS_ROW, peer, info.last_ackno_rxed, info.last_seqno_sent,
+            info.last_seqno_accepted, info.unacked_segments,
+            info.segments_to_output,
+            conn->out_queue.size - conn_bufspace(conn), info.rt_timeout,
+            now - conn->last_active);
+  }
+}
+
+/**
+ * Dumps the current thread's connections' flight recorders, for the "flight"
+ * command.
+ *
+ * out: Where to write.
+ */
+void list_flight(FILE *out) {
+  conn_t *conn;
+
+  for (conn = get_connections(); conn; conn = conn->next) {
+    if (conn->delete_me)
+      continue;
+    flight_write(conn, out, NULL);
+  }
+}
+
+/**
+ * [Server only]
+ * Wakes up each shard that was given packets since the last call.
+ */
+void wake_shards() {
+  uint64_t one = 1;
+  int i;
+
+  for (i = 0; i < num_shards; i++) {
+    if (shards[i].needs_wake) {
+      shards[i].needs_wake = false;
+      write(shards[i].wake_fd, &one, sizeof(one));
+    }
+  }
+}
+
+/**
+ * [Server only]
+ * Called by a shard's event loop when the main thread has given it packets.
+ *
+ * handler: The wake-up handler.
+ * events: The events that occurred.
+ */
+void on_shard_wake(ev_handler_t *handler, uint32_t events) {
+  uint64_t count;
+  conn_t *conn;
+  int len;
+
+  /* Reset the eventfd before looking at the ring, so packets added after this
+     point cause another wake-up. */
+  read(shard->wake_fd, &count, sizeof(count));
+
+  /* List the connections, if the main thread asked for them. */
+  conn_list_t list = __atomic_exchange_n(&shard->info_wanted, NULL,
+                                         __ATOMIC_ACQUIRE);
+  if (list != NULL) {
+    FILE *out = open_memstream(&shard->info, &shard->info_len);
+    list(out);
+    fclose(out);
+    count = 1;
+    write(info_done_fd, &count, sizeof(count));
+  }
+
+  while (shard->ring_head !=
+         __atomic_load_n(&shard->ring_tail, __ATOMIC_ACQUIRE)) {
+    struct shard_packet *pkt = shard_slot(shard, shard->ring_head);
+    conn = NULL;
+    len = filter_packet(pkt->data, pkt->len, &conn);
+    if (len >= FULL_HDR_SIZE)
+      handle_packet(pkt->data, len, conn);
+    if (pkt->data != pkt->buf)
+      free(pkt->data);
+    __atomic_store_n(&shard->ring_head, shard->ring_head + 1,
+                     __ATOMIC_RELEASE);
+  }
+}
+
+/**
+ * Main loop. Dispatches the following as they become ready:
+ *   - Input from STDIN.
+ *   - Messages from programs.
+ *   - Packets from the socket.
+ * and handles timeouts.
+ */
+void do_loop() {
+  while (true) {
+    ev_wait(shard->loop, need_timer_in(&shard->last_timeout, ctcp_cfg->timer));
 
     /* Check if timer is up. */
-    if (need_timer_in(&last_timeout, ctcp_cfg->timer) == 0) {
+    if (need_timer_in(&shard->last_timeout, ctcp_cfg->timer) == 0) {
       ctcp_timer();
-      get_time(&last_timeout);
+      get_time(&shard->last_timeout);
     }
 
+    /* With --broadcast, read more input once every client has taken it. */
+    if (bcast_wanted)
+      broadcast_read();
+
+    /* Write out everything that was output. */
+    flush_output();
+
+    /* Every so often, record how much of the file is complete. */
+    if (resume_fd >= 0 && shard->connections != NULL &&
+        current_time() - last_checkpoint >= RESUME_INTERVAL)
+      write_checkpoint(shard->connections);
+
     /* Delete connections if needed. */
     delete_all_connections();
   }
 }
 
 /**
- * Setup config for polling.
+ * Set up a shard's event loop and connection table. The maximum number of
+ * clients is split evenly between shards.
+ *
+ * s: The shard.
+ */
+void shard_init(struct shard *s) {
+  s->loop = ev_create(backend);
+
+  /* Fall back to epoll if io_uring can't be used. */
+  if (s->loop == NULL && backend == EV_IO_URING) {
+    fprintf(stderr, "[INFO] io_uring is not available, using epoll\n");
+    backend = EV_EPOLL;
+    s->loop = ev_create(backend);
+  }
+  if (s->loop == NULL) {
+    fprintf(stderr, "[ERROR] Could not create event loop\n");
+    exit(EXIT_FAILURE);
+  }
+  s->conn_table = ct_create(0);
+  s->connections = NULL;
+  s->delete_list = NULL;
+}
+
+/**
+ * Writes the label that tells a connection apart in the metrics report.
+ *
+ * conn: The connection object.
+ * buf: Buffer for the label.
+ * len: Size of the buffer.
+ */
+void peer_label(conn_t *conn, char *buf, size_t len) {
+  char peer[32];
+  peer_name(conn, peer, sizeof(peer));
+  snprintf(buf, len, "peer=\"%s\"", peer);
+}
+
+/**
+ * Writes out a gauge that has a single sample.
+ */
+void report_gauge(FILE *out, const char *name, const char *help,
+                  uint64_t value) {
+  metrics_family(out, name, "gauge", help);
+  metrics_sample(out, name, NULL, value);
+}
+
+/**
+ * Writes the metrics report in the Prometheus text format: the counters and
+ * histograms summed over every shard, then gauges. Connections are only listed one by
+ * one with a single shard, since other shards' connections belong to other
+ * threads.
+ *
+ * out: Where to write.
+ */
+void metrics_report(FILE *out) {
+  metrics_t total;
+  histogram_t timing;
+  char name[64];
+  char labels[64];
+  conn_t *conn;
+  uint64_t queued = 0;
+  uint64_t in_flight = 0;
+  int i, m, t;
+
+  memset(&total, 0, sizeof(total));
+  for (i = 0; i < num_shards; i++) {
+    for (m = 0; m < NUM_METRICS; m++)
+      total.count[m] += metrics_get(&shards[i].metrics, m);
+  }
+
+  for (m = 0; m < NUM_METRICS; m++) {
+    snprintf(name, sizeof(name), "ctcp_%s_total", metric_name(m));
+    metrics_family(out, name, "counter", metric_help(m));
+    metrics_sample(out, name, NULL, total.count[m]);
+  }
+  report_gauge(out, "ctcp_connections", "Connections open.",
+               total.count[METRIC_CONNECTIONS_OPENED] -
+               total.count[METRIC_CONNECTIONS_CLOSED]);
+
+  struct mallinfo2 mi = mallinfo2();
+  report_gauge(out, "ctcp_heap_bytes", "Bytes of heap memory in use.",
+               mi.uordblks + mi.hblkhd);
+  metrics_family(out, "ctcp_log_dropped_total", "counter", "Segments or "
+                 "packets not logged because the log could not keep up.");
+  metrics_sample(out, "ctcp_log_dropped_total", NULL, log_dropped());
+
+  for (t = 0; t < NUM_TIMINGS; t++) {
+    memset(&timing, 0, sizeof(timing));
+    for (i = 0; i < num_shards; i++)
+      hist_merge(&timing, &shards[i].timings[t]);
+    snprintf(name, sizeof(name), "ctcp_%s_seconds", timing_name(t));
+    metrics_family(out, name, "summary", timing_help(t));
+    metrics_summary(out, name, NULL, &timing);
+  }
+
+  if (num_shards > 1)
+    return;
+
+  /* Counters for each connection. */
+  for (m = 0; m < NUM_CONN_METRICS; m++) {
+    snprintf(name, sizeof(name), "ctcp_conn_%s_total", metric_name(m));
+    metrics_family(out, name, "counter", metric_help(m));
+    for (conn = get_connections(); conn; conn = conn->next) {
+      peer_label(conn, labels, sizeof(labels));
+      metrics_sample(out, name, labels, metrics_get(&conn->metrics, m));
+    }
+  }
+
+  /* Histograms for each connection, once they have been used. */
+  for (t = 0; t < NUM_TIMINGS; t++) {
+    snprintf(name, sizeof(name), "ctcp_conn_%s_seconds", timing_name(t));
+    metrics_family(out, name, "summary", timing_help(t));
+    for (conn = get_connections(); conn; conn = conn->next) {
+      if (conn->timings[t] == NULL)
+        continue;
+      peer_label(conn, labels, sizeof(labels));
+      metrics_summary(out, name, labels, conn->timings[t]);
+    }
+  }
+
+  /* How much is waiting on each connection: output not yet written out, and
+     data sent but not yet acked. */
+  metrics_family(out, "ctcp_conn_output_queued_bytes", "gauge",
+                 "Bytes of output waiting to be written.");
+  for (conn = get_connections(); conn; conn = conn->next) {
+    peer_label(conn, labels, sizeof(labels));
+    metrics_sample(out, "ctcp_conn_output_queued_bytes", labels,
+                   conn->out_queue.used);
+    queued += conn->out_queue.used;
+  }
+  metrics_family(out, "ctcp_conn_in_flight_bytes", "gauge",
+                 "Bytes sent but not yet acked.");
+  for (conn = get_connections(); conn; conn = conn->next) {
+    uint32_t n = conn->highest_seqno_sent - conn->highest_ackno;
+    if ((int32_t) n < 0)
+      n = 0;
+    peer_label(conn, labels, sizeof(labels));
+    metrics_sample(out, "ctcp_conn_in_flight_bytes", labels, n);
+    in_flight += n;
+  }
+  report_gauge(out, "ctcp_output_queued_bytes",
+               "Bytes of output waiting to be written.", queued);
+  report_gauge(out, "ctcp_in_flight_bytes", "Bytes sent but not yet acked.",
+               in_flight);
+}
+
+/**
+ * Runs the "metrics" command of the control socket: sends the metrics report.
+ *
+ * client: The client that sent the command.
+ */
+void on_metrics_command(control_client_t *client) {
+  size_t len = 0;
+  char *buf = metrics_render(metrics_report, &len);
+  control_reply(client, buf, len);
+}
+
+/**
+ * Starts the shards listing their connections, for the first request waiting
+ * for them.
+ */
+void ask_shards() {
+  uint64_t one = 1;
+  int i;
+
+  info_listing = info_requests[0];
+  info_pending = num_shards;
+  for (i = 0; i < num_shards; i++) {
+    __atomic_store_n(&shards[i].info_wanted, info_listing.list,
+                     __ATOMIC_RELEASE);
+    write(shards[i].wake_fd, &one, sizeof(one));
+  }
+}
+
+/**
+ * Runs a command of the control socket that lists the connections. With more
+ * than one shard, the shards are woken up to list their own connections, and
+ * the list is sent once all of them have (see on_info_done()), so no shard
+ * is ever held up by a lock.
+ *
+ * client: The client that sent the command.
+ * header: Writes what comes before the connections, or NULL.
+ * list: Lists the current thread's connections.
+ */
+void list_command(control_client_t *client, conn_list_t header,
+                  conn_list_t list) {
+  char *buf = NULL;
+  size_t len;
+  FILE *out;
+
+  if (num_shards == 1) {
+    out = open_memstream(&buf, &len);
+    if (header != NULL)
+      header(out);
+    list(out);
+    fclose(out);
+    control_reply(client, buf, len);
+    return;
+  }
+
+  info_requests = realloc(info_requests, (num_info_requests + 1) *
+                                         sizeof(struct info_request));
+  info_requests[num_info_requests].client = client;
+  info_requests[num_info_requests].header = header;
+  info_requests[num_info_requests].list = list;
+  num_info_requests++;
+
+  /* Clients that ask while the shards are still listing their connections
+     wait for them to finish. */
+  if (info_pending == 0)
+    ask_shards();
+}
+
+/**
+ * Called when a client of the control socket hangs up while it waits for the
+ * shards to list the connections. Forgets the client.
+ *
+ * client: The client.
+ */
+void cancel_list_command(control_client_t *client) {
+  int i, n;
+
+  for (i = 0, n = 0; i < num_info_requests; i++) {
+    if (info_requests[i].client != client)
+      info_requests[n++] = info_requests[i];
+  }
+  num_info_requests = n;
+}
+
+/**
+ * Runs the "conns" command of the control socket: lists the connections, with
+ * a header.
+ *
+ * client: The client that sent the command.
+ */
+void on_conns_command(control_client_t *client) {
+  list_command(client, conns_header, list_conns);
+}
+
+/**
+ * Runs the "flight" command of the control socket: dumps each connection's
+ * flight recorder.
+ *
+ * client: The client that sent the command.
+ */
+void on_flight_command(control_client_t *client) {
+  list_command(client, NULL, list_flight);
+}
+
+/**
+ * [--threads only]
+ * Called by the event loop when shards have listed their connections. Once
+ * all of them have, sends the list to every client waiting for it, then
+ * starts the shards on the next list clients are waiting for, if any.
+ *
+ * handler: The handler for info_done_fd.
+ * events: The events that occurred.
+ */
+void on_info_done(ev_handler_t *handler, uint32_t events) {
+  conn_list_t list = info_listing.list;
+  char *buf = NULL;
+  size_t len;
+  uint64_t count;
+  FILE *out;
+  int i, n;
+
+  if (read(info_done_fd, &count, sizeof(count)) != sizeof(count))
+    return;
+  info_pending -= count;
+  if (info_pending > 0)
+    return;
+
+  out = open_memstream(&buf, &len);
+  if (info_listing.header != NULL)
+    info_listing.header(out);
+  for (i = 0; i < num_shards; i++) {
+    fwrite(shards[i].info, 1, shards[i].info_len, out);
+    free(shards[i].info);
+    shards[i].info = NULL;
+  }
+  fclose(out);
+
+  for (i = 0, n = 0; i < num_info_requests; i++) {
+    if (info_requests[i].list == list) {
+      char *copy = malloc(len);
+      memcpy(copy, buf, len);
+      control_reply(info_requests[i].client, copy, len);
+    } else {
+      info_requests[n++] = info_requests[i];
+    }
+  }
+  num_info_requests = n;
+  free(buf);
+
+  if (num_info_requests > 0)
+    ask_shards();
+}
+
+/** Commands of the control socket. */
+static const control_command_t control_commands[] = {
+  { "conns", "List the connections, like ss(8)", on_conns_command,
+    cancel_list_command },
+  { "flight", "Dump each connection's recent events", on_flight_command,
+    cancel_list_command },
+  { "metrics", "Report the metrics in the Prometheus text format",
+    on_metrics_command }
+};
+
+/**
+ * Called by the event loop on SIGUSR1.
+ *
+ * handler: The signalfd handler.
+ * events: The events that occurred.
+ */
+void on_metrics_signal(ev_handler_t *handler, uint32_t events) {
+  metrics_dump(signal_fd, metrics_report);
+}
+
+/**
+ * Serves the control socket (with --control) and dumps the metrics on
+ * SIGUSR1 from an event loop. With more than one shard, this is the main
+ * thread's loop, and must be set up before the shards start.
+ *
+ * loop: The event loop.
+ */
+void setup_control(ev_loop_t *loop) {
+  if (control_path != NULL &&
+      control_listen(loop, control_path, control_commands,
+                     sizeof(control_commands) /
+                     sizeof(control_commands[0])) < 0) {
+    fprintf(stderr, "[ERROR] Could not listen on %s\n", control_path);
+    exit(EXIT_FAILURE);
+  }
+  if (num_shards > 1) {
+    info_done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ev_add(loop, &info_done_handler, info_done_fd, EV_READ, on_info_done,
+           NULL);
+  }
+  if (signal_fd >= 0)
+    ev_add(loop, &signal_handler, signal_fd, EV_READ, on_metrics_signal,
+           NULL);
+}
+
+/**
+ * Set up the event loops.
  */
-void setup_poll() {
-  /* Poll for input from stdin. */
-  struct pollfd *stdin = &events[STDIN_FILENO];
-  stdin->fd = STDIN_FILENO;
-  stdin->events = POLLIN | POLLHUP | POLLERR;
-  async(STDIN_FILENO);
+void setup_events() {
+  int i;
+
+  /* Log segments and capture packets from a thread of their own. The tester
+     wants segments logged right away. */
+  log_ring_t *rings[2 * num_shards];
+  int num_rings = 0;
+  for (i = 0; i < num_shards; i++) {
+    if (log_file != -1 && !test_debug_on) {
+      shards[i].log_ring = log_ring_create(log_file, LOG_TEXT, log_payload);
+      rings[num_rings++] = shards[i].log_ring;
+    }
+    if (pcap_file != -1) {
+      shards[i].pcap_ring = log_ring_create(pcap_file, LOG_PCAP,
+                                            MIN(snaplen, max_packet_size));
+      rings[num_rings++] = shards[i].pcap_ring;
+    }
+  }
+  if (num_rings > 0 && log_writer_start(rings, num_rings) < 0) {
+    fprintf(stderr, "[ERROR] Could not start logging\n");
+    exit(EXIT_FAILURE);
+  }
 
-  /* Poll stdout to do asynchronous output.. */
-  struct pollfd *stdout = &events[STDOUT_FILENO];
-  stdout->fd = STDOUT_FILENO;
-  stdout->events = POLLOUT | POLLERR;
-  async(STDOUT_FILENO);
+  /* Wait for input from stdin. Programs take the place of stdin and stdout
+     when running as a server with a program. */
+  if (!run_program) {
+    /* The server sends STDIN to the most recently connected client (or all
+       of them with --broadcast), which are only known with a single
+       shard. */
+    async(STDIN_FILENO);
+    if (num_shards == 1)
+      ev_add(shard->loop, &stdin_handler, STDIN_FILENO, EV_READ, on_stdin,
+             NULL);
+
+    /* Wait on stdout to do asynchronous output. Only watched while there is
+       queued output. */
+    async(STDOUT_FILENO);
+    for (i = 0; i < num_shards; i++) {
+      ev_add(shards[i].loop, &shards[i].stdout_handler, STDOUT_FILENO, 0,
+             on_stdout, NULL);
+    }
+  }
 
-  /* Poll for segments from the server. */
-  struct pollfd *socket = &events[2];
-  socket->fd = config->socket;
-  socket->events = POLLIN | POLLHUP | POLLERR;
+  /* Wait for segments from the other host. With more than one shard, the main
+     thread does this instead (see run_shards()). */
   async(config->socket);
+  if (num_shards == 1) {
+    ev_add_recv(shard->loop, &socket_handler, config->socket, max_packet_size,
+                on_packet, NULL);
+    setup_control(shard->loop);
+  }
 
   /* Used to detect if a network service has closed. */
   signal(SIGPIPE, SIG_IGN);
 }
 
+/**
+ * [Server only]
+ * Thread for a shard. Runs the shard's main loop.
+ *
+ * arg: The shard.
+ */
+void *shard_main(void *arg) {
+  shard = arg;
+  do_loop();
+  return NULL;
+}
+
+/**
+ * [Server only]
+ * Starts a thread for each shard. The main thread then receives packets and
+ * steers them to the shards. Does not return.
+ */
+void run_shards() {
+  ev_loop_t *recv_loop = ev_create(backend);
+  int i;
+
+  setup_control(recv_loop);
+  for (i = 0; i < num_shards; i++) {
+    struct shard *s = &shards[i];
+    s->ring = calloc(SHARD_RING_SIZE, SHARD_SLOT_SIZE);
+    s->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ev_add(s->loop, &s->wake_handler, s->wake_fd, EV_READ, on_shard_wake, s);
+    pthread_create(&s->thread, NULL, shard_main, s);
+  }
+
+  ev_add_recv(recv_loop, &socket_handler, config->socket, max_packet_size,
+              on_packet_steer, NULL);
+  while (true) {
+    ev_wait(recv_loop, -1);
+    wake_shards();
+  }
+}
+
 /**
  * Library teardown for a client.
  */
@@ -1266,12 +3274,216 @@ void end_client() {
     return;
   }
 
+  /* Once this connection has sent its part of a file too large for one,
+     start over for the next part. The new connection asks the server where
+     to resume. */
+  bool send_rest = resume_rest &&
+                   config->sconn->highest_ackno - 1 >= send_map_len;
+
+  flush_output();
   delete_all_connections();
+  ev_flush(shard->loop);
   close(config->socket);
   fprintf(stderr, "[INFO] Disconnected from server\n");
+
+  if (send_rest) {
+    fprintf(stderr, "[INFO] Reconnecting to send the rest of %s\n",
+            send_file);
+    log_writer_stop();
+    execv("/proc/self/exe", client_argv);
+    perror("[ERROR] execv");
+    exit(EXIT_FAILURE);
+  }
   exit(EXIT_SUCCESS);
 }
 
+/**
+ * [Client only]
+ * Memory-maps the file given with --send-file (see conn_input_map()).
+ * conn_input() copies from the mapping as well. The file also takes the place
+ * of STDIN, which is what the event loop watches for input, so the input is
+ * always ready. The file must not shrink while it is being sent.
+ *
+ * returns: 0 on success, -1 on failure.
+ */
+int map_send_file() {
+  struct stat st;
+  int fd = open(send_file, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+    fprintf(stderr, "[ERROR] Cannot send %s: not a readable file\n",
+            send_file);
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+
+  /* Sequence numbers would wrap around, so a connection sends less than
+     MAX_STREAM_LEN bytes. Stripes each send their own chunk. With --resume,
+     the rest goes over the next connection (see tcp_handshake()). */
+  if (!resume && (uint64_t) st.st_size > (uint64_t) MAX_STREAM_LEN * stripes) {
+    fprintf(stderr, "[ERROR] Cannot send %s: one connection carries at most "
+            "%u bytes, so it needs --resume or --stripes %llu or more\n",
+            send_file, MAX_STREAM_LEN,
+            (unsigned long long) ((st.st_size - 1) / MAX_STREAM_LEN + 1));
+    close(fd);
+    return -1;
+  }
+
+  /* mmap() does not take a length of 0. */
+  send_map_len = st.st_size;
+  if (send_map_len == 0) {
+    send_map = "";
+  }
+  else {
+    void *map = mmap(NULL, send_map_len, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+      perror("[ERROR] mmap");
+      close(fd);
+      return -1;
+    }
+    madvise(map, send_map_len, MADV_SEQUENTIAL);
+    send_map = map;
+  }
+
+  if (dup2(fd, STDIN_FILENO) < 0) {
+    perror("[ERROR] dup2");
+    close(fd);
+    return -1;
+  }
+  close(fd);
+  return 0;
+}
+
+/**
+ * [Client only]
+ * Splits the --send-file file into one chunk per stripe (--stripes), and forks
+ * a client for each. Stripe i connects from port + i, and sends the i-th
+ * chunk, telling the server where it starts in its SYN. The original process
+ * only waits for the stripes to finish.
+ *
+ * port: The port given with -p.
+ * returns: The port this stripe connects from. Only returns in the stripes.
+ */
+char *fork_stripes(char *port) {
+  static char stripe_port[16];
+  size_t chunk = (send_map_len + stripes - 1) / stripes;
+  int i, status, failed = 0;
+
+  for (i = 0; i < stripes; i++) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      perror("[ERROR] fork");
+      failed = stripes - i;
+      break;
+    }
+    if (pid == 0) {
+      size_t start = MIN(i * chunk, send_map_len);
+
+      /* The event loop was created before forking, and would otherwise be
+         shared with the other stripes. */
+      ev_destroy(shard->loop);
+      shard->loop = ev_create(backend);
+      if (shard->loop == NULL) {
+        fprintf(stderr, "[ERROR] Could not create event loop\n");
+        exit(EXIT_FAILURE);
+      }
+
+      striped = true;
+      stripe_offset = start;
+      send_map += start;
+      send_map_len = MIN(chunk, send_map_len - start);
+      snprintf(stripe_port, sizeof(stripe_port), "%d", atoi(port) + i);
+      return stripe_port;
+    }
+  }
+
+  while (wait(&status) > 0) {
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+      failed++;
+  }
+  if (failed > 0) {
+    fprintf(stderr, "[ERROR] %d of %d stripes failed\n", failed, stripes);
+    exit(EXIT_FAILURE);
+  }
+  fprintf(stderr, "[INFO] Sent %s in %d stripes\n", send_file, stripes);
+  exit(EXIT_SUCCESS);
+}
+
+/**
+ * [Server only]
+ * Opens the --resume checkpoint kept next to the --recv-file file, and reads
+ * where the file stops being complete. Anything past that point may have
+ * holes, so it is cut off.
+ *
+ * fd: The --recv-file file.
+ * size: Size of the file.
+ * returns: 0 on success, -1 on failure.
+ */
+int open_checkpoint(int fd, off_t size) {
+  char *path = malloc(strlen(recv_file) + sizeof(RESUME_SUFFIX));
+  sprintf(path, "%s%s", recv_file, RESUME_SUFFIX);
+  resume_fd = open(path, O_RDWR | O_CREAT, 0666);
+  if (resume_fd < 0) {
+    fprintf(stderr, "[ERROR] Cannot open %s: %s\n", path, strerror(errno));
+    free(path);
+    return -1;
+  }
+  free(path);
+
+  /* A checkpoint past the end of the file is not about this file. */
+  char buf[32];
+  memset(buf, 0, sizeof(buf));
+  if (pread(resume_fd, buf, sizeof(buf) - 1, 0) > 0)
+    resume_offset = strtoll(buf, NULL, 10);
+  if (resume_offset < 0 || resume_offset > size)
+    resume_offset = 0;
+
+  if (ftruncate(fd, resume_offset) < 0) {
+    perror("[ERROR] ftruncate");
+    return -1;
+  }
+  fprintf(stderr, "[INFO] %s is complete up to byte %lld\n", recv_file,
+          (long long) resume_offset);
+  return 0;
+}
+
+/**
+ * Opens the file given with --recv-file in place of STDOUT, emptying it
+ * first like a shell redirection would. conn_output() then writes to it in
+ * order as usual, and conn_output_at() can write at any offset.
+ *
+ * returns: 0 on success, -1 on failure.
+ */
+int open_recv_file() {
+  int fd = open(recv_file, O_WRONLY | O_CREAT | (resume ? 0 : O_TRUNC), 0666);
+  if (fd < 0) {
+    fprintf(stderr, "[ERROR] Cannot write to %s: %s\n", recv_file,
+            strerror(errno));
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+    fprintf(stderr, "[ERROR] Cannot write to %s: not a regular file\n",
+            recv_file);
+    close(fd);
+    return -1;
+  }
+
+  if (resume && open_checkpoint(fd, st.st_size) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  if (dup2(fd, STDOUT_FILENO) < 0) {
+    perror("[ERROR] dup2");
+    close(fd);
+    return -1;
+  }
+  close(fd);
+  return 0;
+}
+
 /**
  * Start a client.
  *
@@ -1279,6 +3491,12 @@ void end_client() {
  * port: The port the client will run on.
  */
 int start_client(char *server, char *port) {
+  if (send_file != NULL && map_send_file() < 0)
+    return -1;
+  if (stripes > 1)
+    port = fork_stripes(port);
+  if (recv_file != NULL && open_recv_file() < 0)
+    return -1;
   if (do_config_server(server) < 0 || do_config(port) < 0)
     return -1;
 
@@ -1294,7 +3512,7 @@ int start_client(char *server, char *port) {
   fprintf(stderr, "[INFO] Connected to server\n");
   config->sconn->state = state;
 
-  setup_poll();
+  setup_events();
   do_loop();
   return 0;
 }
@@ -1307,6 +3525,8 @@ int start_client(char *server, char *port) {
  * argv: Array containing arguments to program.
  */
 int start_server(char *port, int argc, char *argv[]) {
+  if (recv_file != NULL && open_recv_file() < 0)
+    return -1;
   if (do_config(port) < 0)
     return -1;
 
@@ -1316,11 +3536,22 @@ int start_server(char *port, int argc, char *argv[]) {
     config->program = argv[optind];
     config->argc = argc - optind;
     config->argv = argv + optind;
+
+    /* Each client uses two pipes to its program. Allow as many open files as
+       the system lets us so that many clients can connect. */
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+      rl.rlim_cur = rl.rlim_max;
+      setrlimit(RLIMIT_NOFILE, &rl);
+    }
   }
   fprintf(stderr, "[INFO] Server started\n");
 
-  setup_poll();
-  do_loop();
+  setup_events();
+  if (num_shards > 1)
+    run_shards();
+  else
+    do_loop();
   return 0;
 }
 
@@ -1342,6 +3573,22 @@ static void usage(char *progname) {
     "   [--corrupt corrupt_percent]\n"
     "   [--delay delay_percent]\n"
     "   [--duplicate duplicate_percent]\n"
+    "   [--max-clients max_clients]     [server only]\n"
+    "   [--threads num_threads]         [server only]\n"
+    "   [--io-uring]\n"
+    "   [--buf-space bytes]\n"
+    "   [--send-file path]              [client only, < 4 GiB per "
+    "connection]\n"
+    "   [--recv-file path]\n"
+    "   [--resume]                      [with --send-file or --recv-file]\n"
+    "   [--stripes num_connections]     [client only, with --send-file]\n"
+    "   [--broadcast]                   [server only]\n"
+    "   [--mss bytes]\n"
+    "   [--log-payload bytes]           [with -l]\n"
+    "   [--pcap path]\n"
+    "   [--snaplen bytes]               [with --pcap]\n"
+    "   [--control path]\n"
+    "   [--flight-threshold ms]\n"
     "   [-- program arg1 arg2 ...]\n\n",
     progname
   );
@@ -1356,6 +3603,12 @@ int main(int argc , char *argv[]) {
   else
     progname = argv[0];
 
+  /* Kept for end_client(), before they are reordered or split up. */
+  int i;
+  client_argv = calloc(argc + 1, sizeof(char *));
+  for (i = 0; i < argc; i++)
+    client_argv[i] = strdup(argv[i]);
+
   /* Possible command-line arguments. */
   bool is_server = 0;
   bool is_client = 0;
@@ -1363,6 +3616,11 @@ int main(int argc , char *argv[]) {
   char *port_str = NULL;
   int port = -1;
   int window = 1;
+  int mss = MAX_SEG_DATA_SIZE;
+  long clients = MAX_NUM_CLIENTS;
+  char *end;
+  bool buf_space_set = false;
+  char *pcap_path = NULL;
   seed = time(NULL);
   test_debug_on = false;
   lab5_mode = false;
@@ -1381,6 +3639,21 @@ int main(int argc , char *argv[]) {
     { "duplicate", required_argument, NULL, 'q' },
     { "logging", no_argument, NULL, 'l' },
     { "lab5", no_argument, NULL, 'f' },
+    { "max-clients", required_argument, NULL, 'm' },
+    { "threads", required_argument, NULL, 'n' },
+    { "io-uring", no_argument, NULL, 'u' },
+    { "buf-space", required_argument, NULL, 'b' },
+    { "send-file", required_argument, NULL, 'i' },
+    { "recv-file", required_argument, NULL, 'o' },
+    { "resume", no_argument, NULL, 'a' },
+    { "stripes", required_argument, NULL, 'g' },
+    { "broadcast", no_argument, NULL, 'x' },
+    { "mss", required_argument, NULL, 'j' },
+    { "log-payload", required_argument, NULL, 'k' },
+    { "pcap", required_argument, NULL, 'v' },
+    { "snaplen", required_argument, NULL, 'h' },
+    { "control", required_argument, NULL, 'M' },
+    { "flight-threshold", required_argument, NULL, 'T' },
     { NULL, 0, NULL, 0 }
   };
 
@@ -1442,6 +3715,71 @@ int main(int argc , char *argv[]) {
     case 'f':
       lab5_mode = true;
       break;
+    /* Maximum number of clients. Anything but a number is invalid, since 0
+       means no limit. */
+    case 'm':
+      errno = 0;
+      clients = strtol(optarg, &end, 10);
+      if (end == optarg || *end != '\0' || errno != 0)
+        clients = -1;
+      break;
+    /* Number of threads (shards) for the server. */
+    case 'n':
+      num_shards = atoi(optarg);
+      break;
+    /* Use io_uring for I/O. */
+    case 'u':
+      backend = EV_IO_URING;
+      break;
+    /* Output buffer space per connection. */
+    case 'b':
+      buf_space = atoi(optarg) > 0 ? atoi(optarg) : 0;
+      buf_space_set = true;
+      break;
+    /* Send a file instead of STDIN. */
+    case 'i':
+      send_file = optarg;
+      break;
+    /* Write output to a file instead of STDOUT. */
+    case 'o':
+      recv_file = optarg;
+      break;
+    /* Resume an interrupted transfer. */
+    case 'a':
+      resume = true;
+      break;
+    /* Send a file over several connections at once. */
+    case 'g':
+      stripes = atoi(optarg);
+      break;
+    /* Send STDIN to every client. */
+    case 'x':
+      broadcast = true;
+      break;
+    /* Maximum segment data size. */
+    case 'j':
+      mss = atoi(optarg);
+      break;
+    /* Data bytes logged per segment. */
+    case 'k':
+      log_payload = atoi(optarg);
+      break;
+    /* Capture packets to a file. */
+    case 'v':
+      pcap_path = optarg;
+      break;
+    /* Bytes captured per packet. */
+    case 'h':
+      snaplen = atoi(optarg);
+      break;
+    /* Serve commands on a control socket. */
+    case 'M':
+      control_path = optarg;
+      break;
+    /* Dump the flight recorder on slow round trips. */
+    case 'T':
+      flight_threshold = atoi(optarg);
+      break;
     default:
       usage(progname);
       break;
@@ -1451,10 +3789,44 @@ int main(int argc , char *argv[]) {
   /* Seed RNG. */
   srand(seed);
 
+  /* The output buffer must hold at least one segment. Unless it was given,
+     it grows to fit larger ones. */
+  if (!buf_space_set)
+    buf_space = MAX(buf_space, (size_t) mss);
+
   /* Validate arguments. */
-  if ((is_client && is_server) || (!is_client && !is_server) || port <= 0) {
+  if ((is_client && is_server) || (!is_client && !is_server) || port <= 0 ||
+      num_shards < 1 || (is_client && num_shards > 1) ||
+      clients < 0 || clients > UINT_MAX ||
+      mss < MIN_MSS || mss > MAX_MSS ||
+      log_payload < 0 || log_payload > MAX_MSS ||
+      snaplen <= 0 || snaplen > IP_MAXPACKET ||
+      buf_space < (size_t) mss || (is_server && send_file != NULL)) {
     usage(progname);
   }
+  max_packet_size = FULL_HDR_SIZE + mss;
+  max_clients = clients;
+
+  /* Connections write to the file at their own offsets, so a server with
+     --recv-file cannot give the output to a program. Which clients it takes
+     at once is up to recv_file_admit(). */
+  if (is_server && recv_file != NULL && (argc - optind > 0 || num_shards > 1))
+    usage(progname);
+
+  /* Only a single-threaded server reads STDIN. */
+  if (broadcast && (is_client || argc - optind > 0 || num_shards > 1))
+    usage(progname);
+
+  /* Stripes are chunks of a file, sent all at once by processes of their
+     own, which cannot share a control socket. */
+  if (stripes < 1 ||
+      (stripes > 1 && (is_server || send_file == NULL || resume ||
+                       control_path != NULL)))
+    usage(progname);
+
+  /* A client resumes sending a file, and a server resumes receiving one. */
+  if (resume && (is_client ? send_file == NULL : recv_file == NULL))
+    usage(progname);
 
   /* Construct log file if logging is turned on. Don't create a file if not
      logging data, since that is only used for testing purposes. */
@@ -1465,26 +3837,44 @@ int main(int argc , char *argv[]) {
     memset(log_filename, 0, 40);
     snprintf(log_filename, sizeof(log_filename), "%d-%d.csv", (int) tv.tv_sec,
              port);
-    log_file = open(log_filename, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+    log_file = open(log_filename, O_CREAT | O_TRUNC | O_WRONLY | O_APPEND,
+                    0666);
     write_log_header(log_file);
   }
 
+  /* Likewise for the packet capture. */
+  if (pcap_path != NULL) {
+    pcap_file = open(pcap_path, O_CREAT | O_TRUNC | O_WRONLY | O_APPEND, 0666);
+    if (pcap_file < 0) {
+      fprintf(stderr, "[ERROR] Could not open %s\n", pcap_path);
+      return 1;
+    }
+    log_pcap_header(pcap_file, snaplen);
+  }
+
   /* Global configuration. */
   struct config cc;
   config = &cc;
 
+  /* Shards. The main thread runs the first one unless the server is started
+     with more than one thread. */
+  shards = calloc(num_shards, sizeof(struct shard));
+  for (i = 0; i < num_shards; i++)
+    shard_init(&shards[i]);
+  shard = &shards[0];
+
+  /* Dump the metrics to STDERR on SIGUSR1. The signal is blocked before any
+     threads are started, so only the signalfd sees it. */
+  signal_fd = metrics_signal_fd();
+
   /* CTCP config for students. */
   static ctcp_config_t cfg;
   ctcp_cfg = &cfg;
-  cfg.recv_window = window * MAX_SEG_DATA_SIZE;
-  cfg.send_window = window * MAX_SEG_DATA_SIZE;
+  cfg.recv_window = window * mss;
+  cfg.send_window = window * mss;
   cfg.timer = TIMER_INTERVAL;
   cfg.rt_timeout = RT_INTERVAL;
-
-  /* Used for polling later. */
-  struct pollfd _events[NUM_POLL + MAX_NUM_CLIENTS];
-  memset(_events, 0, sizeof(struct pollfd) * (NUM_POLL + MAX_NUM_CLIENTS));
-  events = _events;
+  cfg.mss = mss;
 
   /* Start client/server. */
   if (is_client) {
@@ -10,6 +10,11 @@
 #define CTCP_SYS_INTERNAL_H
 
 #include "ctcp.h"
+#include "ctcp_conn_table.h"
+#include "ctcp_event_loop.h"
+#include "ctcp_flight.h"
+#include "ctcp_log.h"
+#include "ctcp_metrics.h"
 #include "ctcp_sys.h"
 #include "ctcp_utils.h"
 
@@ -21,11 +26,9 @@
 /** Localhost IP address in_addr_t. */
 #define LOCALHOST 16777343
 
-/** Maximum number of clients that can connect to the server. */
-#define MAX_NUM_CLIENTS 10
-
-/** Default number of things to poll (stdin, stdout, socket). */
-#define NUM_POLL 3
+/** Default maximum number of clients that can connect to the server. Can be
+    changed with --max-clients, where 0 means there is no limit. */
+#define MAX_NUM_CLIENTS 65536
 
 /** Polling interval in milliseconds. */
 #define POLL_INTERVAL 20
@@ -44,6 +47,41 @@
 /** Connection timeout interval in seconds. */
 #define CONN_TIMEOUT 10
 
+/** How often a server with --resume records how much of its file is
+    complete, in milliseconds. */
+#define RESUME_INTERVAL 1000
+
+/** Suffix added to the --recv-file path to name the file holding the resume
+    checkpoint. */
+#define RESUME_SUFFIX ".resume"
+
+/** With --broadcast, how much input is read at a time into a buffer shared by
+    every client. */
+#define BROADCAST_BLOCK_SIZE (64 * MAX_SEG_DATA_SIZE)
+
+/** TCP option used by --resume. It is an experimental option (RFC 6994):
+    kind, length, and a 16-bit ExID. A SYN carries just that to ask where to
+    resume. The SYN-ACK adds the 64-bit offset to resume from. */
+#define TCP_OPT_EXP 254
+#define TCP_OPT_RESUME_EXID 0x6354
+#define TCP_OPT_RESUME_SYN_LEN 4
+#define TCP_OPT_RESUME_SYNACK_LEN 12
+
+/** TCP option used by --stripes, in the same format. A SYN carries the
+    offset its stripe starts at in the file, and a server that can place it
+    there (one with --recv-file) echoes the option in its SYN-ACK. */
+#define TCP_OPT_STRIPE_EXID 0x6353
+#define TCP_OPT_STRIPE_LEN 12
+
+/** TCP option carrying a window that does not fit in the header's 16 bits
+    (e.g. with jumbo segments), in the same format. SYNs and SYN-ACKs carry
+    the 32-bit window in it, next to an MSS option (see --mss). */
+#define TCP_OPT_WINDOW_EXID 0x6357
+#define TCP_OPT_WINDOW_LEN 8
+
+/** Room for the TCP options of a SYN or SYN-ACK. */
+#define TCP_OPT_MAX_LEN 40
+
 /////////////////////////////////// SYSTEM ////////////////////////////////////
 
 /** Pipe created by parent process. */
@@ -61,20 +99,38 @@
 #define CHILD_READ_FD (pipes[PARENT_WRITE_PIPE][READ_FD])
 #define CHILD_WRITE_FD (pipes[PARENT_READ_PIPE][WRITE_FD])
 
-/** Maximum space for buffering STDOUT for a given connection. */
+/** Default maximum space for buffering STDOUT for a given connection. Can be
+    changed with --buf-space. */
 #define MAX_BUF_SPACE 8192
 
+/** Number of writes to an output queue whose times are kept, to time how
+    long output waits in the queue (see --control). Once they are all in use,
+    later writes take the time of the last one. */
+#define OUT_QUEUE_STAMPS 32
+
 /**
- * Chunk of output. Used to do asynchronous output. A connection will store
- * a queue of chunks to be outputted later.
+ * Output queue. Used to do asynchronous output. Output that could not be
+ * written yet is stored in a ring of bytes as large as the maximum buffer
+ * space (or the pipe to a program, see conn_splice()), which is allocated the
+ * first time it is needed. Queuing output never allocates after that, and the
+ * number of bytes queued is always known.
  */
-struct chunk {
-  struct chunk *next;
-  size_t size;              /* Size of chunk, in bytes */
-  size_t used;              /* Amount of chunk already outputted */
-  char buf[1];              /* Data */
-} __attribute__((packed));
-typedef struct chunk chunk_t;
+struct out_queue {
+  char *buf;                /* Ring of bytes, NULL until first used */
+  size_t size;              /* Size of the ring */
+  size_t head;              /* Offset of the next byte to output */
+  size_t used;              /* Number of bytes waiting to be output */
+
+  uint64_t pushed;          /* Bytes ever queued */
+  uint64_t written;         /* Bytes ever written out */
+  struct {
+    uint64_t end;           /* Value of pushed after the write */
+    uint64_t time;          /* When the write was queued, in us */
+  } stamps[OUT_QUEUE_STAMPS];
+  unsigned int stamp_head;  /* Oldest stamp */
+  unsigned int stamp_tail;  /* Next free stamp */
+};
+typedef struct out_queue out_queue_t;
 
 
 /**
@@ -93,15 +149,24 @@ int async(int fd) {
 }
 
 /**
- * Gets the current time and stores it into the provided timespec object.
+ * Gets the current time and stores it into the provided timespec object. The
+ * clock never jumps, so this is only good for measuring intervals.
  *
  * ts: Timespec object to store result.
  */
 void get_time(struct timespec *ts) {
+  clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+/**
+ * Returns the time of day in microseconds, for timestamps that are written
+ * out (segment logs and packet captures). Intervals are measured with
+ * current_time_us() instead.
+ */
+uint64_t time_of_day_us() {
   struct timeval tv;
   gettimeofday(&tv, NULL);
-  ts->tv_sec = tv.tv_sec;
-  ts->tv_nsec = tv.tv_usec * 1000;
+  return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
 }
 
 /**
@@ -144,8 +209,11 @@ typedef struct tcphdr tcphdr_t;
 #define TCP_HDR_SIZE sizeof(tcphdr_t)
 #define FULL_HDR_SIZE (sizeof(iphdr_t) + sizeof(tcphdr_t))
 
-/** Maximum packet size (data and headers). */
-#define MAX_PACKET_SIZE (1440 + sizeof(iphdr_t) + sizeof(tcphdr_t))
+/** Range of MSS that can be set with --mss. Packets must fit in the 16-bit IP
+    length. An MSS larger than MAX_SEG_DATA_SIZE (jumbo segments) is only
+    allowed over Unix sockets. */
+#define MIN_MSS 64
+#define MAX_MSS (IP_MAXPACKET - FULL_HDR_SIZE)
 
 /** TCP pseudoheader, used in checksum calculations. */
 struct tcp_pseudoheader {
@@ -282,29 +350,107 @@ struct conn {
 
   int stdin;                   /* STDIN for the program */
   int stdout;                  /* STDOUT for the program */
-  struct pollfd *poll_fd;      /* Used for polling for output from program */
+  ev_handler_t stdin_handler;  /* Used for waiting until the program can
+                                  take more input */
+  ev_handler_t stdout_handler; /* Used for waiting for output from program */
 
   bool read_eof;               /* EOF read from STDIN */
+  bool input_drained;          /* conn_input() found no input left */
+  bool input_paused;           /* Input not watched until it runs dry */
   bool wrote_eof;              /* EOF wrote to STDOUT */
   bool wrote_err;              /* Error writing to STDOUT */
   bool delete_me;              /* Whether or not to delete this object. */
-
-  chunk_t *out_queue;          /* Queue for output to STDOUT */
-  chunk_t **out_queue_tail;    /* End of the output queue */
+  int slot;                    /* Slot in the connection table */
+
+  out_queue_t out_queue;       /* Queue for output to STDOUT */
+  ev_op_t *write_op;           /* Write from the output queue in progress
+                                  (io_uring only) */
+  bool splice;                 /* Output is spliced into the program's pipe */
+  size_t in_pipe;              /* Bytes at the front of the output queue that
+                                  are in the program's pipe (splice only) */
+  off_t recv_base;             /* Where this connection's output starts in
+                                  the --recv-file file */
+  bool resume;                 /* Client asked where to resume (--resume) */
+  bool striped;                /* Client is sending one stripe of a file
+                                  (--stripes) */
+  size_t bcast_pos;            /* How much of the --broadcast buffer this
+                                  connection has taken */
+  uint32_t delivered;          /* Bytes of output acked to the other host,
+                                  so known to be in the file (--resume) */
+  bool flush_pending;          /* On the shard's flush list */
+  bool output_later;           /* ctcp_output() is to be called when the
+                                  flush list is written out */
+  struct conn *next_flush;     /* Linked list of connections with output to
+                                  write out */
+
+  metrics_t metrics;           /* Counters for this connection (see
+                                  --control) */
+  histogram_t *timings[NUM_TIMINGS]; /* Histograms for this connection,
+                                        allocated when first used */
+  uint32_t highest_seqno_sent; /* Sequence number after the last data byte
+                                  sent */
+  uint32_t highest_ackno;      /* Highest ack number received */
+  long last_active;            /* When a segment was last sent or received,
+                                  in ms (see the "conns" command) */
+  flight_t flight;             /* Recent events (see ctcp_flight.h) */
+  uint32_t flight_dumped;      /* flight.next when the events were last dumped
+                                  for a slow round trip */
 
   struct conn *next;           /* Linked list of connections */
   struct conn **prev;
+  struct conn *next_delete;    /* Linked list of connections to delete */
 };
 typedef struct conn conn_t;
 
 
 /**
- * Add to the conn_t list.
+ * Add to the conn_t list and the connection table.
  *
- * conn_list: Pointer to linked list of conn_t objects.
  * conn: The new conn_t to add.
+ * returns: 0 on success, -1 if the maximum number of connections is reached.
  */
-void conn_add(conn_t *conn);
+int conn_add(conn_t *conn);
+
+/**
+ * Drain the output queue.
+ *
+ * conn: Associated connection object.
+ */
+void conn_drain(conn_t *conn);
+
+/**
+ * Puts a connection on the shard's flush list.
+ *
+ * conn: Associated connection object.
+ */
+void conn_flush_later(conn_t *conn);
+
+/**
+ * Interprets the result of reading input for a connection.
+ *
+ * conn: The connection object.
+ * r: Result of read() or readv().
+ * buf: The (first) buffer that was read into.
+ * returns: What conn_input() returns.
+ */
+int input_result(conn_t *conn, int r, const char *buf);
+
+/**
+ * [Server only]
+ * Removes the bytes the program has read from its pipe from the front of the
+ * output queue, once the queue is half full.
+ *
+ * conn: Associated connection object.
+ */
+void conn_reclaim(conn_t *conn);
+
+/**
+ * [Server only]
+ * Records how much of the --recv-file file is complete, for --resume.
+ *
+ * conn: The connection writing to the file.
+ */
+void write_checkpoint(conn_t *conn);
 
 /**
  * Set up a conn_t object with the right values.
@@ -404,11 +550,6 @@ in_addr_t ip_from_hostname(char *hostname) {
 
 /////////////////////////////////// LOGGING ////////////////////////////////////
 
-#define LOG_SIZE (4 * MAX_SEG_DATA_SIZE)
-#define LOG_ENTRY_SIZE 20
-#define ADDR_FORMAT_STR "%s\t%d\t%s\t%d\t"
-#define LOCALHOST_STR "localhost"
-
 /** Headers for the log file. */
 #define LOG_HEADERS "Timestamp\tSource IP\tSource Port\tDestination IP\tDestination Port\tSequence Number\tAcknowledgement Number\tLength\tFlags\tWindow\tChecksum\tData\n"
 
@@ -416,119 +557,123 @@ in_addr_t ip_from_hostname(char *hostname) {
 #define DEBUG_TEARDOWN "###teardown###\n"
 
 /**
- * Format the IP addresses and ports for the logger into the provided buffer.
+ * Logs a segment sent or received. Logged output is of the form:
+ *    time fromIP fromPort toIP toPort seqno ackno len flags window cksum data
  *
+ * With a ring, the segment is only copied into it, with at most
+ * log_ring_payload() bytes of its data, and the writer thread writes it out
+ * later (see ctcp_log.h). Otherwise it is written out right away, with all of
+ * its data.
+ *
+ * file: File to output to.
+ * ring: Ring to add the segment to, or NULL.
  * ip_addr: The logger's IP address.
  * port: The logger's port.
  * conn: The other's connection details.
+ * segment: Segment to log. Only the header is used.
+ * data: The segment's data.
  * is_sent_segment: Whether or not this is logging a segment sent by the logger.
  * is_unix_socket: Whether or not the connection is via a Unix socket.
- * buf: Buffer to write formatted IP addresses and ports.
  */
-void format_addresses(in_addr_t ip_addr, int port, conn_t *conn,
-                      bool is_sent_segment, bool is_unix_socket, char *buf) {
-  if (!is_unix_socket) {
-    char this_ip_addr[INET_ADDRSTRLEN];
-    char other_ip_addr[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &ip_addr, this_ip_addr, 100);
-    inet_ntop(AF_INET, &(conn->ip_addr), other_ip_addr, 100);
-
-    if (is_sent_segment) {
-      snprintf(buf, 5 * LOG_ENTRY_SIZE, ADDR_FORMAT_STR, this_ip_addr, port,
-               other_ip_addr, conn->port);
-    }
-    else {
-      snprintf(buf, 5 * LOG_ENTRY_SIZE, ADDR_FORMAT_STR, other_ip_addr,
-               conn->port, this_ip_addr, port);
-    }
+void log_segment(int file, log_ring_t *ring, in_addr_t ip_addr, int port,
+                 conn_t *conn, ctcp_segment_t *segment, const char *data,
+                 bool is_sent_segment, bool is_unix_socket) {
+  size_t data_len = ntohs(segment->len) > sizeof(ctcp_segment_t) ?
+                    ntohs(segment->len) - sizeof(ctcp_segment_t) : 0;
+  log_record_t *rec;
+
+  if (ring != NULL) {
+    rec = log_ring_reserve(ring);
+    if (rec == NULL)
+      return;
+    data_len = MIN(data_len, log_ring_payload(ring));
   }
-
-  /** Just print "localhost" for Unix sockets. */
   else {
-    if (is_sent_segment) {
-      snprintf(buf, 5 * LOG_ENTRY_SIZE, ADDR_FORMAT_STR, LOCALHOST_STR, port,
-               LOCALHOST_STR, conn->port);
-    }
-    else {
-      snprintf(buf, 5 * LOG_ENTRY_SIZE, ADDR_FORMAT_STR, LOCALHOST_STR,
-               conn->port, LOCALHOST_STR, port);
-    }
+    rec = malloc(sizeof(log_record_t) + data_len);
   }
-}
 
-/**
- * Creates a hex dump of data.
- *
- * from: Data to create hex dump.
- * to: Location to write output of dump.
- * len: Length of data.
- */
-void hex_dump(unsigned char *from, char *to, int len) {
-  snprintf(to, 2, "\t");
-  to++;
+  rec->time = time_of_day_us();
+  if (is_sent_segment) {
+    rec->src_ip = ip_addr;
+    rec->src_port = port;
+    rec->dst_ip = conn->ip_addr;
+    rec->dst_port = conn->port;
+  }
+  else {
+    rec->src_ip = conn->ip_addr;
+    rec->src_port = conn->port;
+    rec->dst_ip = ip_addr;
+    rec->dst_port = port;
+  }
+  rec->localhost = is_unix_socket;
+  rec->flags = segment->flags;
+  rec->len = ntohs(segment->len);
+  rec->seqno = ntohl(segment->seqno);
+  rec->ackno = ntohl(segment->ackno);
+  rec->window = ntohs(segment->window);
+  rec->cksum = segment->cksum;
+  rec->data_len = data_len;
+  memcpy(rec->data, data, data_len);
+
+  if (ring != NULL) {
+    log_ring_commit(ring);
+    return;
+  }
 
-  /* Loop through all bytes in the data. */
-  int i;
-  for (i = 0; i < len; i++) {
-    snprintf(to + i * 3, 4, "%02x ", from[i]);
+  /* Write it out, or log it for the tester (without the data). */
+  char *buf = malloc(LOG_LINE_SIZE(data_len));
+  if (!test_debug_on) {
+    write(file, buf, log_format(rec, true, buf));
+  }
+  else {
+    log_format(rec, false, buf);
+    fprintf(stderr, "!!!%s!!!\n", buf);
   }
-  snprintf(to + i * 3, 2, "\n");
+  free(buf);
+  free(rec);
 }
 
 /**
- * Logs a segment sent or received. Logged output is of the form:
- *    time fromIP fromPort toIP toPort seqno ackno len flags window cksum data
+ * Captures a packet sent or received (see --pcap).
  *
- * file: File to output to.
- * ip_addr: The logger's IP address.
- * port: The logger's port.
- * conn: The other's connection details.
- * segment: Segment to log.
- * len: Length of the segment, including headers.
- * is_sent_segment: Whether or not this is logging a segment sent by the logger.
- * is_unix_socket: Whether or not the connection is via a Unix socket.
+ * With a ring, the first log_ring_payload() bytes of the packet are copied
+ * into it, and the writer thread writes them out later. Otherwise they are
+ * written out right away.
+ *
+ * file: The pcap file.
+ * ring: Ring to add the packet to, or NULL.
+ * snaplen: Most bytes to capture.
+ * pkt: The packet, starting with its IP header.
+ * len: Length of the packet.
  */
-void log_segment(int file, in_addr_t ip_addr, int port, conn_t *conn,
-                 ctcp_segment_t *segment, uint16_t len, bool is_sent_segment,
-                 bool is_unix_socket) {
-  /* Create output buffer and write IP addresses and ports. */
-  char buf[LOG_SIZE];
-  memset(buf, 0, LOG_SIZE);
-
-  /* Timestamp. */
-  snprintf(buf, LOG_ENTRY_SIZE, "%lu\t", current_time());
-
-  /* Source and destination. */
-  format_addresses(ip_addr, port, conn, is_sent_segment, is_unix_socket,
-                   buf + strlen(buf));
-
-  /* Sequence number, ack number, length. */
-  snprintf(buf + strlen(buf), 5 * LOG_ENTRY_SIZE, "%d\t%d\t%d\t",
-           ntohl(segment->seqno), ntohl(segment->ackno), ntohs(segment->len));
-
-  /* TCP flags. */
-  if (segment->flags & TH_SYN)
-    snprintf(buf + strlen(buf), 5, "SYN ");
-  if (segment->flags & TH_ACK)
-    snprintf(buf + strlen(buf), 5, "ACK ");
-  if (segment->flags & TH_FIN)
-    snprintf(buf + strlen(buf), 5, "FIN ");
-
-  /* Window and checksum. */
-  snprintf(buf + strlen(buf), LOG_ENTRY_SIZE, "\t%d\t0x%x",
-           ntohs(segment->window), segment->cksum);
-
-  /* Data. */
-  if (!test_debug_on) {
-    hex_dump((unsigned char *) segment->data,
-             buf + strlen(buf),
-             ntohs(segment->len) - sizeof(ctcp_segment_t));
-    write(file, buf, strlen(buf));
+void capture_packet(int file, log_ring_t *ring, size_t snaplen,
+                    const char *pkt, uint16_t len) {
+  size_t data_len = MIN(len, snaplen);
+  log_record_t *rec;
+
+  if (ring != NULL) {
+    rec = log_ring_reserve(ring);
+    if (rec == NULL)
+      return;
   }
-  /* Log data for the tester. */
   else {
-    fprintf(stderr, "!!!%s!!!\n", buf);
+    rec = malloc(sizeof(log_record_t) + data_len);
   }
+
+  rec->time = time_of_day_us();
+  rec->len = len;
+  rec->data_len = data_len;
+  memcpy(rec->data, pkt, data_len);
+
+  if (ring != NULL) {
+    log_ring_commit(ring);
+    return;
+  }
+
+  char *buf = malloc(PCAP_RECORD_SIZE(data_len));
+  write(file, buf, log_format_pcap(rec, buf));
+  free(buf);
+  free(rec);
 }
 
 /**
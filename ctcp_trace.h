@@ -0,0 +1,64 @@
+/******************************************************************************
+ * ctcp_trace.h
+ * ------------
+ * Static tracepoints (USDT) at the protocol's hot paths, for perf and
+ * bpftrace. A probe is a single nop until a tracer attaches to it, so they are
+ * always compiled in when <sys/sdt.h> (from systemtap) is available, and
+ * compiled out otherwise or when built with -DCTCP_NO_TRACE. List them with
+ *     readelf -n ctcp
+ * or `bpftrace -l 'usdt:./ctcp:*'`. See trace/ for example scripts.
+ *
+ * Probes, all in the "ctcp" provider. conn is the conn_t pointer, which tells
+ * connections apart.
+ *   conn_create(conn, port)                   A connection was set up
+ *   conn_destroy(conn, bytes_sent, bytes_received)
+ *                                             A connection was torn down
+ *   conn_send(conn, seqno, ackno, len, flags) A segment was handed to the
+ *                                             network (len is data bytes)
+ *   filter_drop(port, len, reason)            A packet was dropped before it
+ *                                             reached a connection (see
+ *                                             FILTER_* below)
+ *   receive(conn, seqno, ackno, len, flags)   ctcp_receive() was called (len
+ *                                             is the segment length)
+ *   receive_accept(conn, seqno, len)          A segment passed the length,
+ *                                             checksum and window checks
+ *   receive_drop(conn, seqno, reason)         A segment was thrown away
+ *                                             (reason is a conn_event_t)
+ *   send_segment(conn, seqno, len, is_retransmit)
+ *                                             ctcp_send_segment() sent a
+ *                                             segment with len data bytes
+ *   output(conn, seqno, len)                  Data was delivered to the
+ *                                             output
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_TRACE_H
+#define CTCP_TRACE_H
+
+/** Why filter_drop fired. */
+#define FILTER_SHORT    1      /* Too short to hold the headers */
+#define FILTER_PORT     2      /* Not to this host's port */
+#define FILTER_UNKNOWN  3      /* Not from a connection, or from before it */
+
+#if !defined(CTCP_NO_TRACE) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define CTCP_TRACE_ENABLED
+#endif
+#endif
+
+/**
+ * Fires a probe. The arguments are only evaluated when the probe is compiled
+ * in, and should be cheap: they are worked out whether or not a tracer is
+ * attached.
+ *
+ * name: Name of the probe.
+ * ...: Its arguments, at most 12.
+ */
+#ifdef CTCP_TRACE_ENABLED
+#define CTCP_TRACE(name, ...) STAP_PROBEV(ctcp, name, ##__VA_ARGS__)
+#else
+#define CTCP_TRACE(name, ...) do {} while (0)
+#endif
+
+#endif /* CTCP_TRACE_H */
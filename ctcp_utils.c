@@ -16,10 +16,66 @@ uint16_t cksum(const void *_data, uint16_t len) {
   return sum ? sum : 0xffff;
 }
 
+uint16_t cksum_iov(const struct iovec *iov, int iovcnt) {
+  uint32_t sum = 0;
+  bool odd = false;
+  int i;
+
+  for (i = 0; i < iovcnt; i++) {
+    const uint8_t *data = iov[i].iov_base;
+    size_t len = iov[i].iov_len;
+
+    /* The previous buffer ended halfway through a word. */
+    if (odd && len > 0) {
+      sum += data[0];
+      data++;
+      len--;
+      odd = false;
+    }
+    for (; len >= 2; data += 2, len -= 2) {
+      sum += (data[0] << 8) | data[1];
+    }
+    if (len > 0) {
+      sum += data[0] << 8;
+      odd = true;
+    }
+
+    while (sum > 0xffff) {
+      sum = (sum >> 16) + (sum & 0xffff);
+    }
+  }
+  sum = htons(~sum);
+  return sum ? sum : 0xffff;
+}
+
+shared_buf_t *shared_buf_new(size_t len) {
+  shared_buf_t *buf = malloc(sizeof(shared_buf_t) + len);
+  if (buf == NULL)
+    return NULL;
+  buf->refs = 1;
+  buf->len = len;
+  return buf;
+}
+
+void shared_buf_ref(shared_buf_t *buf) {
+  buf->refs++;
+}
+
+void shared_buf_unref(shared_buf_t *buf) {
+  if (buf != NULL && --buf->refs == 0)
+    free(buf);
+}
+
 long current_time() {
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t current_time_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
 void print_hdr_ctcp(ctcp_segment_t *segment) {
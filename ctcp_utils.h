@@ -26,10 +26,59 @@
 uint16_t cksum(const void *_data, uint16_t len);
 
 /**
- * Gets the current time in milliseconds.
+ * Like cksum(), but computes the checksum over several buffers as if they
+ * were one contiguous buffer. Use this to checksum a header and data that are
+ * stored apart.
+ *
+ * iov: Buffers to compute checksum over.
+ * iovcnt: Number of buffers.
+ *
+ * returns: The checksum in network-byte order.
+ */
+uint16_t cksum_iov(const struct iovec *iov, int iovcnt);
+
+/**
+ * A reference-counted buffer. It is freed when the last reference is given
+ * up. Not thread-safe, so a buffer must only be used by one thread.
+ */
+struct shared_buf {
+  unsigned int refs;  /* Number of references */
+  size_t len;         /* Length of the data */
+  char data[];        /* The data */
+};
+
+/**
+ * Allocates a shared buffer, with one reference.
+ *
+ * len: Size of the buffer.
+ *
+ * returns: The new buffer, or NULL if out of memory.
+ */
+shared_buf_t *shared_buf_new(size_t len);
+
+/**
+ * Takes another reference to a shared buffer.
+ */
+void shared_buf_ref(shared_buf_t *buf);
+
+/**
+ * Gives up a reference to a shared buffer, and frees it if that was the last
+ * one. Does nothing if buf is NULL.
+ */
+void shared_buf_unref(shared_buf_t *buf);
+
+/**
+ * Gets the current time in milliseconds, from a clock that never jumps (not
+ * the time of day), so it is only good for measuring intervals.
  */
 long current_time();
 
+/**
+ * Gets the current time in microseconds, from the same clock as
+ * current_time().
+ */
+uint64_t current_time_us();
+
 /**
  * Prints out the headers of a cTCP segment. Expects the segment to come in
  * network-byte order. All fields are converted and printed out in host order,
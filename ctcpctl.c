@@ -0,0 +1,98 @@
+/******************************************************************************
+ * ctcpctl.c
+ * ---------
+ * Sends a command to the control socket of a running ctcp (see --control)
+ * and prints the response. With -i, sends it again every so many seconds,
+ * like watch(1), until interrupted.
+ *
+ * Usage:
+ *     ./ctcpctl [-i seconds] SOCKET [command]
+ *
+ * The command defaults to "conns", which lists the connections. An unknown
+ * command gets the list of commands.
+ *
+ *****************************************************************************/
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/**
+ * Sends a command and copies the response to STDOUT.
+ *
+ * path: Path of the control socket.
+ * command: The command.
+ * returns: 0 on success, -1 on failure.
+ */
+static int run_command(const char *path, const char *command) {
+  struct sockaddr_un addr;
+  char buf[4096];
+  ssize_t r;
+  int fd;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "ctcpctl: %s: path too long\n", path);
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    perror(path);
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+
+  /* One line per command. Shutting down the write side tells ctcp the
+     command is complete even if it was cut short. */
+  dprintf(fd, "%s\n", command);
+  shutdown(fd, SHUT_WR);
+  while ((r = read(fd, buf, sizeof(buf))) > 0)
+    fwrite(buf, 1, r, stdout);
+  fflush(stdout);
+  close(fd);
+  return r < 0 ? -1 : 0;
+}
+
+static void usage(const char *progname) {
+  fprintf(stderr, "Usage: %s [-i seconds] SOCKET [command]\n", progname);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+  const char *command = "conns";
+  int interval = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "i:")) != -1) {
+    switch (opt) {
+    case 'i':
+      interval = atoi(optarg);
+      if (interval <= 0)
+        usage(argv[0]);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (argc - optind < 1 || argc - optind > 2)
+    usage(argv[0]);
+  if (argc - optind == 2)
+    command = argv[optind + 1];
+
+  while (true) {
+    if (run_command(argv[optind], command) < 0)
+      return EXIT_FAILURE;
+    if (interval == 0)
+      return EXIT_SUCCESS;
+    sleep(interval);
+    printf("\n");
+  }
+}
@@ -0,0 +1,127 @@
+#!/bin/bash
+
+# Connects many clients to a single server and reports how much memory and CPU
+# time the server uses per connection.
+#
+# Usage: ./load_test.sh [num_clients] [idle_seconds]
+#
+# Clients are started with their STDIN attached to a FIFO that is held open but
+# never written to, so every connection stays established while the server is
+# measured. Each client is its own process, and an idle client still wakes up
+# for its timer every TIMER_INTERVAL ms, so thousands of them would use all the
+# CPU the server is being measured on. Clients are started in batches instead,
+# and each batch is stopped (SIGSTOP) once all of it has connected. The script
+# raises its process limit as far as it can. Make sure the hard limit
+# (`ulimit -Hu`) has room for the clients before running with 10000 of them:
+#
+#   sudo ./load_test.sh 1000
+#   sudo ./load_test.sh 10000 30
+
+num_clients=${1:-1000}
+idle_seconds=${2:-10}
+batch_size=100
+server_port=8888
+first_client_port=20000
+executable=./ctcp
+
+fifo=$(mktemp -u /tmp/ctcp_load.XXXXXX)
+server_log=$(mktemp /tmp/ctcp_load_server.XXXXXX)
+ticks_per_second=$(getconf CLK_TCK)
+
+make CFLAGS="${CFLAGS:--g -Wall -Werror -pthread}" >/dev/null || exit 1
+ulimit -S -u $(ulimit -H -u)
+
+# Prints the resident memory of a process in KB.
+rss_kb() {
+  awk '/^VmRSS/ { print $2 }' /proc/$1/status
+}
+
+# Prints the CPU time (user + system) used by a process in clock ticks.
+cpu_ticks() {
+  awk '{ print $14 + $15 }' /proc/$1/stat
+}
+
+cleanup() {
+  kill $client_pids $server_pid 2>/dev/null
+  kill -CONT $client_pids 2>/dev/null
+  exec 3>&-
+  rm -f $fifo $server_log
+}
+trap cleanup EXIT
+
+###############################################################################
+# Start the server and record how much it uses with no clients.
+###############################################################################
+
+$executable -s -p $server_port --max-clients $num_clients \
+  > /dev/null 2> $server_log &
+server_pid=$!
+sleep 2 # Give server time to start up
+
+rss_idle=$(rss_kb $server_pid)
+cpu_idle=$(cpu_ticks $server_pid)
+
+###############################################################################
+# Connect the clients.
+###############################################################################
+
+mkfifo $fifo
+exec 3<> $fifo
+
+echo "Connecting $num_clients clients..."
+start=$(date +%s)
+client_pids=""
+connected=0
+for ((i = 0; i < num_clients; i += batch_size)); do
+  batch_pids=""
+  for ((j = i; j < num_clients && j < i + batch_size; j++)); do
+    $executable -p $((first_client_port + j)) -c localhost:$server_port \
+      < $fifo > /dev/null 2>&1 &
+    batch_pids="$batch_pids $!"
+  done
+  client_pids="$client_pids $batch_pids"
+
+  # Wait for the batch to connect, then stop it.
+  batch_start=$(date +%s)
+  while [ "$connected" -lt "$j" ]; do
+    sleep 0.1
+    connected=$(grep -c "Client connected" $server_log)
+    if [ $(($(date +%s) - batch_start)) -gt 60 ]; then
+      break
+    fi
+  done
+  kill -STOP $batch_pids
+  if [ "$connected" -lt "$j" ]; then
+    echo "Timed out with $connected of $num_clients clients connected"
+    break
+  fi
+done
+connect_seconds=$(($(date +%s) - start))
+
+rss_loaded=$(rss_kb $server_pid)
+cpu_loaded=$(cpu_ticks $server_pid)
+
+###############################################################################
+# Let the connections sit idle and measure CPU usage.
+###############################################################################
+
+sleep $idle_seconds
+cpu_after_idle=$(cpu_ticks $server_pid)
+
+###############################################################################
+# Results.
+###############################################################################
+
+awk -v n=$connected -v secs=$connect_seconds -v idle=$idle_seconds \
+    -v hz=$ticks_per_second \
+    -v rss0=$rss_idle -v rss1=$rss_loaded \
+    -v cpu0=$cpu_idle -v cpu1=$cpu_loaded -v cpu2=$cpu_after_idle '
+BEGIN {
+  if (n == 0) { print "No clients connected"; exit 1 }
+  printf "clients connected:            %d (in %d s)\n", n, secs
+  printf "server RSS:                   %d KB -> %d KB\n", rss0, rss1
+  printf "memory per connection:        %.1f KB\n", (rss1 - rss0) / n
+  printf "CPU to connect, per client:   %.3f ms\n", (cpu1 - cpu0) * 1000 / hz / n
+  printf "idle CPU, per client:         %.3f ms/s\n", \
+         (cpu2 - cpu1) * 1000 / hz / idle / n
+}'